@@ -1,5 +1,7 @@
 #include "address.h"
 #include "log.h"
+#include "config.h"
+#include "offload.h"
 #include <sstream>
 #include <netdb.h>
 #include <ifaddrs.h>
@@ -10,6 +12,10 @@ namespace sylar {
 
 static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 
+/// getaddrinfo会阻塞线程(DNS查询), 在协程中调用时是否交给offload线程池
+static sylar::ConfigVar<bool>::ptr g_offload_getaddrinfo =
+    sylar::Config::Lookup("offload.getaddrinfo", false, "offload getaddrinfo to thread pool");
+
 /// 创建掩码
 template<class T>
 static T CreateMask(uint32_t bits) {
@@ -78,7 +84,21 @@ bool Address::Lookup(std::vector<Address::ptr>& result, const std::string& host,
         node = host;
     }
 
-    int error = getaddrinfo(node.c_str(), service, &hints, &results);
+    int error = 0;
+    if(g_offload_getaddrinfo->getValue() && Scheduler::GetTaskScheduler()) {
+        // 参数复制一份, 协程切出后线程池不访问协程栈
+        bool has_service = service != NULL;
+        std::string svc = has_service ? service : "";
+        std::pair<int, addrinfo*> rt = Offload([node, svc, has_service, hints]() {
+            addrinfo* res = NULL;
+            int err = getaddrinfo(node.c_str(), has_service ? svc.c_str() : NULL, &hints, &res);
+            return std::make_pair(err, res);
+        });
+        error = rt.first;
+        results = rt.second;
+    } else {
+        error = getaddrinfo(node.c_str(), service, &hints, &results);
+    }
     if(error) {
         SYLAR_LOG_DEBUG(g_logger) << "Address::Lookup getaddress(" << host << ", "
             << family << ", " << type << ") err=" << error << " errstr="
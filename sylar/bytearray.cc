@@ -1,21 +1,258 @@
 #include "bytearray.h"
 #include "log.h"
+#include "config.h"
+#include <atomic>
+#include <new>
 #include <fstream>
 #include <sstream>
 #include <iomanip>
 #include <cstring>
 #include "endian.h"
 #include <cmath>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
 namespace sylar {
 
 static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 
-ByteArray::Node::Node(size_t s) : ptr(new char[s]), next(nullptr), size(s){}
-ByteArray::Node::Node() : ptr(nullptr), next(nullptr), size(0) {}
+static sylar::ConfigVar<uint64_t>::ptr g_node_cache_bytes =
+    sylar::Config::Lookup<uint64_t>("bytearray.node_cache_bytes", 1024 * 1024
+            , "bytearray per-thread free node cache bytes");
+
+/// 每个线程最多缓存的空闲结点字节数, 0表示不缓存
+static uint64_t s_node_cache_bytes = 0;
+
+struct _ByteArrayIniter {
+    _ByteArrayIniter() {
+        s_node_cache_bytes = g_node_cache_bytes->getValue();
+        g_node_cache_bytes->addListener([](const uint64_t& old_value, const uint64_t& new_value){
+            SYLAR_LOG_INFO(g_logger) << "bytearray node cache bytes changed from "
+                                     << old_value << " to " << new_value;
+            s_node_cache_bytes = new_value;
+        });
+    }
+};
+static _ByteArrayIniter s_bytearray_initer;
+
+/**
+ * 内存布局: Slab | Node * count | 对齐 | 内存块 * count
+ * 结点和内存块一次分配; 结点可能在其他线程释放, 引用计数是原子的
+ * 映射文件的结点单独一个slab, 内存块是整个映射
+ */
+struct ByteArray::Slab {
+    std::atomic<size_t> ref;
+    /// 每个结点的内存块大小, 切片结点为0
+    size_t chunk;
+    /// 内存块是mmap的文件, 释放时munmap
+    bool mapped;
+    /// 整个slab分配的字节数, 缓存它的结点时按这个计入node_cache_bytes
+    size_t bytes;
+};
+
+/// 内存块的对齐
+static const size_t SLAB_ALIGN = 16;
+
+/// 同一个slab的所有结点都释放后回收
+static void ReleaseNode(ByteArray::Node* node) {
+    ByteArray::Slab* slab = node->slab;
+    if(--slab->ref == 0) {
+        if(slab->mapped) {
+            munmap(node->ptr, slab->chunk);
+        }
+        slab->~Slab();
+        ::operator delete(slab);
+    }
+}
 
-ByteArray::Node::~Node() {
-    if (ptr)
-        delete[] ptr;
+/**
+ * @brief 线程本地的空闲结点链表, 按结点大小分组
+ * @details POD, 没有析构函数, 线程退出时由NodeCacheCleaner归还;
+ *          之后(其他thread_local对象析构时)释放的结点直接回收
+ *          缓存的结点持有slab, 只缓存slab中最后一个在用的结点, 按整个slab的大小计数
+ */
+struct NodeCache {
+    static const size_t MAX_SIZES = 4;
+    struct Bucket {
+        size_t size;
+        size_t count;
+        ByteArray::Node* head;
+    };
+    Bucket buckets[MAX_SIZES];
+    /// 缓存的结点所在slab的总字节数
+    uint64_t bytes;
+    /// 是否已经注册了线程退出时的回收
+    bool registered;
+    /// 线程正在退出
+    bool closed;
+};
+static thread_local NodeCache t_node_cache;
+
+struct NodeCacheCleaner {
+    ~NodeCacheCleaner() {
+        NodeCache& cache = t_node_cache;
+        for(auto& b : cache.buckets) {
+            while(b.head) {
+                ByteArray::Node* node = b.head;
+                b.head = node->next;
+                ReleaseNode(node);
+            }
+            b.count = 0;
+        }
+        cache.bytes = 0;
+        cache.closed = true;
+    }
+};
+static thread_local NodeCacheCleaner t_node_cache_cleaner;
+
+/// 放入空闲链表, 缓存已满时返回false
+static bool CacheNode(ByteArray::Node* node) {
+    NodeCache& cache = t_node_cache;
+    ByteArray::Slab* slab = node->slab;
+    // 同一个slab还有其他结点在用时slab不会被回收, 直接释放这个结点;
+    // 否则缓存的小结点会拖住整个slab(例如reserve分配的一大块)
+    if(cache.closed || slab->ref.load(std::memory_order_acquire) != 1
+            || cache.bytes + slab->bytes > s_node_cache_bytes) {
+        return false;
+    }
+    NodeCache::Bucket* bucket = nullptr;
+    for(auto& b : cache.buckets) {
+        if(b.size == node->size) {
+            bucket = &b;
+            break;
+        }
+        if(!bucket && b.count == 0) {
+            bucket = &b;
+        }
+    }
+    if(!bucket) {
+        return false;
+    }
+    if(!cache.registered) {
+        // 第一次放入结点时注册线程退出的回收, 空的分组大小是0, 切片结点会直接匹配上
+        (void)&t_node_cache_cleaner;
+        cache.registered = true;
+    }
+    bucket->size = node->size;
+    node->next = bucket->head;
+    bucket->head = node;
+    ++bucket->count;
+    cache.bytes += slab->bytes;
+    return true;
+}
+
+/// 从空闲链表中取最多count个结点, 接在*tail后面
+static size_t TakeCachedNodes(size_t size, size_t count, ByteArray::Node** tail) {
+    NodeCache& cache = t_node_cache;
+    for(auto& b : cache.buckets) {
+        if(b.size != size || b.count == 0) {
+            continue;
+        }
+        size_t n = 0;
+        while(n < count && b.head) {
+            ByteArray::Node* node = b.head;
+            b.head = node->next;
+            node->next = nullptr;
+            cache.bytes -= node->slab->bytes;
+            *tail = node;
+            tail = &node->next;
+            ++n;
+        }
+        b.count -= n;
+        return n;
+    }
+    return 0;
+}
+
+/**
+ * @brief 释放结点的一个引用, 最后一个引用释放时回收
+ * @details 切片结点同时释放它引用的结点; 被截短的结点恢复原来的大小
+ */
+static void UnrefNode(ByteArray::Node* node) {
+    if(node->ref.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return;
+    }
+    if(node->source) {
+        UnrefNode(node->source);
+        node->source = nullptr;
+        node->ptr = nullptr;
+    }
+    node->size = node->slab->chunk;
+    node->next = nullptr;
+    node->ref.store(1, std::memory_order_relaxed);
+    if(node->slab->mapped || !CacheNode(node)) {
+        ReleaseNode(node);
+    }
+}
+
+ByteArray::Node::Node() : ptr(nullptr), next(nullptr), size(0), slab(nullptr)
+    ,ref(1), source(nullptr) {}
+
+ByteArray::Node* ByteArray::AllocNodes(size_t size, size_t count, Node*& last) {
+    Node* first = nullptr;
+    size_t cached = TakeCachedNodes(size, count, &first);
+    last = first;
+    while(last && last->next) {
+        last = last->next;
+    }
+    if(cached == count) {
+        return first;
+    }
+
+    // 剩下的结点一次分配
+    count -= cached;
+    size_t head = sizeof(Slab) + count * sizeof(Node);
+    head = (head + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+    char* mem = (char*)::operator new(head + count * size);
+    Slab* slab = new (mem) Slab;
+    slab->ref = count;
+    slab->chunk = size;
+    slab->mapped = false;
+    slab->bytes = head + count * size;
+    Node* nodes = (Node*)(mem + sizeof(Slab));
+    for(size_t i = 0; i < count; ++i) {
+        Node* node = new (&nodes[i]) Node;
+        node->ptr = mem + head + i * size;
+        node->size = size;
+        node->slab = slab;
+        node->next = i + 1 < count ? &nodes[i + 1] : nullptr;
+    }
+    if(last) {
+        last->next = nodes;
+    } else {
+        first = nodes;
+    }
+    last = &nodes[count - 1];
+    return first;
+}
+
+/// 引用整个映射的结点, 初始引用计数为1
+static ByteArray::Node* MapNode(char* addr, size_t len) {
+    char* mem = (char*)::operator new(sizeof(ByteArray::Slab) + sizeof(ByteArray::Node));
+    ByteArray::Slab* slab = new (mem) ByteArray::Slab;
+    slab->ref = 1;
+    slab->chunk = len;
+    slab->mapped = true;
+    slab->bytes = sizeof(ByteArray::Slab) + sizeof(ByteArray::Node);
+    ByteArray::Node* node = new (mem + sizeof(ByteArray::Slab)) ByteArray::Node;
+    node->ptr = addr;
+    node->size = len;
+    node->slab = slab;
+    return node;
+}
+
+void ByteArray::FreeNodes(Node* first) {
+    while(first) {
+        Node* node = first;
+        first = first->next;
+        UnrefNode(node);
+    }
 }
 
 
@@ -25,17 +262,15 @@ ByteArray::ByteArray(size_t base_size)
     ,m_capacity(base_size)
     ,m_size(0)
     ,m_endian(SYLAR_BIG_ENDIAN)
-    ,m_root(new Node(base_size))
-    ,m_cur(m_root) {
+    ,m_root(nullptr)
+    ,m_cur(nullptr)
+    ,m_tail(nullptr)
+    ,m_curBase(0) {
+    m_root = m_cur = AllocNodes(base_size, 1, m_tail);
 }
 ByteArray::~ByteArray() {
     /// 释放链表
-    Node* tmp = m_root;
-    while(tmp) {
-        m_cur = tmp;
-        tmp = tmp->next;
-        delete m_cur;
-    } 
+    FreeNodes(m_root);
 }
 
 bool ByteArray::isLittleEndian() const {
@@ -103,20 +338,13 @@ void ByteArray::writeFuint64(uint64_t value) {
 }
 
 
+/// 负数变成奇数, 正数变成偶数, 绝对值小的数编码后也小; 不需要分支
 static uint32_t EncodeZigzag32(const int32_t& v) {
-    if(v < 0) {
-        return ((uint32_t)(-v)) * 2 - 1;    // 负数变成 
-    } else {
-        return v * 2;       
-    }
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
 }
 
 static uint64_t EncodeZigzag64(const int64_t& v) {
-    if(v < 0) {
-        return ((uint64_t)(-v)) * 2 - 1;    // 负数变成 
-    } else {
-        return v * 2;       
-    }
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
 }
 
 static int32_t DecodeZigzag32(const uint32_t& v) {
@@ -127,34 +355,141 @@ static int64_t DecodeZigzag64(const uint64_t& v) {
     return (v >> 1) ^ -(v & 1);
 }
 
+/// varint最长的字节数
+static const size_t MAX_VARINT_SIZE = 10;
+
+/// 把v的低56位按7位一组分散到8个字节的低7位
+static inline uint64_t SpreadVarint(uint64_t v) {
+#ifdef __BMI2__
+    return _pdep_u64(v, 0x7f7f7f7f7f7f7f7full);
+#else
+    return (v & 0x7full)
+        | ((v << 1) & 0x7f00ull)
+        | ((v << 2) & 0x7f0000ull)
+        | ((v << 3) & 0x7f000000ull)
+        | ((v << 4) & 0x7f00000000ull)
+        | ((v << 5) & 0x7f0000000000ull)
+        | ((v << 6) & 0x7f000000000000ull)
+        | ((v << 7) & 0x7f00000000000000ull);
+#endif
+}
+
+/// SpreadVarint的逆操作, 丢掉每个字节的最高位
+static inline uint64_t GatherVarint(uint64_t w) {
+#ifdef __BMI2__
+    return _pext_u64(w, 0x7f7f7f7f7f7f7f7full);
+#else
+    return (w & 0x7full)
+        | ((w >> 1) & (0x7full << 7))
+        | ((w >> 2) & (0x7full << 14))
+        | ((w >> 3) & (0x7full << 21))
+        | ((w >> 4) & (0x7full << 28))
+        | ((w >> 5) & (0x7full << 35))
+        | ((w >> 6) & (0x7full << 42))
+        | ((w >> 7) & (0x7full << 49));
+#endif
+}
+
+/**
+ * @brief 编码varint
+ * @param[out] out 至少MAX_VARINT_SIZE字节, 小端机器上一次写8个字节, 超出编码长度的部分是无效数据
+ * @return 编码长度
+ */
+static inline size_t EncodeVarint64(uint64_t v, uint8_t* out) {
+    // 有效位数除以7向上取整
+    size_t n = ((64 - __builtin_clzll(v | 1)) * 9 + 64) / 64;
+#if SYLAR_BYTE_ORDER == SYLAR_LITTLE_ENDIAN
+    // 除最后一个字节外都带继续标志
+    uint64_t cont = n > 8 ? ~0ull : (1ull << ((n - 1) * 8)) - 1;
+    uint64_t word = SpreadVarint(v) | (cont & 0x8080808080808080ull);
+    memcpy(out, &word, sizeof(word));
+    if(n > 8) {
+        out[8] = ((v >> 56) & 0x7f) | (n > 9 ? 0x80 : 0);
+        out[9] = v >> 63;
+    }
+#else
+    for(size_t i = 0; i + 1 < n; ++i) {
+        out[i] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    out[n - 1] = v;
+#endif
+    return n;
+}
+
+/**
+ * @brief 解码varint
+ * @param[in] in 至少可以访问MAX_VARINT_SIZE字节, 超出编码长度的部分不影响结果
+ * @return 编码长度, 和原来逐字节读取一样最多读10个字节
+ */
+static inline size_t DecodeVarint64(const uint8_t* in, uint64_t& v) {
+#if SYLAR_BYTE_ORDER == SYLAR_LITTLE_ENDIAN
+    uint64_t word;
+    memcpy(&word, in, sizeof(word));
+    // 最高位为0的字节是最后一个
+    uint64_t stops = ~word & 0x8080808080808080ull;
+    if(stops) {
+        // stops ^ (stops - 1)保留到最后一个字节为止
+        v = GatherVarint(word & (stops ^ (stops - 1)));
+        return __builtin_ctzll(stops) / 8 + 1;
+    }
+    v = GatherVarint(word) | ((uint64_t)(in[8] & 0x7f) << 56);
+    if(in[8] < 0x80) {
+        return 9;
+    }
+    v |= (uint64_t)in[9] << 63;
+    return 10;
+#else
+    v = 0;
+    for(size_t i = 0; i < MAX_VARINT_SIZE; ++i) {
+        v |= (uint64_t)(in[i] & 0x7f) << (i * 7);
+        if(in[i] < 0x80) {
+            return i + 1;
+        }
+    }
+    return MAX_VARINT_SIZE;
+#endif
+}
+
 /// ? 为什么这里压缩不需要考虑字节序?  -> 解压是由我们写的代码决定的，不是由cpu
 void ByteArray::writeInt32(int32_t value) {
     writeUint32(EncodeZigzag32(value));
 }
 void ByteArray::writeUint32(uint32_t value) {
-    uint8_t tmp[5];     // 最多不超过5个字节
-    uint8_t i = 0;
-    while(value >= 0x80) {    // >=0x80,说明value的高7位的二进制肯定有1，则需要压缩
-        tmp[i++] = (value & 0x7f) | 0x80;  // 1 + 低7位，构成一个记录
-        value >>= 7;     // 右
-    }
-    tmp[i++] = value;
-    /// write（const char* str,int n), n 用来表示输出显示字符串中字符的个数。
-    /// void ByteArray::read(char* buf, size_t size);
-    write(tmp, i);
+    writeUint64(value);     // 编码相同, 最多5个字节
 }
 void ByteArray::writeInt64(int64_t value) {
     writeUint64(EncodeZigzag64(value));
 }
 void ByteArray::writeUint64(uint64_t value) {
-    uint8_t tmp[10];        // 7*9=63 7*10=70， 因此需要10
-    uint8_t i = 0;
-    while(value >= 0x80) {
-        tmp[i++] = (value & 0x7F) | 0x80;
-        value >>= 7;
+    uint8_t* out = varintWriteBuffer();
+    if(out) {
+        // 当前结点剩余空间足够, 直接编码到结点中
+        skipInNode(EncodeVarint64(value, out));
+        m_size = m_position;
+        return;
+    }
+    uint8_t tmp[MAX_VARINT_SIZE];
+    write(tmp, EncodeVarint64(value, tmp));
+}
+
+void ByteArray::writeVarints(const uint64_t* values, size_t n) {
+    size_t i = 0;
+    while(i < n) {
+        uint8_t* out = varintWriteBuffer();
+        if(!out) {
+            // 跨结点或者需要扩容
+            writeUint64(values[i++]);
+            continue;
+        }
+        uint8_t* begin = out;
+        uint8_t* end = (uint8_t*)m_cur->ptr + m_cur->size - MAX_VARINT_SIZE;
+        while(i < n && out <= end) {
+            out += EncodeVarint64(values[i++], out);
+        }
+        skipInNode(out - begin);
+        m_size = m_position;
     }
-    tmp[i++] = value;
-    write(tmp, i);
 }
 
 void ByteArray::writeFloat(float value) {
@@ -244,6 +579,17 @@ int32_t     ByteArray::readInt32() {
     return DecodeZigzag32(readUint32());
 }
 uint32_t    ByteArray::readUint32() {
+    uint64_t v = 0;
+    const uint8_t* in = varintReadBuffer();
+    if(in) {
+        size_t n = DecodeVarint64(in, v);
+        if(n <= 5 && n <= getReadSize()) {
+            skipInNode(n);
+            return v;
+        }
+        // 超过5个字节(数据有误)或者数据不足, 按原来的方式读, 保持行为一致
+    }
+
     uint32_t result = 0;
     for(int i = 0; i < 32; i += 7) {
         uint8_t b = readFuint8();   // 先读一个字节
@@ -261,6 +607,16 @@ int64_t     ByteArray::readInt64() {
     return DecodeZigzag64(readUint64());
 }
 uint64_t    ByteArray::readUint64() {
+    uint64_t v = 0;
+    const uint8_t* in = varintReadBuffer();
+    if(in) {
+        size_t n = DecodeVarint64(in, v);
+        if(n <= getReadSize()) {
+            skipInNode(n);
+            return v;
+        }
+    }
+
     uint64_t result = 0;
     for(int i = 0; i < 64; i += 7) {
         uint8_t b = readFuint8();
@@ -274,6 +630,34 @@ uint64_t    ByteArray::readUint64() {
     return result;
 }
 
+void ByteArray::readVarints(uint64_t* values, size_t n) {
+    size_t i = 0;
+    while(i < n) {
+        const uint8_t* in = varintReadBuffer();
+        if(!in) {
+            values[i++] = readUint64();
+            continue;
+        }
+        const uint8_t* begin = in;
+        const uint8_t* end = (const uint8_t*)m_cur->ptr + m_cur->size - MAX_VARINT_SIZE;
+        // 数据的结尾可能在当前结点中
+        const uint8_t* data_end = in + getReadSize();
+        while(i < n && in <= end) {
+            size_t len = DecodeVarint64(in, values[i]);
+            if(in + len > data_end) {
+                break;
+            }
+            in += len;
+            ++i;
+        }
+        skipInNode(in - begin);
+        if(i < n && in <= end) {
+            // 数据不足, 由readUint64抛出异常
+            values[i++] = readUint64();
+        }
+    }
+}
+
 float ByteArray::readFloat() {
     uint32_t v = readFuint32();     // 直接按32位读
     float value;
@@ -318,21 +702,62 @@ std::string ByteArray::readStringVint() {
 }
 
 
+uint8_t* ByteArray::varintWriteBuffer() {
+    // 只在追加时直接写, 一次写8个字节不能覆盖后面已有的数据
+    if(!m_cur || m_position < m_size) {
+        return nullptr;
+    }
+    size_t npos = m_position - m_curBase;
+    if(m_cur->size - npos < MAX_VARINT_SIZE) {
+        return nullptr;
+    }
+    return (uint8_t*)m_cur->ptr + npos;
+}
+
+const uint8_t* ByteArray::varintReadBuffer() const {
+    if(!m_cur) {
+        return nullptr;
+    }
+    size_t npos = m_position - m_curBase;
+    // 结点内存足够就可以直接访问, 是否超出数据长度由调用者检查
+    if(m_cur->size - npos < MAX_VARINT_SIZE) {
+        return nullptr;
+    }
+    return (const uint8_t*)m_cur->ptr + npos;
+}
+
+void ByteArray::skipInNode(size_t n) {
+    m_position += n;
+    if(m_position - m_curBase == m_cur->size) {
+        m_curBase += m_cur->size;
+        m_cur = m_cur->next;
+    }
+}
+
 // 内部操作
 void ByteArray::clear() {
     m_position = m_size = 0;
-    m_capacity = m_baseSize;
+    m_curBase = 0;
 
-    // 释放内存
-    Node* tmp = m_root->next;       // 只留一个起始结点
-    while(tmp) {
-        m_cur = tmp;
-        tmp = tmp->next;
-        delete m_cur;
+    // 释放内存, 只留一个起始结点
+    Node* rest = m_root->next;
+    m_root->next = NULL;
+    if(m_root->source || m_root->ref.load(std::memory_order_acquire) != 1) {
+        // 起始结点是切片结点, 或者内存还被切片引用, 不能再往里写, 换一个新的
+        FreeNodes(m_root);
+        m_root = AllocNodes(m_baseSize, 1, m_tail);
+    } else {
+        m_root->size = m_root->slab->chunk;     // 可能被writeSlice截短过
     }
+    FreeNodes(rest);
 
     m_cur = m_root;
-    m_root->next = NULL;
+    m_tail = m_root;
+    m_capacity = m_root->size;
+}
+
+void ByteArray::reserve(size_t size) {
+    addCapacity(size);
 }
 
 // 注意buf是void，支持任何类型
@@ -342,7 +767,7 @@ void ByteArray::write(const void* buf, size_t size) {
     }
     addCapacity(size);  // 确保容量足够
 
-    size_t npos = m_position % m_baseSize;  // 当前结点的可用空间的起始位置
+    size_t npos = m_position - m_curBase;  // 当前结点的可用空间的起始位置
     size_t ncap = m_cur->size - npos;      // 当前结点的容量
     size_t bpos = 0;
 
@@ -350,6 +775,7 @@ void ByteArray::write(const void* buf, size_t size) {
         if (ncap >= size) {     //  当前结点容量就够
             memcpy(m_cur->ptr + npos, (const char*)buf + bpos, size);
             if (m_cur->size == (npos + size)) {     // 刚好将这个结点写满
+                m_curBase += m_cur->size;
                 m_cur = m_cur->next;
             }
 
@@ -362,6 +788,7 @@ void ByteArray::write(const void* buf, size_t size) {
             m_position += ncap;
             bpos += ncap;
             size -= ncap;   // 还要写入的数量
+            m_curBase += m_cur->size;
             m_cur = m_cur->next;
             ncap = m_cur->size;
             npos = 0;
@@ -383,7 +810,7 @@ void ByteArray::read(void* buf, size_t size) {
         throw std::out_of_range("not enough len");
     }
 
-    size_t npos = m_position % m_baseSize;
+    size_t npos = m_position - m_curBase;
     size_t ncap = m_cur->size - npos;
     size_t bpos = 0;
 
@@ -391,6 +818,7 @@ void ByteArray::read(void* buf, size_t size) {
         if(ncap >= size) {
             memcpy((char*)buf + bpos, m_cur->ptr + npos, size);
             if(m_cur->size == (npos + size)) {
+                m_curBase += m_cur->size;
                 m_cur = m_cur->next;
             }
             m_position += size;
@@ -401,6 +829,7 @@ void ByteArray::read(void* buf, size_t size) {
             m_position += ncap;
             bpos += ncap;
             size -= ncap;
+            m_curBase += m_cur->size;
             m_cur = m_cur->next;   // ???这里怎么是继续next呢? 
             ncap = m_cur->size;
             npos = 0;
@@ -414,10 +843,15 @@ void ByteArray::read(void* buf, size_t size, size_t position) const {
         throw std::out_of_range("not enough len");
     }
 
-    size_t npos = position % m_baseSize;
-    size_t ncap = m_cur->size - npos;
+    if(size == 0) {
+        return;
+    }
+
+    size_t base = 0;
+    Node* cur = locate(position, base);
+    size_t npos = position - base;
+    size_t ncap = cur->size - npos;
     size_t bpos = 0;
-    Node* cur = m_cur;
     while(size > 0) {
         if(ncap >= size) {
             memcpy((char*)buf + bpos, cur->ptr + npos, size);
@@ -450,47 +884,71 @@ void ByteArray::setPosition(size_t v) {
         m_size = m_position;
     }
 
-    m_cur = m_root;
-    while(v > m_cur->size) {    // m_cur->size是结点的容量
-        v -= m_cur->size;
-        m_cur = m_cur->next;   
+    // v等于容量时m_cur为nullptr
+    m_cur = locate(v, m_curBase);
+}
+
+ByteArray::Node* ByteArray::locate(size_t position, size_t& base) const {
+    Node* cur = m_root;
+    size_t start = 0;
+    if(m_cur && position >= m_curBase) {
+        // 向后找时从当前结点开始
+        cur = m_cur;
+        start = m_curBase;
     }
-    // 如果上面while(v>=m_cur->size), 那么下次m_cur就是Null, 然后进入while循环就会报错
-    // 所以这里将v==m_cur->size的条件单独判断 
-    if(v == m_cur->size) { 
-        m_cur = m_cur->next;      
+    while(cur && position >= start + cur->size) {
+        start += cur->size;
+        cur = cur->next;
     }
+    base = start;
+    return cur;
 }
 
 
 bool ByteArray::writeToFile(const std::string& name) const {
-    std::ofstream ofs;
-    ofs.open(name, std::ios::trunc | std::ios::binary); // 打开文件，清空+写二进制
-    SYLAR_LOG_ERROR(g_logger) << name;
-    if(!ofs) {
+    int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);   // 打开文件，清空+写
+    if(fd < 0) {
         SYLAR_LOG_ERROR(g_logger) << "writeToFile name=" << name
             << " error , errno=" << errno << " errstr=" << strerror(errno);
         return false;
     }
 
-    int64_t read_size = getReadSize();      // 获得可读的数据大小
-    int64_t pos = m_position;               // 当前位置信息
-    Node* cur = m_cur;                      // 当前位置所属的结点
-    
-    while(read_size > 0) {      
-        /// 从当前位置写到最后
-        int diff = pos % m_baseSize;        // 当前位置在所属结点的偏移
-        int64_t len = (read_size > (int64_t)m_baseSize ? m_baseSize : read_size) - diff;    // 当前结点可读的数据长度
-        ofs.write(cur->ptr + diff, len);        // 将当前结点的内容写入文件
-
-        cur = cur->next;        // 下一个结点
-        pos += len;             // 改变pos
-        read_size -= len;
+    // 结点大小不固定, 按iovec写, 每次最多IOV_MAX个结点
+    std::vector<iovec> buffers;
+    getReadBuffers(buffers, getReadSize(), m_position);
+    size_t idx = 0;
+    off_t offset = 0;
+    while(idx < buffers.size()) {
+        int count = std::min(buffers.size() - idx, (size_t)IOV_MAX);
+        ssize_t rt = pwritev(fd, &buffers[idx], count, offset);
+        if(rt < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            SYLAR_LOG_ERROR(g_logger) << "writeToFile name=" << name
+                << " pwritev error, errno=" << errno << " errstr=" << strerror(errno);
+            close(fd);
+            return false;
+        }
+        offset += rt;
+        // 跳过写完的结点, 写了一部分的结点调整起始位置
+        while(rt > 0 && (size_t)rt >= buffers[idx].iov_len) {
+            rt -= buffers[idx].iov_len;
+            ++idx;
+        }
+        if(rt > 0) {
+            buffers[idx].iov_base = (char*)buffers[idx].iov_base + rt;
+            buffers[idx].iov_len -= rt;
+        }
     }
-
+    close(fd);
     return true;
 }
-bool ByteArray::readFromFile(const std::string& name) {
+
+bool ByteArray::readFromFile(const std::string& name, bool map) {
+    if(map) {
+        return mapFile(name);
+    }
     std::ifstream ifs;
     ifs.open(name, std::ios::binary);
     if(!ifs) {
@@ -508,6 +966,45 @@ bool ByteArray::readFromFile(const std::string& name) {
 
 }
 
+bool ByteArray::mapFile(const std::string& name) {
+    int fd = open(name.c_str(), O_RDONLY);
+    if(fd < 0) {
+        SYLAR_LOG_ERROR(g_logger) << "readFromFile name=" << name
+            << " error, errno=" << errno << " errstr=" << strerror(errno);
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        SYLAR_LOG_ERROR(g_logger) << "readFromFile name=" << name
+            << " fstat error, errno=" << errno << " errstr=" << strerror(errno);
+        close(fd);
+        return false;
+    }
+    if(!S_ISREG(st.st_mode) || st.st_size == 0) {
+        // 管道、字符设备等不能映射; /proc中的文件是普通文件但大小为0
+        // 按复制的方式读, 真正的空文件也就什么都读不到
+        close(fd);
+        return readFromFile(name, false);
+    }
+    // 私有映射: 原地改写只复制被写的页, 不会写回文件
+    void* addr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);      // 映射不依赖fd
+    if(addr == MAP_FAILED) {
+        SYLAR_LOG_ERROR(g_logger) << "readFromFile name=" << name
+            << " mmap error, errno=" << errno << " errstr=" << strerror(errno);
+        return false;
+    }
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+
+    // 映射作为一个内存块, 按切片拼接进来; 最后一个引用释放时munmap
+    Slice slice;
+    Node* node = MapNode((char*)addr, st.st_size);
+    slice.m_parts.push_back(Slice::Part{node, node->ptr, node->size});
+    slice.m_size = node->size;
+    writeSlice(slice);
+    return true;
+}
+
 
 void ByteArray::addCapacity(size_t size) {      // size是新的容量
     if (size == 0) {
@@ -520,24 +1017,15 @@ void ByteArray::addCapacity(size_t size) {      // size是新的容量
     }
 
     size = size - old_cap;      // 实际需要扩容的字节
-    size_t count = ceil(1.0 * size / m_baseSize);   // 需要加多少个节点，有余数会多增加一个结点
-    Node* tmp = m_root;
-    while(tmp->next) {
-        tmp = tmp->next;
-    }
-
+    size_t count = (size + m_baseSize - 1) / m_baseSize;   // 需要加多少个节点，有余数会多增加一个结点
 
-    Node* first = NULL;
-    for(size_t i = 0; i < count; ++i) {
-        tmp->next = new Node(m_baseSize);  // 增加结点
-
-        if(first == NULL) {
-            first = tmp->next;      // 记录新增结点的起始结点
-        }
-        tmp = tmp->next;
+    // 接在缓存的尾结点后面, 不需要从头遍历
+    Node* last = nullptr;
+    Node* first = AllocNodes(m_baseSize, count, last);
+    m_tail->next = first;
+    m_tail = last;
+    m_capacity += count * m_baseSize;
 
-        m_capacity += m_baseSize;
-    }
     if(old_cap == 0) { 
         // 只有在原始为空的情况下，才需要设置m_cur, 否则不需要
         m_cur = first;
@@ -583,7 +1071,7 @@ int32_t ByteArray::getReadBuffers(std::vector<iovec>& buffers, uint64_t len) {
 
     uint64_t size = len;
 
-    size_t npos = m_position % m_baseSize;
+    size_t npos = m_position - m_curBase;
     size_t ncap = m_cur->size - npos;
     Node* cur = m_cur;
     struct iovec iov;
@@ -615,14 +1103,9 @@ uint64_t ByteArray::getReadBuffers(std::vector<iovec>& buffers, uint64_t len, ui
 
     uint64_t size = len;
 
-    size_t npos = position % m_baseSize;
-    size_t count = position / m_baseSize;
-    Node* cur = m_root;
-    while(count > 0) {
-        cur = cur->next;
-        --count;
-    }
-
+    size_t base = 0;
+    Node* cur = locate(position, base);
+    size_t npos = position - base;
     size_t ncap = cur->size - npos;
     struct iovec iov;
     while(len > 0) {
@@ -649,7 +1132,7 @@ int64_t ByteArray::getWriteBuffers(std::vector<iovec>& buffers, uint64_t len) {
     addCapacity(len);   // 分配空间
     uint64_t size = len;
 
-    size_t npos = m_position % m_baseSize;
+    size_t npos = m_position - m_curBase;
     size_t ncap = m_cur->size - npos;
     struct iovec iov;
     Node* cur = m_cur;
@@ -673,4 +1156,152 @@ int64_t ByteArray::getWriteBuffers(std::vector<iovec>& buffers, uint64_t len) {
     return size;
 }
 
+
+ByteArray::Slice::Slice(const Slice& rhs)
+    :m_parts(rhs.m_parts)
+    ,m_size(rhs.m_size) {
+    for(auto& i : m_parts) {
+        i.chunk->ref.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+ByteArray::Slice::Slice(Slice&& rhs)
+    :m_parts(std::move(rhs.m_parts))
+    ,m_size(rhs.m_size) {
+    rhs.m_parts.clear();
+    rhs.m_size = 0;
+}
+
+ByteArray::Slice& ByteArray::Slice::operator=(const Slice& rhs) {
+    if(this != &rhs) {
+        Slice tmp(rhs);
+        *this = std::move(tmp);
+    }
+    return *this;
+}
+
+ByteArray::Slice& ByteArray::Slice::operator=(Slice&& rhs) {
+    if(this != &rhs) {
+        clear();
+        m_parts.swap(rhs.m_parts);
+        m_size = rhs.m_size;
+        rhs.m_size = 0;
+    }
+    return *this;
+}
+
+ByteArray::Slice::~Slice() {
+    clear();
+}
+
+void ByteArray::Slice::clear() {
+    for(auto& i : m_parts) {
+        UnrefNode(i.chunk);
+    }
+    m_parts.clear();
+    m_size = 0;
+}
+
+uint64_t ByteArray::Slice::getReadBuffers(std::vector<iovec>& buffers) const {
+    for(auto& i : m_parts) {
+        iovec iov;
+        iov.iov_base = (void*)i.ptr;
+        iov.iov_len = i.len;
+        buffers.push_back(iov);
+    }
+    return m_size;
+}
+
+std::string ByteArray::Slice::toString() const {
+    std::string str;
+    str.reserve(m_size);
+    for(auto& i : m_parts) {
+        str.append(i.ptr, i.len);
+    }
+    return str;
+}
+
+ByteArray::Slice ByteArray::readSlice(size_t size) {
+    Slice slice = readSlice(size, m_position);
+    setPosition(m_position + size);
+    return slice;
+}
+
+ByteArray::Slice ByteArray::readSlice(size_t size, size_t position) const {
+    if(position > m_size || size > m_size - position) {
+        throw std::out_of_range("not enough len");
+    }
+    Slice slice;
+    size_t base = 0;
+    Node* cur = size ? locate(position, base) : nullptr;
+    size_t npos = position - base;
+    while(size > 0) {
+        size_t len = std::min(cur->size - npos, size);
+        // 切片结点的数据在它引用的结点中
+        Node* chunk = cur->source ? cur->source : cur;
+        chunk->ref.fetch_add(1, std::memory_order_relaxed);
+        slice.m_parts.push_back(Slice::Part{chunk, cur->ptr + npos, len});
+        slice.m_size += len;
+        size -= len;
+        cur = cur->next;
+        npos = 0;
+    }
+    return slice;
+}
+
+void ByteArray::writeSlice(const Slice& slice) {
+    if(slice.empty()) {
+        return;
+    }
+
+    // 丢弃当前位置之后的结点
+    Node* rest = nullptr;
+    if(m_cur) {
+        size_t npos = m_position - m_curBase;
+        if(npos == 0) {
+            Node* prev = nullptr;
+            for(Node* i = m_root; i != m_cur; i = i->next) {
+                prev = i;
+            }
+            rest = m_cur;
+            if(prev) {
+                prev->next = nullptr;
+            } else {
+                m_root = nullptr;
+            }
+            m_tail = prev;
+        } else {
+            // 内存块后半段不再属于这个ByteArray, 可能被切片引用, 只截短结点
+            rest = m_cur->next;
+            m_cur->next = nullptr;
+            m_cur->size = npos;
+            m_tail = m_cur;
+        }
+    }
+    FreeNodes(rest);
+
+    // 每一段一个切片结点, 引用原来的内存块
+    Node* last = nullptr;
+    Node* first = AllocNodes(0, slice.m_parts.size(), last);
+    Node* node = first;
+    for(auto& i : slice.m_parts) {
+        i.chunk->ref.fetch_add(1, std::memory_order_relaxed);
+        node->source = i.chunk;
+        node->ptr = (char*)i.ptr;
+        node->size = i.len;
+        node = node->next;
+    }
+    if(m_tail) {
+        m_tail->next = first;
+    } else {
+        m_root = first;
+    }
+    m_tail = last;
+
+    m_position += slice.size();
+    m_capacity = m_size = m_position;
+    m_cur = nullptr;
+    m_curBase = m_capacity;
+}
+
 }
\ No newline at end of file
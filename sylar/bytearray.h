@@ -5,6 +5,7 @@
 #ifndef __SYLAR_BYTEARRAY_H__
 #define __SYLAR_BYTEARRAY_H__
 
+#include <atomic>
 #include <memory>
 #include <string>
 #include <stdint.h>
@@ -20,18 +21,70 @@ class ByteArray {
 public:
     typedef std::shared_ptr<ByteArray> ptr;
 
+    /// 一次分配的多个结点和它们的内存块, 所有结点释放后整体回收
+    struct Slab;
+
     /**
      * @brief ByteArray的存储节点,使用链表管理
      * 注意：并不是一个结点一个数据，结点也是连续管理的
+     * 结点和内存块来自slab, 释放后先进入线程本地的空闲链表(bytearray.node_cache_bytes)
+     * 结点的大小不一定是base_size: 拼接进来的切片结点只引用其他结点的内存,
+     * readFromFile映射的文件是一个结点, 大小是整个文件
      */
     struct Node {
-        Node(size_t s);
         Node();
-        ~Node();
 
         char *ptr;
         Node* next;
         size_t size;
+        /// 所属的slab
+        Slab* slab;
+        /// 内存块的引用计数: 所在的链表算一个, 每个引用它的切片算一个
+        std::atomic<uint32_t> ref;
+        /// 切片结点引用的结点, 自己没有内存块; 普通结点为nullptr
+        Node* source;
+    };
+
+    /**
+     * @brief 引用ByteArray中一段数据的切片, 不复制数据
+     * @details 持有内存块的引用, ByteArray清空或者析构后仍然有效;
+     *          数据被原地改写(setPosition后write)时切片也能看到变化
+     *          可以复制, 可以在其他线程中使用和释放
+     */
+    class Slice {
+    friend class ByteArray;
+    public:
+        Slice() {}
+        Slice(const Slice& rhs);
+        Slice(Slice&& rhs);
+        Slice& operator=(const Slice& rhs);
+        Slice& operator=(Slice&& rhs);
+        ~Slice();
+
+        /// 数据长度
+        size_t size() const { return m_size;}
+        bool empty() const { return m_size == 0;}
+
+        /// 释放引用的内存块
+        void clear();
+
+        /**
+         * @brief 保存成iovec数组, 方便使用sendmsg
+         * @return 数据长度
+         */
+        uint64_t getReadBuffers(std::vector<iovec>& buffers) const;
+
+        /// 复制出数据
+        std::string toString() const;
+    private:
+        /// 在一个内存块中的一段数据
+        struct Part {
+            Node* chunk;
+            const char* ptr;
+            size_t len;
+        };
+        std::vector<Part> m_parts;
+        size_t m_size = 0;
     };
 
     /**
@@ -61,6 +114,12 @@ public:
     void writeInt64(int64_t value);
     void writeUint64(uint64_t value);
 
+    /**
+     * @brief 批量写入无符号Varint64
+     * @details 当前结点剩余空间足够时直接编码到结点中, 比逐个调用writeUint64少很多检查
+     */
+    void writeVarints(const uint64_t* values, size_t n);
+
     void writeFloat(float value);
     void writeDouble(double value);
 
@@ -90,6 +149,12 @@ public:
     int64_t     readInt64();
     uint64_t    readUint64();
 
+    /**
+     * @brief 批量读取无符号Varint64
+     * @exception 数据不足时抛出std::out_of_range, 已经读出的值保留在values中
+     */
+    void readVarints(uint64_t* values, size_t n);
+
     float readFloat();
     double readDouble();
 
@@ -102,6 +167,28 @@ public:
     // 内部操作
     void clear();
 
+    /**
+     * @brief 从当前位置取出size字节的切片, 不复制数据, 位置后移
+     * @exception 可读数据不足时抛出std::out_of_range
+     */
+    Slice readSlice(size_t size);
+
+    /// 从position开始取出size字节的切片, 当前位置不变
+    Slice readSlice(size_t size, size_t position) const;
+
+    /**
+     * @brief 把切片拼接到当前位置, 不复制数据
+     * @details 当前位置之后原有的数据和容量被丢弃, 之后的写入追加到切片后面
+     *          切片的内存和来源共享, 不要再setPosition回去原地改写这一段
+     */
+    void writeSlice(const Slice& slice);
+
+    /**
+     * @brief 预留从当前位置开始写入size字节的容量
+     * @details 不足的结点优先从线程本地的空闲链表中取, 剩下的一次分配成一个连续的slab
+     */
+    void reserve(size_t size);
+
     void write(const void* buf, size_t size);
     void read(void* buf, size_t size);
     void read(void* buf, size_t size, size_t position) const;   // position不变
@@ -109,8 +196,20 @@ public:
     size_t getPosition() const { return m_position;}
     void setPosition(size_t v);
 
+    /**
+     * @brief 把当前位置之后的数据写入文件
+     * @details 用pwritev一次写多个结点, 不经过中间缓冲区
+     */
     bool writeToFile(const std::string& name) const;
-    bool readFromFile(const std::string& name);
+
+    /**
+     * @brief 把文件内容写到当前位置, 位置后移到末尾
+     * @param[in] map 为true时mmap文件(私有映射), 不复制数据, 读取时按需缺页;
+     *                映射按切片拼接进来, 当前位置之后原有的数据被丢弃(同writeSlice)
+     *                原地改写只影响内存中的副本, 不会写回文件;
+     *                不是普通文件(管道、字符设备等)或者大小为0(/proc中的文件)时按复制的方式读
+     */
+    bool readFromFile(const std::string& name, bool map = false);
 
     // 返回内存块的大小
     size_t getBaseSize() const { return m_baseSize;}
@@ -147,6 +246,41 @@ private:
      * @brief 获取当前的可写入容量
      */
     size_t getCapacity() const { return m_capacity - m_position;}
+
+    /**
+     * @brief 分配count个大小为size的结点, 连成链表
+     * @param[out] last 最后一个结点
+     * @return 第一个结点
+     */
+    static Node* AllocNodes(size_t size, size_t count, Node*& last);
+
+    /**
+     * @brief 追加varint时可以直接写入的位置
+     * @return 当前结点剩余空间不足10个字节, 或者不是在末尾追加时返回nullptr
+     */
+    uint8_t* varintWriteBuffer();
+
+    /**
+     * @brief 可以直接解码varint的位置
+     * @return 当前结点剩余内存不足10个字节时返回nullptr
+     */
+    const uint8_t* varintReadBuffer() const;
+
+    /// mmap文件, 映射按切片拼接到当前位置
+    bool mapFile(const std::string& name);
+
+    /// 在当前结点内前进n个字节, n不超过结点的剩余空间
+    void skipInNode(size_t n);
+
+    /// 释放从first开始的整个链表
+    static void FreeNodes(Node* first);
+
+    /**
+     * @brief 找到position所在的结点
+     * @param[out] base 结点在数据中的起始位置
+     * @return position等于容量时返回nullptr
+     */
+    Node* locate(size_t position, size_t& base) const;
 private:
 
     /// 内存块的大小(每个node有多大)
@@ -165,6 +299,10 @@ private:
     Node* m_root;
     /// 当前操作的内存块指针
     Node* m_cur;        // 这个执行的内存块应该是有保存内容的最后一个吧???
+    /// 最后一个内存块指针, 扩容时直接接在后面
+    Node* m_tail;
+    /// m_cur在数据中的起始位置(结点大小不固定, 不能用m_position % m_baseSize)
+    size_t m_curBase;
 
 };
 
@@ -0,0 +1,288 @@
+/**
+ * @file channel.h
+ * @brief 协程间传递数据的有界多生产者多消费者通道
+ * @details 满时发送方、空时接收方只让出当前协程, 对方取走或放入数据后被唤醒
+ *          数据保存在固定容量的环形队列中, 稳定状态下收发没有内存分配
+ *          (Scheduler::schedule传递闭包每条消息都要分配一个std::function)
+ *          被唤醒的协程重新检查队列, 不会把数据直接写到等待者的栈上(共享栈模式下切出的协程栈不在原地)
+ *          需要等待的send/recv只能在任务协程中调用; trySend/tryRecv可以在任意线程调用
+ */
+#ifndef __SYLAR_CHANNEL_H__
+#define __SYLAR_CHANNEL_H__
+
+#include <memory>
+#include "ring_queue.h"
+#include "mutex.h"
+#include "iomanager.h"
+#include "macro.h"
+#include "noncopyable.h"
+
+namespace sylar {
+
+template<class T>
+class Channel : Noncopyable {
+public:
+    typedef std::shared_ptr<Channel> ptr;
+    typedef Spinlock MutexType;
+
+    /**
+     * @brief 构造函数
+     * @param[in] capacity 最多缓存的数据个数, 至少为1
+     */
+    Channel(size_t capacity)
+        : m_capacity(capacity ? capacity : 1)
+        , m_queue(m_capacity) {
+    }
+
+    ~Channel() {
+        SYLAR_ASSERT(m_senders.empty() && m_receivers.empty());
+    }
+
+    /**
+     * @brief 发送数据, 通道满时等待
+     * @param[in] timeout_ms 超时时间, ~0ull表示一直等待, 需要在IOManager中使用
+     * @return 成功返回true; 通道已关闭或者超时返回false
+     */
+    bool send(const T& v, uint64_t timeout_ms = ~0ull) {
+        T tmp(v);
+        return send(std::move(tmp), timeout_ms);
+    }
+
+    bool send(T&& v, uint64_t timeout_ms = ~0ull) {
+        uint64_t deadline = ~0ull;
+        while(true) {
+            typename MutexType::Lock lock(m_mutex);
+            if(m_closed) {
+                return false;
+            }
+            if(m_queue.size() < m_capacity) {
+                m_queue.push_back(std::move(v));
+                wakeOne(m_receivers, lock);
+                return true;
+            }
+            if(!wait(m_senders, lock, timeout_ms, deadline)) {
+                return false;
+            }
+        }
+    }
+
+    /// 不等待, 通道满或者已关闭时返回false
+    bool trySend(const T& v) {
+        T tmp(v);
+        return trySend(std::move(tmp));
+    }
+
+    bool trySend(T&& v) {
+        typename MutexType::Lock lock(m_mutex);
+        if(m_closed || m_queue.size() >= m_capacity) {
+            return false;
+        }
+        m_queue.push_back(std::move(v));
+        wakeOne(m_receivers, lock);
+        return true;
+    }
+
+    /**
+     * @brief 接收数据, 通道空时等待
+     * @param[in] timeout_ms 超时时间, ~0ull表示一直等待, 需要在IOManager中使用
+     * @return 成功返回true; 通道已关闭并且没有剩余数据, 或者超时返回false
+     */
+    bool recv(T& v, uint64_t timeout_ms = ~0ull) {
+        uint64_t deadline = ~0ull;
+        while(true) {
+            typename MutexType::Lock lock(m_mutex);
+            if(!m_queue.empty()) {
+                v = std::move(m_queue.front());
+                m_queue.pop_front();
+                wakeOne(m_senders, lock);
+                return true;
+            }
+            if(m_closed) {
+                return false;
+            }
+            if(!wait(m_receivers, lock, timeout_ms, deadline)) {
+                return false;
+            }
+        }
+    }
+
+    /// 不等待, 通道空时返回false
+    bool tryRecv(T& v) {
+        typename MutexType::Lock lock(m_mutex);
+        if(m_queue.empty()) {
+            return false;
+        }
+        v = std::move(m_queue.front());
+        m_queue.pop_front();
+        wakeOne(m_senders, lock);
+        return true;
+    }
+
+    /**
+     * @brief 关闭通道
+     * @details 之后发送都失败, 接收方取完剩余数据后失败; 唤醒全部等待者
+     */
+    void close() {
+        RingQueue<Waiter> senders;
+        RingQueue<Waiter> receivers;
+        {
+            typename MutexType::Lock lock(m_mutex);
+            m_closed = true;
+            std::swap(senders, m_senders);
+            std::swap(receivers, m_receivers);
+        }
+        RingQueue<Waiter>* queues[] = {&senders, &receivers};
+        for(auto q : queues) {
+            while(!q->empty()) {
+                q->front().wake();
+                q->pop_front();
+            }
+        }
+    }
+
+    bool isClosed() {
+        typename MutexType::Lock lock(m_mutex);
+        return m_closed;
+    }
+
+    size_t size() {
+        typename MutexType::Lock lock(m_mutex);
+        return m_queue.size();
+    }
+
+    size_t capacity() const { return m_capacity;}
+private:
+    /**
+     * @brief 带超时等待的状态, 通道和定时器都通过它唤醒, 只有第一次唤醒有效
+     * @details 定时器回调只持有它, 不访问通道: 回调执行时通道可能已经析构
+     */
+    struct TimedWait {
+        MutexType mutex;
+        Scheduler* scheduler = nullptr;
+        Fiber::ptr fiber;
+        /// 是否被定时器唤醒
+        bool timedOut = false;
+
+        void wake(bool timeout) {
+            Fiber::ptr fiber;
+            {
+                typename MutexType::Lock lock(mutex);
+                if(!this->fiber) {
+                    return;
+                }
+                fiber.swap(this->fiber);
+                timedOut = timeout;
+            }
+            scheduler->schedule(std::move(fiber));
+        }
+    };
+
+    /// 等待的协程
+    struct Waiter {
+        Scheduler* scheduler = nullptr;
+        Fiber::ptr fiber;
+        /// 带超时等待时协程保存在这里, 不超时的等待为nullptr
+        std::shared_ptr<TimedWait> timed;
+
+        void wake() {
+            if(timed) {
+                timed->wake(false);
+                return;
+            }
+            // 协程可能还没有切出, 调度器会等它切出后再执行
+            scheduler->schedule(std::move(fiber));
+        }
+    };
+
+    /// 唤醒队头的等待者, 会释放锁
+    void wakeOne(RingQueue<Waiter>& q, typename MutexType::Lock& lock) {
+        if(q.empty()) {
+            return;
+        }
+        Waiter w = std::move(q.front());
+        q.pop_front();
+        lock.unlock();
+        w.wake();
+    }
+
+    /**
+     * @brief 当前协程进入等待队列并让出, 被唤醒后返回, 调用者重新检查
+     * @param[in,out] deadline 同一次收发的多次等待之间共享截止时间
+     * @return 超时返回false
+     */
+    bool wait(RingQueue<Waiter>& q, typename MutexType::Lock& lock
+              ,uint64_t timeout_ms, uint64_t& deadline) {
+        IOManager* iom = nullptr;
+        uint64_t remain = 0;
+        if(timeout_ms != ~0ull) {
+            iom = IOManager::GetThis();
+            SYLAR_ASSERT2(iom, "Channel timeout needs an IOManager");
+            uint64_t now = iom->getNowUs();
+            if(deadline == ~0ull) {
+                deadline = now + timeout_ms * 1000;
+            }
+            if(now >= deadline) {
+                return false;
+            }
+            remain = deadline - now;
+        }
+        // use_caller调度器的caller线程在stop()之前也有调度器, 但主协程挂起后没有人恢复它
+        Scheduler* scheduler = Scheduler::GetTaskScheduler();
+        SYLAR_ASSERT2(scheduler, "Channel must wait inside a task fiber");
+        Waiter w;
+        w.scheduler = scheduler;
+        std::shared_ptr<TimedWait> timed;
+        if(iom) {
+            timed = std::make_shared<TimedWait>();
+            timed->scheduler = scheduler;
+            timed->fiber = Fiber::GetThis();
+            w.timed = timed;
+        } else {
+            w.fiber = Fiber::GetThis();
+        }
+        q.push_back(std::move(w));
+        lock.unlock();
+
+        Timer::ptr timer;
+        if(iom) {
+            timer = iom->addTimerUs(remain, [timed](){
+                timed->wake(true);
+            });
+        }
+        Fiber::YieldToHold();
+        if(timer) {
+            timer->cancel();
+            if(timed->timedOut) {
+                // 定时器唤醒时还在队列中, 回到协程后再移出; 此时通道一定还存在
+                lock.lock();
+                // 保持其他等待者的顺序
+                for(size_t n = q.size(); n > 0; --n) {
+                    Waiter i = std::move(q.front());
+                    q.pop_front();
+                    if(i.timed != timed) {
+                        q.push_back(std::move(i));
+                    }
+                }
+                lock.unlock();
+            }
+        }
+        return true;
+    }
+private:
+    /// 容量
+    size_t m_capacity;
+    /// 保护下面所有成员
+    MutexType m_mutex;
+    /// 缓存的数据
+    RingQueue<T> m_queue;
+    /// 等待发送的协程
+    RingQueue<Waiter> m_senders;
+    /// 等待接收的协程
+    RingQueue<Waiter> m_receivers;
+    /// 是否已关闭
+    bool m_closed = false;
+};
+
+}
+
+#endif
@@ -0,0 +1,118 @@
+#include "fcontext.h"
+
+#ifdef SYLAR_HAVE_FCONTEXT
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+/**
+ * 栈上保存的内容(低地址 -> 高地址):
+ * mxcsr(4字节) x87控制字(2字节) 填充(2字节), r15, r14, r13, r12, rbx, rbp, 返回地址
+ * rdi: from, rsi: to
+ */
+asm(R"(
+    .text
+    .globl sylar_jump_fcontext
+    .type sylar_jump_fcontext,@function
+    .align 16
+sylar_jump_fcontext:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    leaq -8(%rsp), %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, (%rdi)
+
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    leaq 8(%rsp), %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+    .size sylar_jump_fcontext,.-sylar_jump_fcontext
+)");
+#elif defined(__aarch64__)
+/**
+ * 栈上保存的内容(0xb0字节, 低地址 -> 高地址):
+ * d8-d15, x19-x28, x29(fp), x30(lr), 填充
+ * x0: from, x1: to
+ */
+asm(R"(
+    .text
+    .globl sylar_jump_fcontext
+    .type sylar_jump_fcontext,%function
+    .align 4
+sylar_jump_fcontext:
+    sub sp, sp, #0xb0
+    stp d8, d9, [sp, #0x00]
+    stp d10, d11, [sp, #0x10]
+    stp d12, d13, [sp, #0x20]
+    stp d14, d15, [sp, #0x30]
+    stp x19, x20, [sp, #0x40]
+    stp x21, x22, [sp, #0x50]
+    stp x23, x24, [sp, #0x60]
+    stp x25, x26, [sp, #0x70]
+    stp x27, x28, [sp, #0x80]
+    stp x29, x30, [sp, #0x90]
+    mov x9, sp
+    str x9, [x0]
+
+    mov sp, x1
+    ldp d8, d9, [sp, #0x00]
+    ldp d10, d11, [sp, #0x10]
+    ldp d12, d13, [sp, #0x20]
+    ldp d14, d15, [sp, #0x30]
+    ldp x19, x20, [sp, #0x40]
+    ldp x21, x22, [sp, #0x50]
+    ldp x23, x24, [sp, #0x60]
+    ldp x25, x26, [sp, #0x70]
+    ldp x27, x28, [sp, #0x80]
+    ldp x29, x30, [sp, #0x90]
+    add sp, sp, #0xb0
+    ret
+    .size sylar_jump_fcontext,.-sylar_jump_fcontext
+)");
+#endif
+
+namespace sylar {
+
+fcontext_t make_fcontext(void* stack, size_t size, void (*fn)()) {
+    // 栈从高地址开始使用, 按16字节对齐
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+#if defined(__x86_64__)
+    uint64_t* sp = (uint64_t*)top;
+    *--sp = 0;                  // fn的返回地址, fn不会返回
+    *--sp = (uint64_t)fn;       // sylar_jump_fcontext最后的ret跳到fn, 此时栈和正常调用一样对齐
+    for(int i = 0; i < 6; ++i) {
+        *--sp = 0;              // rbp, rbx, r12 - r15
+    }
+    --sp;
+    // 浮点控制寄存器沿用当前线程的设置
+    uint32_t mxcsr = 0;
+    uint16_t fpucw = 0;
+    asm volatile("stmxcsr %0" : "=m"(mxcsr));
+    asm volatile("fnstcw %0" : "=m"(fpucw));
+    memcpy(sp, &mxcsr, sizeof(mxcsr));
+    memcpy((char*)sp + 4, &fpucw, sizeof(fpucw));
+    return sp;
+#elif defined(__aarch64__)
+    uint64_t* sp = (uint64_t*)(top - 0xb0);
+    memset(sp, 0, 0xb0);
+    sp[0x98 / 8] = (uint64_t)fn;    // x30, ret跳到fn
+    return sp;
+#endif
+}
+
+}
+
+#endif
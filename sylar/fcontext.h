@@ -0,0 +1,51 @@
+/**
+ * @file fcontext.h
+ * @brief 汇编实现的协程上下文切换(x86-64, aarch64)
+ * @details 只保存被调用者保存的寄存器和栈指针, 切换时不进入内核
+ *          (glibc的swapcontext每次都要调用rt_sigprocmask)
+ *          编译时定义SYLAR_FIBER_ASM(cmake选项SYLAR_FIBER_ASM)后Fiber使用它,
+ *          不支持的平台和AddressSanitizer下仍然使用ucontext
+ */
+#ifndef __SYLAR_FCONTEXT_H__
+#define __SYLAR_FCONTEXT_H__
+
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__aarch64__)
+#define SYLAR_HAVE_FCONTEXT 1
+#endif
+
+#if defined(SYLAR_HAVE_FCONTEXT) && defined(SYLAR_FIBER_ASM) && !defined(__SANITIZE_ADDRESS__)
+#define SYLAR_FIBER_USE_FCONTEXT 1
+#endif
+
+#ifdef SYLAR_HAVE_FCONTEXT
+
+namespace sylar {
+
+/// 上下文: 保存完寄存器之后的栈指针
+typedef void* fcontext_t;
+
+extern "C" {
+
+/**
+ * @brief 保存当前上下文到from, 切换到to
+ * @details 再次切换回from时从这里返回
+ */
+void sylar_jump_fcontext(fcontext_t* from, fcontext_t to);
+
+}
+
+/**
+ * @brief 在栈上构造一个新的上下文
+ * @param[in] stack 栈的起始地址(低地址)
+ * @param[in] size 栈大小
+ * @param[in] fn 第一次切换进来时执行的函数, 不能返回
+ */
+fcontext_t make_fcontext(void* stack, size_t size, void (*fn)());
+
+}
+
+#endif
+
+#endif
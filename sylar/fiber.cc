@@ -4,6 +4,10 @@
 #include "log.h"
 #include "scheduler.h"
 #include <atomic>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
 
 namespace sylar {
 
@@ -37,7 +41,206 @@ public:
         return free(vp);
     }
 };
-using StackAllocator = MallocStackAllocator;
+
+/// 是否用mmap分配协程栈
+static ConfigVar<bool>::ptr g_fiber_stack_mmap =
+    Config::Lookup<bool>("fiber.stack_mmap", false, "fiber stack use mmap with guard page");
+
+/// mmap的栈放回栈池时是否用MADV_DONTNEED释放物理内存
+static ConfigVar<bool>::ptr g_fiber_stack_madvise =
+    Config::Lookup<bool>("fiber.stack_madvise", false, "fiber stack madvise dontneed when pooled");
+
+/**
+ * @brief 协程的栈的内存分配器(mmap)
+ * @details 栈向低地址增长, 最低处一个PROT_NONE的保护页, 栈溢出时直接SIGSEGV, 不会破坏堆
+ *          MAP_NORESERVE, 只有被访问到的页才占用物理内存
+ */
+class MmapStackAllocator {
+public:
+    static void* Alloc(size_t size) {
+        size_t page = getpagesize();
+        size_t len = RoundUp(size) + page;
+        void* vp = mmap(nullptr, len, PROT_READ | PROT_WRITE
+                        ,MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if(vp == MAP_FAILED) {
+            SYLAR_LOG_ERROR(g_logger) << "mmap stack size=" << size << " errno="
+                << errno << " " << strerror(errno);
+            SYLAR_ASSERT2(false, "mmap stack");
+        }
+        if(mprotect(vp, page, PROT_NONE)) {
+            SYLAR_LOG_ERROR(g_logger) << "mprotect guard page errno=" << errno
+                << " " << strerror(errno);
+        }
+        return (char*)vp + page;
+    }
+
+    static void Dealloc(void* vp, size_t size) {
+        size_t page = getpagesize();
+        munmap((char*)vp - page, RoundUp(size) + page);
+    }
+
+    /// 释放栈已经占用的物理内存, 映射保留, 再次访问时重新分配清零的页
+    static void Discard(void* vp, size_t size) {
+        madvise(vp, RoundUp(size), MADV_DONTNEED);
+    }
+private:
+    static size_t RoundUp(size_t size) {
+        size_t page = getpagesize();
+        return (size + page - 1) / page * page;
+    }
+};
+
+/// 是否使用mmap分配栈: 第一次分配栈时读取, 之后不再改变, 已经分配的栈要用同一种方式释放
+static bool UseMmapStack() {
+    static bool s_mmap = g_fiber_stack_mmap->getValue();
+    return s_mmap;
+}
+
+static void* SystemStackAlloc(size_t size) {
+    return UseMmapStack() ? MmapStackAllocator::Alloc(size)
+                          : MallocStackAllocator::Alloc(size);
+}
+
+static void SystemStackDealloc(void* vp, size_t size) {
+    if(UseMmapStack()) {
+        MmapStackAllocator::Dealloc(vp, size);
+    } else {
+        MallocStackAllocator::Dealloc(vp, size);
+    }
+}
+
+/// 每个线程的栈池最多缓存的栈数量, 0表示不缓存
+static ConfigVar<uint32_t>::ptr g_fiber_stack_pool_max =
+    Config::Lookup<uint32_t>("fiber.stack_pool_max", 32, "fiber stack pool max count per thread");
+
+static uint32_t s_stack_pool_max = 32;
+static bool s_stack_madvise = false;
+
+struct _StackPoolIniter {
+    _StackPoolIniter() {
+        s_stack_pool_max = g_fiber_stack_pool_max->getValue();
+        s_stack_madvise = g_fiber_stack_madvise->getValue();
+        g_fiber_stack_madvise->addListener([](const bool& old_value, const bool& new_value){
+            s_stack_madvise = new_value;
+        });
+        g_fiber_stack_pool_max->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+            SYLAR_LOG_INFO(g_logger) << "fiber stack pool max changed from "
+                                     << old_value << " to " << new_value;
+            s_stack_pool_max = new_value;
+        });
+    }
+};
+static _StackPoolIniter s_stack_pool_initer;
+
+/// 栈池统计, 所有线程共用
+static std::atomic<uint64_t> s_stack_hits {0};
+static std::atomic<uint64_t> s_stack_misses {0};
+static std::atomic<uint64_t> s_stack_bytes {0};
+static std::atomic<uint64_t> s_stack_high_water {0};
+
+/// 线程的栈池已经析构(线程退出时), 之后释放的栈直接还给分配器
+static thread_local bool t_stackPoolDestroyed = false;
+
+/**
+ * @brief 协程栈池
+ * @details 每个线程一个, 协程析构时栈放回当前线程的池, 创建协程时优先从池中取同样大小的栈
+ *          不加锁; 协程可能在别的线程析构, 栈就进入那个线程的池
+ */
+class StackPool {
+public:
+    ~StackPool() {
+        for(auto& i : m_stacks) {
+            s_stack_bytes -= i.second;
+            SystemStackDealloc(i.first, i.second);
+        }
+        t_stackPoolDestroyed = true;
+    }
+
+    void* alloc(size_t size) {
+        // 后放入的栈更可能还在缓存中
+        for(size_t i = m_stacks.size(); i > 0; --i) {
+            if(m_stacks[i - 1].second == size) {
+                void* vp = m_stacks[i - 1].first;
+                m_stacks.erase(m_stacks.begin() + i - 1);
+                s_stack_bytes -= size;
+                ++s_stack_hits;
+                return vp;
+            }
+        }
+        ++s_stack_misses;
+        return SystemStackAlloc(size);
+    }
+
+    void dealloc(void* vp, size_t size) {
+        if(m_stacks.size() >= s_stack_pool_max) {
+            SystemStackDealloc(vp, size);
+            return;
+        }
+        if(s_stack_madvise && UseMmapStack()) {
+            // 缓存中的栈不占物理内存, 空闲的协程多时RSS保持很小
+            MmapStackAllocator::Discard(vp, size);
+        }
+        m_stacks.push_back(std::make_pair(vp, size));
+        uint64_t bytes = s_stack_bytes += size;
+        uint64_t high = s_stack_high_water;
+        while(bytes > high && !s_stack_high_water.compare_exchange_weak(high, bytes));
+    }
+private:
+    /// 缓存的栈和大小
+    std::vector<std::pair<void*, size_t> > m_stacks;
+};
+
+static thread_local StackPool t_stackPool;
+
+/// 协程的栈的内存分配器: 先经过当前线程的栈池
+class PooledStackAllocator {
+public:
+    static void* Alloc(size_t size) {
+        if(t_stackPoolDestroyed) {
+            return SystemStackAlloc(size);
+        }
+        return t_stackPool.alloc(size);
+    }
+
+    static void Dealloc(void* vp, size_t size) {
+        if(t_stackPoolDestroyed) {
+            return SystemStackDealloc(vp, size);
+        }
+        t_stackPool.dealloc(vp, size);
+    }
+};
+using StackAllocator = PooledStackAllocator;
+
+#ifdef SYLAR_FIBER_USE_FCONTEXT
+/// 所有共享栈协程切出后保存的栈内容的总字节数
+static std::atomic<uint64_t> s_shared_saved_bytes {0};
+
+/**
+ * @brief 线程的共享运行栈
+ * @details 共享栈协程都在这里运行, 切出后用到的部分复制到协程自己的缓冲区
+ */
+struct SharedStack {
+    ~SharedStack() {
+        if(base) {
+            SystemStackDealloc(base, size);
+        }
+    }
+
+    /// 栈顶(高地址)
+    char* top() {
+        if(!base) {
+            size = g_fiber_stack_size->getValue();
+            base = (char*)SystemStackAlloc(size);
+        }
+        return base + size;
+    }
+
+    char* base = nullptr;
+    size_t size = 0;
+};
+
+static thread_local SharedStack t_sharedStack;
+#endif
 
 
 Fiber::Fiber() {      
@@ -45,10 +248,12 @@ Fiber::Fiber() {
     m_state = EXEC;
     SetThis(this);      
 
-    /// 获得当前协程的上下文
+#ifndef SYLAR_FIBER_USE_FCONTEXT
+    /// 获得当前协程的上下文(汇编实现不需要, 第一次切换出去时保存)
     if(getcontext(&m_ctx)) {
         SYLAR_ASSERT2(false, "getcontext");
     }
+#endif
 
     ++s_fiber_count;    // 总协程数量加1
 
@@ -56,26 +261,26 @@ Fiber::Fiber() {
 
 }      
 
-Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool user_caller) : m_id(++s_fiber_id), m_cb(cb){
+Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool user_caller, bool shared_stack)
+    : m_id(++s_fiber_id), m_cb(cb){
     /// 真正创建一个执行协程(子协程)
     ++s_fiber_count;
 
+#ifdef SYLAR_FIBER_USE_FCONTEXT
+    if(shared_stack && !user_caller) {
+        // 第一次swapIn时才在线程的共享栈上准备上下文
+        m_shared = true;
+        SYLAR_LOG_DEBUG(g_logger) << "Fiber::Fiber id=" << m_id << " shared stack";
+        return;
+    }
+#endif
     m_stacksize = stacksize ? stacksize : g_fiber_stack_size->getValue();
     m_stack = StackAllocator::Alloc(m_stacksize);   // 分配内存空间给栈使用
 
-    if(getcontext(&m_ctx)) {
-        SYLAR_ASSERT2(false, "getcontext");
-    }
-    /// 设置上下文
-    m_ctx.uc_link = nullptr;    // 该协程关联的上文
-    // m_ctx.uc_link = &t_threadFiber->m_ctx;    // 该协程结束后，会回到主协程
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
-
     if (user_caller) {
-        makecontext(&m_ctx, &Fiber::CallerMainFunc, 0);   // 设置执行完后的回调函数
+        makeContext(&Fiber::CallerMainFunc);   // 设置执行完后的回调函数
     } else {
-        makecontext(&m_ctx, &Fiber::MainFunc, 0);   // 设置执行完后的回调函数
+        makeContext(&Fiber::MainFunc);   // 设置执行完后的回调函数
     }
 
     SYLAR_LOG_DEBUG(g_logger) << "Fiber::Fiber id=" << m_id;
@@ -85,12 +290,15 @@ Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool user_caller) : m_i
 Fiber::~Fiber() {
     --s_fiber_count;
 
-    if (m_stack) {      
+    if (m_stack || m_shared) {
         SYLAR_ASSERT(m_state == TERM
                     || m_state == EXCEPT
                     || m_state == INIT);
 
-        StackAllocator::Dealloc(m_stack, m_stacksize);
+        if(m_stack) {
+            StackAllocator::Dealloc(m_stack, m_stacksize);
+        }
+        freeSaved();
     } else { // 主协程没有栈，不需要回收
         // 确认是主协程
         SYLAR_ASSERT(!m_cb);
@@ -107,7 +315,7 @@ Fiber::~Fiber() {
 
 /// 重置协程执行函数，并设置状态 -> 减少内存分配和释放操作
 void Fiber::reset(std::function<void()> cb) {
-    SYLAR_ASSERT(m_stack); // 要求有栈
+    SYLAR_ASSERT(m_stack || m_shared); // 要求有栈
 
     SYLAR_ASSERT(m_state == TERM
                 || m_state == EXCEPT
@@ -115,16 +323,95 @@ void Fiber::reset(std::function<void()> cb) {
 
     m_cb = cb;  // 重新设置执行函数
 
+    if(m_shared) {
+#ifdef SYLAR_FIBER_USE_FCONTEXT
+        // 还没有运行过, 可以在任意线程上开始
+        freeSaved();
+        m_ctx = nullptr;
+        m_thread = -1;
+#endif
+    } else {
+        makeContext(&Fiber::MainFunc);   // 设置执行完后的回调函数
+    }
+    m_state = INIT;
+}
+
+void Fiber::freeSaved() {
+#ifdef SYLAR_FIBER_USE_FCONTEXT
+    if(m_saved) {
+        s_shared_saved_bytes -= m_savedCap;
+        free(m_saved);
+        m_saved = nullptr;
+    }
+    m_savedSize = 0;
+    m_savedCap = 0;
+#endif
+}
+
+void Fiber::restoreStack() {
+#ifdef SYLAR_FIBER_USE_FCONTEXT
+    int thread = GetThreadId();
+    if(m_thread == -1) {
+        m_thread = thread;
+    }
+    // 栈上的指针都是绝对地址, 只能回到同一个线程的共享栈上继续运行
+    SYLAR_ASSERT2(m_thread == thread, "shared stack fiber resumed on another thread");
+
+    char* top = t_sharedStack.top();
+    if(!m_ctx) {
+        m_ctx = make_fcontext(t_sharedStack.base, t_sharedStack.size, &Fiber::MainFunc);
+    } else {
+        memcpy(top - m_savedSize, m_saved, m_savedSize);
+    }
+#endif
+}
+
+void Fiber::saveStack() {
+#ifdef SYLAR_FIBER_USE_FCONTEXT
+    if(m_state == TERM || m_state == EXCEPT) {
+        freeSaved();
+        return;
+    }
+    // 只复制从栈指针到栈顶实际用到的部分
+    char* top = t_sharedStack.top();
+    size_t used = top - (char*)m_ctx;
+    if(used > m_savedCap || used < m_savedCap / 4) {
+        // 按实际大小分配, 用量大幅减少时也缩小
+        s_shared_saved_bytes += used;
+        s_shared_saved_bytes -= m_savedCap;
+        m_saved = (char*)realloc(m_saved, used);
+        m_savedCap = used;
+    }
+    memcpy(m_saved, m_ctx, used);
+    m_savedSize = used;
+#endif
+}
+
+void Fiber::makeContext(void (*fn)()) {
+#ifdef SYLAR_FIBER_USE_FCONTEXT
+    m_ctx = make_fcontext(m_stack, m_stacksize, fn);
+#else
     if(getcontext(&m_ctx)) {
         SYLAR_ASSERT2(false, "getcontext");
     }
-
-    m_ctx.uc_link = nullptr;
+    /// 设置上下文
+    m_ctx.uc_link = nullptr;    // 该协程关联的上文
+    // m_ctx.uc_link = &t_threadFiber->m_ctx;    // 该协程结束后，会回到主协程
     m_ctx.uc_stack.ss_sp = m_stack;
     m_ctx.uc_stack.ss_size = m_stacksize;
 
-    makecontext(&m_ctx, &Fiber::MainFunc, 0);   // 设置执行完后的回调函数
-    m_state = INIT;
+    makecontext(&m_ctx, fn, 0);
+#endif
+}
+
+void Fiber::SwapContext(Fiber* from, Fiber* to) {
+#ifdef SYLAR_FIBER_USE_FCONTEXT
+    sylar_jump_fcontext(&from->m_ctx, to->m_ctx);
+#else
+    if(swapcontext(&from->m_ctx, &to->m_ctx)) {
+        SYLAR_ASSERT2(false, "swapcontext");
+    }
+#endif
 }
 
 /// 将当前协程切换到运行态执行
@@ -138,10 +425,14 @@ void Fiber::swapIn() {
     // if(swapcontext(&t_threadFiber->m_ctx, &m_ctx)) {
 
     // 和协程调度器的主协程交换
-    if(swapcontext(&Scheduler::GetMainFiber()->m_ctx, &m_ctx)) {
-        SYLAR_ASSERT2(false, "swapcontext");
+    if(m_shared) {
+        restoreStack();
+        SwapContext(Scheduler::GetMainFiber(), this);
+        // 已经回到主协程的栈上, 可以把协程用到的共享栈复制出去
+        saveStack();
+    } else {
+        SwapContext(Scheduler::GetMainFiber(), this);
     }
-    
 
 }
 
@@ -149,24 +440,22 @@ void Fiber::swapIn() {
 /// 将当前协程切换到后台, 运行主协程
 void Fiber::back() {
     SetThis(t_threadFiber.get());
-    if(swapcontext(&m_ctx, &t_threadFiber->m_ctx)) {
-        SYLAR_ASSERT2(false, "swapcontext");
-    }
+    SwapContext(this, t_threadFiber.get());
 }
 
 /// 将当前协程切换到后台, 运行主协程
 void Fiber::swapOut() {
     SetThis(Scheduler::GetMainFiber());
-    if(swapcontext(&m_ctx, &Scheduler::GetMainFiber()->m_ctx)) {
-        SYLAR_ASSERT2(false, "swapcontext");
-    }
+    SwapContext(this, Scheduler::GetMainFiber());
 }
 
 void Fiber::call() {
+    SYLAR_ASSERT2(!m_shared, "shared stack fiber must run in a scheduler");
     SetThis(this);
     m_state = EXEC;
-    if(swapcontext(&t_threadFiber->m_ctx, &m_ctx)) {
-        SYLAR_ASSERT2(false, "swapcontext");
+    SwapContext(t_threadFiber.get(), this);
+    if(m_state == EXEC) {
+        m_state = HOLD;
     }
 }
 
@@ -187,6 +476,10 @@ Fiber::ptr Fiber::GetThis() {
     return t_fiber->shared_from_this();
 }
 
+bool Fiber::InMainFiber() {
+    return !t_fiber || t_fiber == t_threadFiber.get();
+}
+
 /// 将当前协程切换到后台,设置为READY状态, 
 void Fiber::YieldToReady() {
     Fiber::ptr cur = GetThis();
@@ -200,9 +493,23 @@ void Fiber::YieldToHold() {
     Fiber::ptr cur = GetThis();
     SYLAR_ASSERT(cur->m_state == EXEC);
 
-    cur->m_state = HOLD;
+    // 保持EXEC直到切换完成(由调度器/call改为HOLD), 否则协程可能在上下文保存完之前
+    // 就被其他线程的事件唤醒并恢复执行
     cur->swapOut();     // 切换到主协程
 }
+
+Fiber::StackPoolStats Fiber::GetStackPoolStats() {
+    StackPoolStats stats;
+    stats.hits = s_stack_hits;
+    stats.misses = s_stack_misses;
+    stats.bytes = s_stack_bytes;
+    stats.highWater = s_stack_high_water;
+#ifdef SYLAR_FIBER_USE_FCONTEXT
+    stats.sharedSaved = s_shared_saved_bytes;
+#endif
+    return stats;
+}
+
 /// 总协程数量
 uint64_t Fiber::TotalFibers() {
     return s_fiber_count;
@@ -8,6 +8,7 @@
 #include <memory>
 #include <functional>
 #include <ucontext.h>
+#include "fcontext.h"
 
 
 namespace sylar{     
@@ -39,13 +40,36 @@ public:
         EXCEPT
     };
 
+    /// 协程栈池统计(所有线程)
+    struct StackPoolStats {
+        /// 从池中取到栈的次数
+        uint64_t hits = 0;
+        /// 池中没有同样大小的栈, 重新分配的次数
+        uint64_t misses = 0;
+        /// 池中当前缓存的字节数
+        uint64_t bytes = 0;
+        /// bytes曾经达到的最大值
+        uint64_t highWater = 0;
+        /// 共享栈协程切出后保存栈内容占用的字节数
+        uint64_t sharedSaved = 0;
+    };
+
 private:
 
     Fiber();        // 私有，不允许直接构造，因为智能指针对象必须在堆上
 
 public:
 
-    Fiber(std::function<void()> cb, size_t stacksize = 0, bool use_caller = false);
+    /**
+     * @brief 构造子协程
+     * @param[in] cb 协程执行的函数
+     * @param[in] stacksize 栈大小, 0表示使用fiber.stack_size
+     * @param[in] use_caller 是否是use_caller的调度协程
+     * @param[in] shared_stack 是否在线程的共享栈上运行(只支持汇编上下文, 且必须由调度器执行)
+     *            切出时把用到的栈复制到刚好够大的缓冲区, 第一次运行后只能在同一个线程上恢复
+     */
+    Fiber(std::function<void()> cb, size_t stacksize = 0, bool use_caller = false
+          ,bool shared_stack = false);
     ~Fiber();
 
     /// 重置协程执行函数，并设置状态 -> 减少内存分配和释放操作
@@ -72,11 +96,17 @@ public:
 
     uint64_t getId() const { return m_id; }
     State getState() const { return m_state; }
+    /// 是否在共享栈上运行
+    bool isSharedStack() const { return m_shared;}
+    /// 共享栈协程绑定的线程id, 还没有运行过或者不是共享栈协程时为-1
+    int getBoundThread() const { return m_thread;}
     
     /// 设置当前协程
     static void SetThis(Fiber* f);
     /// 返回当前所在的协程
     static Fiber::ptr GetThis();
+    /// 当前是否在线程主协程中(还没有创建协程时也算)
+    static bool InMainFiber();
 
     /// 将当前协程切换到后台,并设置为READY状态
     static void YieldToReady();
@@ -85,6 +115,9 @@ public:
     /// 总协程数量
     static uint64_t TotalFibers();
 
+    /// 协程栈池的统计信息(fiber.stack_pool_max控制每个线程缓存的栈数量)
+    static StackPoolStats GetStackPoolStats();
+
     /**
      * @brief 协程执行函数
      * @post 执行完成返回到线程主协程
@@ -101,13 +134,34 @@ public:
     /// 获得当前协程id
     static uint64_t GetFiberId();
 
+private:
+    /// 在协程栈上准备上下文, 第一次切换进来时执行fn
+    void makeContext(void (*fn)());
+    /// 保存当前上下文到from, 切换到to
+    static void SwapContext(Fiber* from, Fiber* to);
+    /// 共享栈协程: 切入前把保存的栈内容复制回共享栈
+    void restoreStack();
+    /// 共享栈协程: 切出后把用到的共享栈复制到缓冲区
+    void saveStack();
+    /// 释放共享栈协程保存栈内容的缓冲区
+    void freeSaved();
+
 private:
     uint64_t m_id = 0;          // 协程id
     uint32_t m_stacksize = 0;   // 协程运行栈大小
     State m_state = INIT;       // 协程状态
+#ifdef SYLAR_FIBER_USE_FCONTEXT
+    fcontext_t m_ctx = nullptr; // 协程上下文(汇编实现)
+#else
     ucontext_t m_ctx;           // 协程上下文
+#endif
     void* m_stack = nullptr;    // 协程运行栈指针
     std::function<void()> m_cb; // 协程运行函数
+    bool m_shared = false;      // 是否在共享栈上运行
+    int m_thread = -1;          // 共享栈协程绑定的线程
+    char* m_saved = nullptr;    // 共享栈协程切出后保存的栈内容
+    size_t m_savedSize = 0;     // 保存的栈内容大小
+    size_t m_savedCap = 0;      // 缓冲区大小
 };
 
 
@@ -0,0 +1,184 @@
+#include "fiber_mutex.h"
+#include "scheduler.h"
+#include "macro.h"
+
+namespace sylar {
+
+void FiberWaitQueue::Waiter::wake() {
+    if(sem) {
+        sem->notify();
+        return;
+    }
+    // 协程可能还没有切出, 调度器会等它切出后再执行
+    scheduler->schedule(std::move(fiber));
+}
+
+void FiberWaitQueue::push(Semaphore& sem) {
+    m_waiters.push_back(Waiter());
+    Waiter& waiter = m_waiters.back();
+    // use_caller调度器的caller线程在stop()之前也有调度器, 但它的主协程不能挂起
+    waiter.scheduler = Scheduler::GetTaskScheduler();
+    if(waiter.scheduler) {
+        waiter.fiber = Fiber::GetThis();
+    } else {
+        waiter.sem = &sem;
+    }
+}
+
+void FiberWaitQueue::Park(Semaphore& sem) {
+    if(Scheduler::GetTaskScheduler()) {
+        Fiber::YieldToHold();
+    } else {
+        sem.wait();
+    }
+}
+
+bool FiberWaitQueue::pop(Waiter& waiter) {
+    if(m_waiters.empty()) {
+        return false;
+    }
+    waiter = std::move(m_waiters.front());
+    m_waiters.pop_front();
+    return true;
+}
+
+FiberSemaphore::FiberSemaphore(uint32_t count)
+    : m_value(count) {
+}
+
+FiberSemaphore::~FiberSemaphore() {
+    SYLAR_ASSERT(m_waiters.empty());
+}
+
+void FiberSemaphore::wait() {
+    if(m_value.fetch_sub(1, std::memory_order_acquire) > 0) {
+        return;
+    }
+    Semaphore sem;
+    {
+        Spinlock::Lock lock(m_mutex);
+        if(m_handoff) {
+            // notify已经把许可留给了我们
+            --m_handoff;
+            return;
+        }
+        m_waiters.push(sem);
+    }
+    FiberWaitQueue::Park(sem);
+}
+
+bool FiberSemaphore::tryWait() {
+    int64_t value = m_value.load(std::memory_order_relaxed);
+    while(value > 0) {
+        if(m_value.compare_exchange_weak(value, value - 1, std::memory_order_acquire)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void FiberSemaphore::notify() {
+    if(m_value.fetch_add(1, std::memory_order_release) >= 0) {
+        return;
+    }
+    // 有等待者, 许可直接交给它
+    FiberWaitQueue::Waiter waiter;
+    {
+        Spinlock::Lock lock(m_mutex);
+        if(!m_waiters.pop(waiter)) {
+            ++m_handoff;
+            return;
+        }
+    }
+    waiter.wake();
+}
+
+void FiberCondition::wait(FiberMutex& mutex) {
+    Semaphore sem;
+    {
+        Spinlock::Lock lock(m_mutex);
+        m_waiters.push(sem);
+    }
+    mutex.unlock();
+    FiberWaitQueue::Park(sem);
+    mutex.lock();
+}
+
+void FiberCondition::wait(FiberMutex::Lock& lock) {
+    Semaphore sem;
+    {
+        Spinlock::Lock lock2(m_mutex);
+        m_waiters.push(sem);
+    }
+    lock.unlock();
+    FiberWaitQueue::Park(sem);
+    lock.lock();
+}
+
+void FiberCondition::notify() {
+    FiberWaitQueue::Waiter waiter;
+    {
+        Spinlock::Lock lock(m_mutex);
+        if(!m_waiters.pop(waiter)) {
+            return;
+        }
+    }
+    waiter.wake();
+}
+
+void FiberCondition::notifyAll() {
+    std::deque<FiberWaitQueue::Waiter> waiters;
+    {
+        Spinlock::Lock lock(m_mutex);
+        m_waiters.takeAll(waiters);
+    }
+    for(auto& i : waiters) {
+        i.wake();
+    }
+}
+
+WaitGroup::WaitGroup(int64_t count)
+    : m_count(count) {
+}
+
+WaitGroup::~WaitGroup() {
+    SYLAR_ASSERT(m_waiters.empty());
+}
+
+void WaitGroup::add(int64_t n) {
+    m_count.fetch_add(n, std::memory_order_relaxed);
+}
+
+void WaitGroup::done() {
+    int64_t count = m_count.fetch_sub(1, std::memory_order_acq_rel) - 1;
+    SYLAR_ASSERT2(count >= 0, "WaitGroup::done called more times than add");
+    if(count) {
+        return;
+    }
+    std::deque<FiberWaitQueue::Waiter> waiters;
+    {
+        Spinlock::Lock lock(m_mutex);
+        m_waiters.takeAll(waiters);
+    }
+    for(auto& i : waiters) {
+        i.wake();
+    }
+}
+
+void WaitGroup::wait() {
+    if(m_count.load(std::memory_order_acquire) == 0) {
+        return;
+    }
+    Semaphore sem;
+    {
+        Spinlock::Lock lock(m_mutex);
+        // done在计数归零之后才加锁唤醒, 这里看到非0时一定会被唤醒
+        if(m_count.load(std::memory_order_acquire) == 0) {
+            return;
+        }
+        m_waiters.push(sem);
+    }
+    FiberWaitQueue::Park(sem);
+}
+
+}
@@ -0,0 +1,135 @@
+/**
+ * @file fiber_mutex.h
+ * @brief 协程级的同步原语: 信号量、互斥锁、条件变量、WaitGroup
+ * @details mutex.h中的锁会阻塞整个线程, 同一线程上的其他协程也跟着停下;
+ *          这里的原语在需要等待时只让出当前协程(YieldToHold), 唤醒时通过等待者所在的调度器重新调度
+ *          不竞争时加锁和解锁都只有一次原子操作
+ *          不在任务协程中(例如main线程, 包括use_caller调度器的caller线程)等待时阻塞当前线程;
+ *          notify/unlock可以在任意线程调用
+ */
+#ifndef __SYLAR_FIBER_MUTEX_H__
+#define __SYLAR_FIBER_MUTEX_H__
+
+#include <atomic>
+#include <deque>
+#include "mutex.h"
+#include "fiber.h"
+#include "noncopyable.h"
+
+namespace sylar {
+
+class Scheduler;
+
+/// 协程等待队列, 由使用者的锁保护
+class FiberWaitQueue {
+public:
+    /// 等待的协程和它所在的调度器
+    struct Waiter {
+        Scheduler* scheduler = nullptr;
+        Fiber::ptr fiber;
+        /// 不在任务协程中等待时, 阻塞线程用的信号量
+        Semaphore* sem = nullptr;
+
+        /// 把协程放回调度器(或唤醒阻塞的线程), 在释放使用者的锁之后调用
+        void wake();
+    };
+
+    /**
+     * @brief 将当前协程加入队尾, 调用者释放锁后需要Park
+     * @param[in] sem 不在任务协程中时阻塞线程用的信号量, 由调用者提供
+     */
+    void push(Semaphore& sem);
+    /// 挂起直到被wake: 任务协程让出, 否则阻塞在sem上
+    static void Park(Semaphore& sem);
+    /// 取出队头的等待者, 队列为空时返回false
+    bool pop(Waiter& waiter);
+    /// 取出全部等待者
+    void takeAll(std::deque<Waiter>& out) { out.swap(m_waiters);}
+
+    bool empty() const { return m_waiters.empty();}
+private:
+    std::deque<Waiter> m_waiters;
+};
+
+/// 协程信号量
+class FiberSemaphore : Noncopyable {
+public:
+    FiberSemaphore(uint32_t count = 0);
+    ~FiberSemaphore();
+
+    /// 获取信号量, 没有时让出当前协程
+    void wait();
+    /// 尝试获取信号量, 不等待
+    bool tryWait();
+    /// 释放信号量, 有等待者时直接交给队头的协程
+    void notify();
+
+private:
+    /// 大于等于0时是可用数, 小于0时是等待者数的相反数
+    std::atomic<int64_t> m_value;
+    /// 保护等待队列
+    Spinlock m_mutex;
+    FiberWaitQueue m_waiters;
+    /// notify时等待者已经计入m_value但还没进入队列, 许可留给它
+    uint64_t m_handoff = 0;
+};
+
+/// 协程互斥锁, 解锁时锁直接交给等待最久的协程(不会被新来的插队)
+class FiberMutex : Noncopyable {
+public:
+    typedef ScopedLockImpl<FiberMutex> Lock;
+
+    FiberMutex() : m_sem(1) {}
+
+    void lock() { m_sem.wait();}
+    bool tryLock() { return m_sem.tryWait();}
+    void unlock() { m_sem.notify();}
+private:
+    FiberSemaphore m_sem;
+};
+
+/// 协程条件变量, 配合FiberMutex使用
+class FiberCondition : Noncopyable {
+public:
+    /**
+     * @brief 释放mutex并等待通知, 返回前重新加锁
+     * @pre 当前协程持有mutex
+     */
+    void wait(FiberMutex& mutex);
+    void wait(FiberMutex::Lock& lock);
+
+    /// 唤醒一个等待的协程
+    void notify();
+    /// 唤醒全部等待的协程
+    void notifyAll();
+private:
+    Spinlock m_mutex;
+    FiberWaitQueue m_waiters;
+};
+
+/**
+ * @brief 等待一组任务完成
+ * @details 派发任务前add, 每个任务结束时done, wait的协程在计数归零时被唤醒
+ */
+class WaitGroup : Noncopyable {
+public:
+    WaitGroup(int64_t count = 0);
+    ~WaitGroup();
+
+    /// 增加计数
+    void add(int64_t n = 1);
+    /// 一个任务完成, 计数减1
+    void done();
+    /// 等待计数归零
+    void wait();
+    /// 当前计数
+    int64_t count() const { return m_count;}
+private:
+    std::atomic<int64_t> m_count;
+    Spinlock m_mutex;
+    FiberWaitQueue m_waiters;
+};
+
+}
+
+#endif
@@ -0,0 +1,367 @@
+/**
+ * @file future.h
+ * @brief 协程版的Future/Promise, 以及WhenAll/WhenAny
+ * @details 等待结果时只让出当前协程, 结果设置后通过等待者所在的调度器唤醒;
+ *          不在任务协程中(例如main线程)等待时阻塞当前线程
+ *          典型用法: 用Async把多个上游请求同时派发到调度器, 再用WhenAll等待,
+ *          总耗时是最慢的一个请求而不是所有请求之和
+ *          Async中func抛出的异常, 以及所有Promise都析构了还没有设置结果(std::future_error),
+ *          都保存为Future的结果, 在get()中重新抛出
+ */
+#ifndef __SYLAR_FUTURE_H__
+#define __SYLAR_FUTURE_H__
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <future>
+#include <exception>
+#include <functional>
+#include <type_traits>
+#include "mutex.h"
+#include "fiber.h"
+#include "scheduler.h"
+#include "iomanager.h"
+#include "macro.h"
+
+namespace sylar {
+
+template<class T> class Promise;
+
+/// Future和Promise共享的状态
+template<class T>
+struct FutureState {
+    Spinlock mutex;
+    /// 是否已经设置了结果
+    bool ready = false;
+    /// 结果
+    T value;
+    /// 异常, 和value只有一个有效
+    std::exception_ptr exception;
+    /// 共享这个状态的Promise个数, 归零时还没有结果则设置std::future_error
+    std::atomic<uint32_t> promises = {0};
+    /// 结果设置后执行的回调, 和它们的编号
+    std::vector<std::pair<uint64_t, std::function<void()> > > callbacks;
+    /// 下一个回调的编号, 从1开始
+    uint64_t nextId = 1;
+};
+
+/**
+ * @brief 异步结果
+ * @details 可以复制, 多个Future共享同一个结果
+ *          T需要可默认构造
+ */
+template<class T>
+class Future {
+friend class Promise<T>;
+public:
+    /// 构造一个无效的Future
+    Future() {}
+
+    bool valid() const { return (bool)m_state;}
+
+    bool isReady() const {
+        Spinlock::Lock lock(m_state->mutex);
+        return m_state->ready;
+    }
+
+    /**
+     * @brief 注册结果设置后执行的回调
+     * @details 已经有结果时在当前协程中立即执行; 否则在设置结果的协程中执行
+     * @return 回调的编号, 用于removeCallback; 立即执行时返回0
+     */
+    uint64_t onReady(std::function<void()> cb) const {
+        {
+            Spinlock::Lock lock(m_state->mutex);
+            if(!m_state->ready) {
+                uint64_t id = m_state->nextId++;
+                m_state->callbacks.push_back(std::make_pair(id, std::move(cb)));
+                return id;
+            }
+        }
+        cb();
+        return 0;
+    }
+
+    /**
+     * @brief 删除还没有执行的回调
+     * @return 回调已经执行或者不存在时返回false
+     */
+    bool removeCallback(uint64_t id) const {
+        std::function<void()> cb;
+        {
+            Spinlock::Lock lock(m_state->mutex);
+            auto& callbacks = m_state->callbacks;
+            for(auto it = callbacks.begin(); it != callbacks.end(); ++it) {
+                if(it->first == id) {
+                    // 回调持有的对象在锁外释放
+                    cb.swap(it->second);
+                    callbacks.erase(it);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief 等待结果
+     * @param[in] timeout_ms 超时时间, ~0ull表示一直等待; 超时需要在IOManager中使用
+     * @return 有结果返回true, 超时返回false
+     */
+    bool wait(uint64_t timeout_ms = ~0ull) const {
+        if(isReady()) {
+            return true;
+        }
+        Scheduler* scheduler = Scheduler::GetTaskScheduler();
+        if(!scheduler) {
+            // 不在任务协程中(包括use_caller调度器的caller线程), 阻塞线程
+            SYLAR_ASSERT2(timeout_ms == ~0ull, "Future timeout needs an IOManager");
+            Semaphore sem;
+            onReady([&sem](){
+                sem.notify();
+            });
+            sem.wait();
+            return true;
+        }
+        if(timeout_ms == 0) {
+            return false;
+        }
+
+        // 结果和定时器谁先到谁唤醒协程, 只唤醒一次
+        std::shared_ptr<std::atomic<bool> > woken(new std::atomic<bool>(false));
+        Fiber::ptr fiber = Fiber::GetThis();
+        std::function<void()> wake = [woken, scheduler, fiber](){
+            bool expected = false;
+            if(woken->compare_exchange_strong(expected, true)) {
+                scheduler->schedule(fiber);
+            }
+        };
+        Timer::ptr timer;
+        if(timeout_ms != ~0ull) {
+            IOManager* iom = IOManager::GetThis();
+            SYLAR_ASSERT2(iom, "Future timeout needs an IOManager");
+            timer = iom->addTimer(timeout_ms, wake);
+        }
+        uint64_t id = onReady(wake);
+        Fiber::YieldToHold();
+        if(timer) {
+            timer->cancel();
+            // 超时后删除自己的回调, 否则它持有的协程要等到有结果才释放
+            removeCallback(id);
+        }
+        return isReady();
+    }
+
+    /**
+     * @brief 结果是异常时返回它
+     * @pre isReady()
+     */
+    std::exception_ptr getException() const {
+        Spinlock::Lock lock(m_state->mutex);
+        return m_state->exception;
+    }
+
+    /**
+     * @brief 等待并返回结果
+     * @exception 结果是异常时重新抛出
+     */
+    const T& get() const {
+        wait();
+        if(m_state->exception) {
+            std::rethrow_exception(m_state->exception);
+        }
+        return m_state->value;
+    }
+private:
+    Future(std::shared_ptr<FutureState<T> > state)
+        : m_state(state) {
+    }
+private:
+    std::shared_ptr<FutureState<T> > m_state;
+};
+
+/// 设置异步结果
+template<class T>
+class Promise {
+public:
+    Promise()
+        : m_state(std::make_shared<FutureState<T> >()) {
+        m_state->promises = 1;
+    }
+
+    Promise(const Promise& rhs)
+        : m_state(rhs.m_state) {
+        ++m_state->promises;
+    }
+
+    Promise(Promise&& rhs)
+        : m_state(std::move(rhs.m_state)) {
+    }
+
+    Promise& operator=(Promise rhs) {
+        m_state.swap(rhs.m_state);
+        return *this;
+    }
+
+    /// 最后一个Promise析构时还没有结果, 等待者得到std::future_error(broken_promise)
+    ~Promise() {
+        if(!m_state || --m_state->promises) {
+            return;
+        }
+        bool ready = false;
+        {
+            Spinlock::Lock lock(m_state->mutex);
+            ready = m_state->ready;
+        }
+        // 已经是最后一个Promise, 不会再有别人设置结果
+        if(!ready) {
+            setException(std::make_exception_ptr(
+                        std::future_error(std::future_errc::broken_promise)));
+        }
+    }
+
+    Future<T> getFuture() const { return Future<T>(m_state);}
+
+    /**
+     * @brief 设置结果, 唤醒等待者
+     * @return 已经设置过时返回false
+     */
+    bool setValue(const T& v) {
+        T tmp(v);
+        return setValue(std::move(tmp));
+    }
+
+    bool setValue(T&& v) {
+        std::vector<std::pair<uint64_t, std::function<void()> > > callbacks;
+        {
+            Spinlock::Lock lock(m_state->mutex);
+            if(m_state->ready) {
+                return false;
+            }
+            m_state->value = std::move(v);
+            m_state->ready = true;
+            callbacks.swap(m_state->callbacks);
+        }
+        for(auto& i : callbacks) {
+            i.second();
+        }
+        return true;
+    }
+
+    /**
+     * @brief 设置异常作为结果, 唤醒等待者, get()时重新抛出
+     * @return 已经设置过时返回false
+     */
+    bool setException(std::exception_ptr e) {
+        std::vector<std::pair<uint64_t, std::function<void()> > > callbacks;
+        {
+            Spinlock::Lock lock(m_state->mutex);
+            if(m_state->ready) {
+                return false;
+            }
+            m_state->exception = e;
+            m_state->ready = true;
+            callbacks.swap(m_state->callbacks);
+        }
+        for(auto& i : callbacks) {
+            i.second();
+        }
+        return true;
+    }
+private:
+    std::shared_ptr<FutureState<T> > m_state;
+};
+
+/**
+ * @brief 在调度器中执行func, 返回它的结果
+ * @details func抛出的异常在Future::get()中重新抛出
+ * @param[in] thread 指定执行的线程, -1表示任意线程
+ */
+template<class F>
+auto Async(Scheduler* scheduler, F func, int thread = -1)
+        -> typename std::enable_if<!std::is_void<decltype(func())>::value
+                                   ,Future<decltype(func())> >::type {
+    Promise<decltype(func())> promise;
+    scheduler->schedule([promise, func]() mutable {
+        try {
+            promise.setValue(func());
+        } catch (...) {
+            promise.setException(std::current_exception());
+        }
+    }, thread);
+    return promise.getFuture();
+}
+
+/**
+ * @brief 没有返回值的func
+ * @details 不支持Future<void>, 完成后的结果固定是true
+ */
+template<class F>
+auto Async(Scheduler* scheduler, F func, int thread = -1)
+        -> typename std::enable_if<std::is_void<decltype(func())>::value
+                                   ,Future<bool> >::type {
+    return Async(scheduler, [func]() mutable {
+        func();
+        return true;
+    }, thread);
+}
+
+/**
+ * @brief 全部完成后得到所有结果, 顺序和futures相同
+ * @details 有结果是异常时, 得到排在最前面的那个异常
+ */
+template<class T>
+Future<std::vector<T> > WhenAll(const std::vector<Future<T> >& futures) {
+    struct Context {
+        std::atomic<size_t> remain;
+        std::vector<Future<T> > futures;
+        Promise<std::vector<T> > promise;
+    };
+    std::shared_ptr<Context> ctx(new Context);
+    ctx->remain = futures.size();
+    ctx->futures = futures;
+    Future<std::vector<T> > rt = ctx->promise.getFuture();
+    if(futures.empty()) {
+        ctx->promise.setValue(std::vector<T>());
+        return rt;
+    }
+    for(auto& i : futures) {
+        i.onReady([ctx](){
+            if(--ctx->remain) {
+                return;
+            }
+            std::vector<T> values;
+            values.reserve(ctx->futures.size());
+            for(auto& f : ctx->futures) {
+                std::exception_ptr e = f.getException();
+                if(e) {
+                    ctx->futures.clear();
+                    ctx->promise.setException(e);
+                    return;
+                }
+                values.push_back(f.get());
+            }
+            ctx->futures.clear();
+            ctx->promise.setValue(std::move(values));
+        });
+    }
+    return rt;
+}
+
+/// 任意一个完成(包括结果是异常)后得到它在futures中的下标
+template<class T>
+Future<size_t> WhenAny(const std::vector<Future<T> >& futures) {
+    SYLAR_ASSERT(!futures.empty());
+    Promise<size_t> promise;
+    for(size_t i = 0; i < futures.size(); ++i) {
+        futures[i].onReady([promise, i]() mutable {
+            promise.setValue(i);
+        });
+    }
+    return promise.getFuture();
+}
+
+}
+
+#endif
@@ -2,7 +2,10 @@
 #include "fiber.h"
 #include "iomanager.h"
 #include "fd_manager.h"
+#include "offload.h"
 #include <dlfcn.h>
+#include <poll.h>
+#include <string.h>
 #include "log.h"
 #include "config.h"
 sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
@@ -15,6 +18,10 @@ static thread_local bool t_hook_enable = false;     // 线程局部变量，判
 static sylar::ConfigVar<int>::ptr g_tcp_connect_timeout =
         sylar::Config::Lookup("tcp.connect.timeout", 5000, "tcp connect timeout");
 
+// 非socket fd的open/read/write是否交给offload线程池执行
+static sylar::ConfigVar<bool>::ptr g_offload_file_io =
+        sylar::Config::Lookup("offload.file_io", false, "offload blocking file io to thread pool");
+
 #define HOOK_FUN(XX) \
     XX(sleep) \
     XX(usleep) \
@@ -32,6 +39,7 @@ static sylar::ConfigVar<int>::ptr g_tcp_connect_timeout =
     XX(send) \
     XX(sendto) \
     XX(sendmsg) \
+    XX(open) \
     XX(close) \
     XX(fcntl) \
     XX(ioctl) \
@@ -51,6 +59,7 @@ void hook_init() {
 
 
 static uint64_t s_connect_timeout = -1;
+static bool s_offload_file_io = false;
 
 struct _HookIniter {
     _HookIniter() {
@@ -63,6 +72,13 @@ struct _HookIniter {
                                         << old_value << " to " << new_value;
                 s_connect_timeout = new_value;
         });
+
+        s_offload_file_io = g_offload_file_io->getValue();
+        g_offload_file_io->addListener([](const bool& old_value, const bool& new_value){
+                SYLAR_LOG_INFO(g_logger) << "offload file io changed from "
+                                        << old_value << " to " << new_value;
+                s_offload_file_io = new_value;
+        });
     }
 };
 static _HookIniter s_hook_initer;
@@ -78,21 +94,68 @@ void set_hook_enable(bool flag) {
 
 } // sylar
 
-/// 存放条件的结构体，为了条件定时器
-/// ??? 为什么要用结构体，直接用int类型变量不可以吗??
-struct timer_info {
-    int cancelled = 0;
-};
-
-
 ///!! 注意，下面的函数定义在全局namespace，所以才会覆盖原始的库函数
 
 /// 读写的Socket函数封装
 // fun: 原始的函数；hook_fun_name: 函数名； event: 事件类型；timeout_so： time_out的类型
 // Args: fun函数需要的参数（可变）
+/// 构造io_uring请求
+static io_uring_sqe make_sqe(uint8_t opcode, int fd, const void* addr, uint32_t len) {
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = opcode;
+    sqe.fd = fd;
+    sqe.addr = (uint64_t)addr;
+    sqe.len = len;
+    return sqe;
+}
+
+/// 等待fd就绪的io_uring请求, 用于没有对应io_uring操作的调用
+static io_uring_sqe make_poll_sqe(int fd, uint32_t event) {
+    io_uring_sqe sqe = make_sqe(IORING_OP_POLL_ADD, fd, nullptr, 0);
+    // IOManager::READ/WRITE和POLLIN/POLLOUT的值相同
+    sqe.poll32_events = event;
+    return sqe;
+}
+
+/**
+ * @brief 通过io_uring等待
+ * @param[in] uop 直接完成IO的请求, 为nullptr时等待fd就绪
+ * @return 直接请求完成时返回结果; 返回-EAGAIN表示fd已就绪(或直接请求遇到EAGAIN), 需要重新执行系统调用
+ */
+static ssize_t uring_wait(sylar::IOManager* iom, const sylar::FdCtx::ptr& ctx, int fd,
+                          uint32_t event, const io_uring_sqe* uop, uint64_t to) {
+    io_uring_sqe sqe = uop ? *uop : make_poll_sqe(fd, event);
+    int res = iom->uringWait(sqe, to);
+    if(res == -ECANCELED) {
+        // 超时或者fd已经被关闭
+        return sylar::FdMgr::GetInstance()->get(fd) == ctx ? -ETIMEDOUT : -EBADF;
+    }
+    if(!uop && res >= 0) {
+        return -EAGAIN;
+    }
+    return res;
+}
+
+/**
+ * @brief 在offload线程池中执行原始的阻塞调用
+ * @details 参数按值捕获; errno是线程局部的, 需要带回当前线程
+ */
+template<typename OriginFun, typename... Args>
+static ssize_t offload_io(int fd, OriginFun fun, Args... args) {
+    std::pair<ssize_t, int> rt = sylar::Offload([fd, fun, args...]() {
+        ssize_t n = fun(fd, args...);
+        return std::make_pair(n, n < 0 ? errno : 0);
+    });
+    if(rt.first < 0) {
+        errno = rt.second;
+    }
+    return rt.first;
+}
+
 template<typename OriginFun, typename... Args>
 static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
-                     uint32_t event, int timeout_so, Args&&... args) {
+                     uint32_t event, int timeout_so, const io_uring_sqe* uop, Args&&... args) {
     if (!sylar::t_hook_enable) {    // 判断是否hook
         return fun(fd, std::forward<Args>(args)...);
     }
@@ -109,7 +172,17 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
         return -1;
     }
 
-    if(!ctx->isSocket() || ctx->getUserNonblock()) {
+    if(!ctx->isSocket()) {
+        // 普通文件不能用epoll等待, 只能交给线程池阻塞执行
+        // 共享栈模式下buf可能在协程栈上, 协程切出后线程池不能访问, 直接执行
+        sylar::Scheduler* scheduler = sylar::Scheduler::GetTaskScheduler();
+        if(sylar::s_offload_file_io && scheduler && !scheduler->isSharedStack()) {
+            return offload_io(fd, fun, std::forward<Args>(args)...);
+        }
+        return fun(fd, std::forward<Args>(args)...);
+    }
+
+    if(ctx->getUserNonblock()) {
         // 如果不是Socket, 或者是Socket但是用户已经设置为非阻塞的，则我们也不需要处理!!! why??
         return fun(fd, std::forward<Args>(args)...);
     }
@@ -118,8 +191,6 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
 
     uint64_t to = ctx->getTimeout(timeout_so);    // 获得超时时间
 
-    std::shared_ptr<timer_info> tinfo(new timer_info);  // 创建条件
-
 retry:
     ssize_t n = fun(fd, std::forward<Args>(args)...); // 执行原始方法
 
@@ -131,48 +202,35 @@ retry:
     if (n == -1 && errno == EAGAIN) {   // 非阻塞但是条件不满足，就会出现EAGAIN错误
         // 开始异步管理
         sylar::IOManager* iom = sylar::IOManager::GetThis();
-        sylar::Timer::ptr timer;
-        std::weak_ptr<timer_info> winfo(tinfo);    // 条件
-
-        if (to != (uint64_t)-1) {   // 说明设置了超时时间
-            timer = iom->addConditionTimer(to, [winfo, fd, iom, event]() {
-                auto t = winfo.lock();  // 检查条件是否还存在
-                if(!t || t->cancelled) {    // 如果条件不存在  或 已经到了超时时间 
-                    return;
-                }
-                t->cancelled = ETIMEDOUT;       // 设置超时时间
-                iom->cancelEvent(fd, (sylar::IOManager::Event)(event));  //  取消fd上的事件
-            }, winfo);
+        if(iom->isUring()) {
+            // 直接提交IO请求, 完成时协程恢复, 不需要epoll_ctl注册和再次读写
+            ssize_t res = uring_wait(iom, ctx, fd, event, uop, to);
+            if(res == -EAGAIN) {
+                // 直接请求也遇到了EAGAIN, 之后改为等待fd就绪
+                uop = nullptr;
+                goto retry;
+            }
+            if(res < 0) {
+                errno = -res;
+                return -1;
+            }
+            return res;
         }
-
-        int rt = iom->addEvent(fd, (sylar::IOManager::Event)(event));   // 添加事件,但是不需要指定cb
-        if (rt) {       // 添加事件操作出错
+        // 超时状态保存在fd的事件上下文中, 定时器在第一次超时等待时创建, 之后反复使用
+        int rt = iom->waitEvent(fd, (sylar::IOManager::Event)(event), to);
+        if (rt == -1) {       // 添加事件操作出错
             SYLAR_LOG_ERROR(g_logger) << hook_fun_name << " addEvent("
                 << fd << ", " << event << ")";
-            
-            if(timer) {     // 还需要取消定时器，会在定时器容器类型中删除该定时器对象
-                timer->cancel();
-            }
             return -1;
-        } else {    // 事件添加成功
-       // SYLAR_LOG_INFO(g_logger) <<" !!!!!!begin do_io<< " << hook_fun_name << ">>";
-            sylar::Fiber::YieldToHold();    // 放弃CPU, 可以执行其他任务
-    // SYLAR_LOG_INFO(g_logger) <<" !!!!!!!end yibu do_io<< " << hook_fun_name << ">>";
-
-            if(timer) { // 如果提前唤醒，则取消timer
-                timer->cancel();
-            }
-            if(tinfo->cancelled) {      // 说明等待超时
-                errno = tinfo->cancelled;
-                return -1;
-            }
-
-            goto retry;     // 说明此时是因为fd上有读事件，其实如果不考虑多线程抢占，下次n一定不是0了
+        } else if (rt) {      // 说明等待超时
+            errno = rt;
+            return -1;
         }
+        goto retry;     // 说明此时是因为fd上有读事件，其实如果不考虑多线程抢占，下次n一定不是0了
     }
 
     return n;   // 如果读到数据，则可以直接返回
-    // 这个时候虽然对应的timer没有被手动释放，但是winfo是空，因此即使该timer到达时间触发执行，也不会做任何操作
+    // 事件先发生时定时器已经在waitEvent中停止, 即使回调已经在排队, 看到deadline已更新也不会做任何操作
     // 反而，如果到达超时时间还没有读到数据，则会执行其中的函数取消事件                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                            
 }
 
@@ -222,7 +280,7 @@ int usleep(useconds_t usec) {
     // iom->addTimer(usec / 1000, [iom, fiber] () {
     //     iom->schedule(fiber);
     // });
-    iom->addTimer(usec / 1000, std::bind((void(sylar::Scheduler::*)
+    iom->addTimerUs(usec, std::bind((void(sylar::Scheduler::*)
         (sylar::Fiber::ptr, int thread))&sylar::IOManager::schedule
         ,iom, fiber, -1));
     sylar::Fiber::YieldToHold();  // 当前协程放弃CPU，则可以运行其他协程
@@ -235,13 +293,14 @@ int nanosleep(const struct timespec *req, struct timespec *rem) {
         return nanosleep_f(req, rem);
     }
 
-    int timeout_ms = req->tv_sec * 1000 + req->tv_nsec / 1000 /1000;    // 可能有精度问题
+    // 定时器精度是微秒, 不足1微秒的部分向上取整, 不会提前唤醒
+    uint64_t timeout_us = req->tv_sec * 1000000ull + (req->tv_nsec + 999) / 1000;
     sylar::Fiber::ptr fiber = sylar::Fiber::GetThis();
     sylar::IOManager* iom = sylar::IOManager::GetThis();
     // iom->addTimer(timeout_ms, [iom, fiber] () {
     //     iom->schedule(fiber);
     // });
-    iom->addTimer(timeout_ms, std::bind((void(sylar::Scheduler::*)
+    iom->addTimerUs(timeout_us, std::bind((void(sylar::Scheduler::*)
         (sylar::Fiber::ptr, int thread))&sylar::IOManager::schedule
         ,iom, fiber, -1));
     sylar::Fiber::YieldToHold();
@@ -292,37 +351,21 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
     
     // 开始设置定时任务
     sylar::IOManager* iom = sylar::IOManager::GetThis();
-    sylar::Timer::ptr timer;
-    std::shared_ptr<timer_info> tinfo(new timer_info);
-    std::weak_ptr<timer_info> winfo(tinfo);
-
-    if (timeout_ms != (uint64_t)-1) {
-        timer = iom->addConditionTimer(timeout_ms, [winfo, fd, iom](){
-            auto t = winfo.lock();
-            if (!t || t->cancelled) {
-                return;
-            }
-            t->cancelled = ETIMEDOUT;
-            iom->cancelEvent(fd, sylar::IOManager::WRITE);
-        }, winfo);
-    }
-
-    int rt = iom->addEvent(fd, sylar::IOManager::WRITE); // 写事件??  只要可以连接，就可写，将会触发
-    if (rt == 0) { // 事件添加成功
-        sylar::Fiber::YieldToHold();
-
-        if (timer) {
-            timer->cancel();
-        }
-        if (tinfo->cancelled) {
-            errno = tinfo->cancelled;
+    if(iom->isUring()) {
+        // 等待可写之后检查连接结果
+        ssize_t res = uring_wait(iom, ctx, fd, sylar::IOManager::WRITE, nullptr, timeout_ms);
+        if(res != -EAGAIN) {
+            errno = -res;
             return -1;
         }
     } else {
-        if (timer) {
-            timer->cancel();
+        int rt = iom->waitEvent(fd, sylar::IOManager::WRITE, timeout_ms); // 只要可以连接，就可写，将会触发
+        if (rt == -1) {
+            SYLAR_LOG_ERROR(g_logger) << "connect addEvent(" << fd << ", WRITE) error";
+        } else if (rt) {
+            errno = rt;
+            return -1;
         }
-        SYLAR_LOG_ERROR(g_logger) << "connect addEvent(" << fd << ", WRITE) error";
     }
     
     // 可以连接，然后去检查连接是否成功
@@ -351,7 +394,9 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 
 int accept(int s, struct sockaddr *addr, socklen_t *addrlen) {
     // accpet实际上相当于从监听套接字中执行读操作
-    int fd = do_io(s, accept_f, "accept", sylar::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+    io_uring_sqe sqe = make_sqe(IORING_OP_ACCEPT, s, addr, 0);
+    sqe.addr2 = (uint64_t)addrlen;
+    int fd = do_io(s, accept_f, "accept", sylar::IOManager::READ, SO_RCVTIMEO, &sqe, addr, addrlen);
     if(fd >= 0) {       // 读到的，则会返回一个socket套接字
         sylar::FdMgr::GetInstance()->get(fd, true);     // 加入记录中
     }
@@ -360,47 +405,87 @@ int accept(int s, struct sockaddr *addr, socklen_t *addrlen) {
 
 
 ssize_t read(int fd, void *buf, size_t count) {
-    return do_io(fd, read_f, "read", sylar::IOManager::READ, SO_RCVTIMEO, buf, count);
+    io_uring_sqe sqe = make_sqe(IORING_OP_RECV, fd, buf, count);
+    return do_io(fd, read_f, "read", sylar::IOManager::READ, SO_RCVTIMEO, &sqe, buf, count);
 }
 
 ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
-    return do_io(fd, readv_f, "readv", sylar::IOManager::READ, SO_RCVTIMEO, iov, iovcnt);
+    return do_io(fd, readv_f, "readv", sylar::IOManager::READ, SO_RCVTIMEO, nullptr, iov, iovcnt);
 }
 
 ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
-    return do_io(sockfd, recv_f, "recv", sylar::IOManager::READ, SO_RCVTIMEO, buf, len, flags);
+    io_uring_sqe sqe = make_sqe(IORING_OP_RECV, sockfd, buf, len);
+    sqe.msg_flags = flags;
+    return do_io(sockfd, recv_f, "recv", sylar::IOManager::READ, SO_RCVTIMEO, &sqe, buf, len, flags);
 }
 
 ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen) {
-    return do_io(sockfd, recvfrom_f, "recvfrom", sylar::IOManager::READ, SO_RCVTIMEO, buf, len, flags, src_addr, addrlen);
+    return do_io(sockfd, recvfrom_f, "recvfrom", sylar::IOManager::READ, SO_RCVTIMEO, nullptr, buf, len, flags, src_addr, addrlen);
 }
 
 ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
-    return do_io(sockfd, recvmsg_f, "recvmsg", sylar::IOManager::READ, SO_RCVTIMEO, msg, flags);
+    return do_io(sockfd, recvmsg_f, "recvmsg", sylar::IOManager::READ, SO_RCVTIMEO, nullptr, msg, flags);
 }
 
 ssize_t write(int fd, const void *buf, size_t count) {
-    return do_io(fd, write_f, "write", sylar::IOManager::WRITE, SO_SNDTIMEO, buf, count);
+    io_uring_sqe sqe = make_sqe(IORING_OP_SEND, fd, buf, count);
+    return do_io(fd, write_f, "write", sylar::IOManager::WRITE, SO_SNDTIMEO, &sqe, buf, count);
 }
 
 ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
-    return do_io(fd, writev_f, "writev", sylar::IOManager::WRITE, SO_SNDTIMEO, iov, iovcnt);
+    return do_io(fd, writev_f, "writev", sylar::IOManager::WRITE, SO_SNDTIMEO, nullptr, iov, iovcnt);
 }
 
 ssize_t send(int s, const void *msg, size_t len, int flags) {
-    return do_io(s, send_f, "send", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags);
+    io_uring_sqe sqe = make_sqe(IORING_OP_SEND, s, msg, len);
+    sqe.msg_flags = flags;
+    return do_io(s, send_f, "send", sylar::IOManager::WRITE, SO_SNDTIMEO, &sqe, msg, len, flags);
 }
 
 ssize_t sendto(int s, const void *msg, size_t len, int flags, const struct sockaddr *to, socklen_t tolen) {
-    return do_io(s, sendto_f, "sendto", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags, to, tolen);
+    return do_io(s, sendto_f, "sendto", sylar::IOManager::WRITE, SO_SNDTIMEO, nullptr, msg, len, flags, to, tolen);
 }
 
 ssize_t sendmsg(int s, const struct msghdr *msg, int flags) {
-    return do_io(s, sendmsg_f, "sendmsg", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, flags);
+    return do_io(s, sendmsg_f, "sendmsg", sylar::IOManager::WRITE, SO_SNDTIMEO, nullptr, msg, flags);
 }
 
 
+int open(const char* pathname, int flags, ...) {
+    mode_t mode = 0;
+    if((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE) {
+        va_list va;
+        va_start(va, flags);
+        mode = va_arg(va, int);
+        va_end(va);
+    }
+    if(!open_f) {
+        // 其他库的静态初始化可能早于hook_init
+        sylar::hook_init();
+    }
+    if(!sylar::t_hook_enable || !sylar::s_offload_file_io || !sylar::Scheduler::GetTaskScheduler()) {
+        return open_f(pathname, flags, mode);
+    }
+
+    // 路径复制一份, 协程切出后线程池不访问协程栈
+    std::string path(pathname);
+    std::pair<int, int> rt = sylar::Offload([path, flags, mode]() {
+        int fd = open_f(path.c_str(), flags, mode);
+        return std::make_pair(fd, fd < 0 ? errno : 0);
+    });
+    if(rt.first < 0) {
+        errno = rt.second;
+        return -1;
+    }
+    // 记录下来, 之后这个fd上的read/write也交给线程池
+    sylar::FdMgr::GetInstance()->get(rt.first, true);
+    return rt.first;
+}
+
 int close(int fd) {
+    // 不管在哪个线程关闭, 都要取消所有IOManager中这个fd上的事件
+    // 内核会把关闭的fd移出epoll, 但持久注册模式下IOManager仍然认为它已经注册
+    sylar::IOManager::CancelAllFd(fd);
     if(!sylar::t_hook_enable) {
         return close_f(fd);
     }
@@ -409,7 +494,7 @@ int close(int fd) {
     if(ctx) {       // 如果是socket套接字
         auto iom = sylar::IOManager::GetThis();
         if(iom) {
-            iom->cancelAll(fd);     // 取消这个fd上的所有事件
+            iom->uringCancel(fd);   // io_uring持有fd的引用, 未完成的请求需要主动取消
         }
         sylar::FdMgr::GetInstance()->del(fd);   // 删除这个fd记录
     }
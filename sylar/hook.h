@@ -88,6 +88,10 @@ extern sendto_fun sendto_f;
 typedef ssize_t (*sendmsg_fun)(int s, const struct msghdr *msg, int flags);
 extern sendmsg_fun sendmsg_f;
 
+// open
+typedef int (*open_fun)(const char* pathname, int flags, ...);
+extern open_fun open_f;
+
 // close
 typedef int (*close_fun)(int fd);
 extern close_fun close_f;
@@ -1,17 +1,71 @@
 #include "iomanager.h"
 #include "macro.h"
 #include "log.h"
+#include "config.h"
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
 #include <string.h>
+#include <algorithm>
 
 namespace sylar {
 
 static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 
+/// 是否开启分片模式: 每个工作线程一个epoll, fd的事件固定在注册它的线程上执行
+static ConfigVar<bool>::ptr g_iomanager_shard_per_thread =
+    Config::Lookup<bool>("iomanager.shard_per_thread", false, "iomanager epoll per thread");
+
+/// 是否开启持久注册: fd只在第一次等待时注册一次读写两个方向(边缘触发), 之后等待和触发都不再调用epoll_ctl
+static ConfigVar<bool>::ptr g_iomanager_persistent_epoll =
+    Config::Lookup<bool>("iomanager.persistent_epoll", false, "iomanager keep fd registered in epoll");
+
+/// 是否使用io_uring: hook的IO操作直接提交给io_uring, 完成后恢复协程
+static ConfigVar<bool>::ptr g_iomanager_io_uring =
+    Config::Lookup<bool>("iomanager.io_uring", false, "iomanager use io_uring");
+
+/// io_uring提交队列长度
+static ConfigVar<uint32_t>::ptr g_iomanager_io_uring_entries =
+    Config::Lookup<uint32_t>("iomanager.io_uring_entries", 1024, "io_uring entries");
+
+/// 所有存活的IOManager
+struct IOManagerList {
+    RWMutex mutex;
+    std::vector<IOManager*> ioms;
+};
+
+/// 不析构: 静态析构阶段仍然可能关闭fd
+static IOManagerList& GetIOManagerList() {
+    static IOManagerList* s_list = new IOManagerList;
+    return *s_list;
+}
+
+/// 等待io_uring完成事件的协程, 地址作为请求的user_data
+struct UringWaiter {
+    Fiber::ptr fiber;
+    int res = 0;
+};
+
+/// 创建epoll并把唤醒用的eventfd加入监听
+static int CreateEpoll(int tickle_fd) {
+    int epfd = epoll_create(5000);
+    SYLAR_ASSERT(epfd > 0);
+
+    epoll_event event;
+    memset(&event, 0 ,sizeof(event));
+    // 水平触发: 计数没有被读完时, epoll会继续唤醒下一个等待的线程
+    event.events = EPOLLIN;
+    event.data.fd = tickle_fd;
+
+    int rt = epoll_ctl(epfd, EPOLL_CTL_ADD, tickle_fd, &event);  // 加入监听
+    SYLAR_ASSERT(!rt);
+    return epfd;
+}
+
 IOManager::FdContext::EventContext& IOManager::FdContext::getContext(IOManager::Event event) {
     switch(event) {
         case IOManager::READ:
@@ -31,7 +85,8 @@ void IOManager::FdContext::resetContext(EventContext& ctx) {
     ctx.cb = nullptr;
 }
 
-void IOManager::FdContext::triggerEvent(IOManager::Event event) {
+void IOManager::FdContext::triggerEvent(IOManager::Event event, IOManager* owner
+                                       ,std::vector<FiberAndThread>* batch) {
     // SYLAR_ASSERT(events & event);   // 确保有这个监听事件
 
     // events = (Event)(events & ~event);  // 删除这个事件
@@ -48,10 +103,19 @@ void IOManager::FdContext::triggerEvent(IOManager::Event event) {
 
     events = (Event)(events & ~event);
     EventContext& ctx = getContext(event);
-    if(ctx.cb) {
-        ctx.scheduler->schedule(&ctx.cb);
+    // 分片模式下事件回到fd所在分片的线程上执行
+    bool own = ctx.scheduler == owner;
+    int thr = own ? thread : -1;
+    if(batch && own) {
+        if(ctx.cb) {
+            batch->push_back(FiberAndThread(&ctx.cb, thr));
+        } else {
+            batch->push_back(FiberAndThread(&ctx.fiber, thr));
+        }
+    } else if(ctx.cb) {
+        ctx.scheduler->schedule(&ctx.cb, thr);
     } else {
-        ctx.scheduler->schedule(&ctx.fiber);
+        ctx.scheduler->schedule(&ctx.fiber, thr);
     }
     ctx.scheduler = nullptr;
     return;
@@ -59,24 +123,57 @@ void IOManager::FdContext::triggerEvent(IOManager::Event event) {
 
 IOManager::IOManager(size_t threads, bool use_caller, const std::string& name) 
     : Scheduler(threads, use_caller, name){
-    // 创建epoll
-    m_epfd = epoll_create(5000);
-    SYLAR_ASSERT(m_epfd > 0);
-
-    int rt = pipe(m_tickleFds);
-    SYLAR_ASSERT(!rt);
+    m_sharded = g_iomanager_shard_per_thread->getValue();
+    m_persistent = g_iomanager_persistent_epoll->getValue();
+    if(m_sharded) {
+        // 每个工作线程一个epoll和一个eventfd, 只有这个线程在上面等待
+        m_shards.resize(getWorkerCount());
+        for(auto& i : m_shards) {
+            i = new Shard;
+            i->tickleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            SYLAR_ASSERT(i->tickleFd >= 0);
+            i->epfd = CreateEpoll(i->tickleFd);
+        }
+    } else {
+        // 信号量模式: 计数为n时可以被读n次, 每次读走1
+        m_tickleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC | EFD_SEMAPHORE);
+        SYLAR_ASSERT(m_tickleFd >= 0);
+        // 创建epoll
+        m_epfd = CreateEpoll(m_tickleFd);
+    }
 
-    epoll_event event;
-    memset(&event, 0 ,sizeof(event));
-    event.events = EPOLLIN | EPOLLET;       // 边缘触发
-    event.data.fd = m_tickleFds[0];
-    rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);    // 设置为非阻塞
-    SYLAR_ASSERT(!rt);
+    if(g_iomanager_io_uring->getValue()) {
+        if(m_sharded) {
+            SYLAR_LOG_WARN(g_logger) << "io_uring is not supported in shard mode, use epoll";
+        } else if(isSharedStack()) {
+            // 内核会在协程切出期间写入用户缓冲区, 而共享栈上的缓冲区此时属于别的协程
+            SYLAR_LOG_WARN(g_logger) << "io_uring is not supported with shared stack, use epoll";
+        } else {
+            m_uring = IoUring::Create(g_iomanager_io_uring_entries->getValue());
+        }
+        if(m_uring) {
+            // 完成队列非空时io_uring的fd可读, 由空闲线程取出完成事件
+            epoll_event event;
+            memset(&event, 0 ,sizeof(event));
+            event.events = EPOLLIN;
+            event.data.fd = m_uring->getFd();
+            int rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_uring->getFd(), &event);
+            SYLAR_ASSERT(!rt);
+        } else {
+            SYLAR_LOG_WARN(g_logger) << "io_uring unavailable, use epoll";
+        }
+    }
 
-    rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);  // 加入监听
-    SYLAR_ASSERT(!rt);
+    for(auto& i : m_fdSegments) {
+        i = nullptr;
+    }
+    getFdContext(0, true);  // 提前创建第一段
 
-    contextResize(32);
+    {
+        IOManagerList& list = GetIOManagerList();
+        RWMutex::WriteLock lock(list.mutex);
+        list.ioms.push_back(this);
+    }
 
     start();    // 默认启动Scheduler::start()
     
@@ -84,44 +181,64 @@ IOManager::IOManager(size_t threads, bool use_caller, const std::string& name)
 IOManager::~IOManager() {
     stop();
 
-    close(m_epfd);
-    close(m_tickleFds[0]);
-    close(m_tickleFds[1]);
+    {
+        IOManagerList& list = GetIOManagerList();
+        RWMutex::WriteLock lock(list.mutex);
+        list.ioms.erase(std::find(list.ioms.begin(), list.ioms.end(), this));
+    }
+
+    if(m_uring) {
+        delete m_uring;
+    }
+    if(m_epfd >= 0) {
+        close(m_epfd);
+        close(m_tickleFd);
+    }
+    for(auto& i : m_shards) {
+        close(i->epfd);
+        close(i->tickleFd);
+        delete i;
+    }
 
     // 释放内存
-    for(size_t i = 0; i < m_fdContexts.size(); ++i) {
-        if(m_fdContexts[i]) {
-            delete m_fdContexts[i];
+    for(auto& i : m_fdSegments) {
+        if(i) {
+            delete[] i.load();
         }
     }
 }
 
-void IOManager::contextResize(size_t size) {
-    m_fdContexts.resize(size);
-
-    for(size_t i = 0; i < m_fdContexts.size(); ++i) {
-        if(!m_fdContexts[i]) {
-            // 提前初始化
-            m_fdContexts[i] = new FdContext;    
-            m_fdContexts[i]->fd = i;
+IOManager::FdContext* IOManager::getFdContext(int fd, bool auto_create) {
+    if(fd < 0 || (size_t)fd >= FD_SEGMENT_SIZE * FD_SEGMENT_COUNT) {
+        return nullptr;
+    }
+    std::atomic<FdContext*>& slot = m_fdSegments[fd / FD_SEGMENT_SIZE];
+    FdContext* segment = slot.load(std::memory_order_acquire);
+    if(!segment) {
+        if(!auto_create) {
+            return nullptr;
+        }
+        FdContext* created = new FdContext[FD_SEGMENT_SIZE];
+        size_t base = fd - fd % FD_SEGMENT_SIZE;
+        for(size_t i = 0; i < FD_SEGMENT_SIZE; ++i) {
+            created[i].fd = base + i;
+        }
+        // 多个线程同时创建时只保留一个
+        if(slot.compare_exchange_strong(segment, created, std::memory_order_acq_rel)) {
+            segment = created;
+        } else {
+            delete[] created;
         }
     }
+    return &segment[fd % FD_SEGMENT_SIZE];
 }
 
 int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
     // SYLAR_LOG_INFO(g_logger) << " addEvent";
-    FdContext* fd_ctx = nullptr;
-    RWMutexType::ReadLock lock(m_mutex);    // 加锁,可能有多线程同时加入事件
-    if((int)m_fdContexts.size() > fd) {
-        // fd就是m_fdContexts的下标
-        fd_ctx = m_fdContexts[fd];
-        lock.unlock();
-    } else {
-        lock.unlock();
-        // 创建
-        RWMutexType::WriteLock lock2(m_mutex);
-        contextResize(fd * 1.5);
-        fd_ctx = m_fdContexts[fd];
+    FdContext* fd_ctx = getFdContext(fd, true);
+    if(!fd_ctx) {
+        SYLAR_LOG_ERROR(g_logger) << "addEvent fd=" << fd << " out of range";
+        return -1;
     }
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
@@ -133,18 +250,30 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
         SYLAR_ASSERT(!(fd_ctx->events & event));
     }
 
-    int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;    // 判断是修改还是增加
-    epoll_event epevent;
-    epevent.events = EPOLLET | fd_ctx->events | event;
-    epevent.data.ptr = fd_ctx;      // ???保存该事件的fdcContexts
-
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if (rt) {
-        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd <<","
-            << op << ", " << fd << ", " << epevent.events<<")"
-            << rt << " (" << errno <<") (" <<strerror(errno) << ")";
-
-        return -1;
+    if(!fd_ctx->events && !fd_ctx->registered) {
+        assignShard(fd_ctx);
+    }
+    int epfd = getEpfd(fd_ctx);
+    if(!m_persistent || !fd_ctx->registered) {
+        int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;    // 判断是修改还是增加
+        epoll_event epevent;
+        // 持久注册模式一次注册读写两个方向, 之后的增删只修改FdContext里的状态
+        epevent.events = EPOLLET | (m_persistent ? (READ | WRITE) : (fd_ctx->events | event));
+        epevent.data.ptr = fd_ctx;      // ???保存该事件的fdcContexts
+
+        ++m_epollCtlCount;
+        int rt = epoll_ctl(epfd, op, fd, &epevent);
+        if (rt) {
+            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epfd <<","
+                << op << ", " << fd << ", " << epevent.events<<")"
+                << rt << " (" << errno <<") (" <<strerror(errno) << ")";
+
+            return -1;
+        }
+        if(m_persistent) {
+            fd_ctx->registered = true;
+            fd_ctx->ready = NONE;
+        }
     }
 
     ++m_pendingEventCount;      //? 如果这个事件本身就有，那这个数字不就多加了???
@@ -165,39 +294,50 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
         event_ctx.fiber = Fiber::GetThis();
         SYLAR_ASSERT(event_ctx.fiber->getState() == Fiber::EXEC);
     }
+
+    if(fd_ctx->ready & event) {
+        // 没有等待者时已经就绪过, 边缘不会再来, 直接触发
+        // 可能是已经被读写掉的旧状态, 调用者重试IO仍然EAGAIN时会再等待一次
+        fd_ctx->ready &= ~event;
+        fd_ctx->triggerEvent(event, this);
+        --m_pendingEventCount;
+    }
     // SYLAR_LOG_INFO(g_logger) << " addEvent";
     return 0;
 }
 
 bool IOManager::delEvent(int fd, Event event) {
-    RWMutexType::ReadLock lock(m_mutex);
-    if((int)m_fdContexts.size() <= fd) {
+    FdContext* fd_ctx = getFdContext(fd);   // 获得这个fd的上下文
+    if(!fd_ctx) {
         return false;
     }
-    FdContext* fd_ctx = m_fdContexts[fd];   // 获得这个fd的上下文
-    lock.unlock();
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if(fd_ctx->events & event) {    // fd中没有这个事件
+    if(!(fd_ctx->events & event)) {    // fd中没有这个事件
         return false;   // 则不用删除
     }
 
     Event new_events = (Event)(fd_ctx->events & ~event);
-    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;        // 判断是修改这个fd,还是直接删除fd
-
-    // 重新设置这个fd上的事件
-    epoll_event epevent;
-    epevent.events = EPOLLET | new_events;
-    epevent.data.ptr = fd_ctx;
-
-    // 重新设置这个fd的监听情况
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if (rt) {
-        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd <<","
-            << op << ", " << fd << ", " << epevent.events<<")"
-            << rt << " (" << errno <<") (" <<strerror(errno) << ")";
-
-        return false;
+    // 持久注册模式下fd一直留在epoll中
+    if(!m_persistent) {
+        int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;        // 判断是修改这个fd,还是直接删除fd
+
+        // 重新设置这个fd上的事件
+        epoll_event epevent;
+        epevent.events = EPOLLET | new_events;
+        epevent.data.ptr = fd_ctx;
+
+        // 重新设置这个fd的监听情况
+        int epfd = getEpfd(fd_ctx);
+        ++m_epollCtlCount;
+        int rt = epoll_ctl(epfd, op, fd, &epevent);
+        if (rt) {
+            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epfd <<","
+                << op << ", " << fd << ", " << epevent.events<<")"
+                << rt << " (" << errno <<") (" <<strerror(errno) << ")";
+
+            return false;
+        }
     }
 
     --m_pendingEventCount;
@@ -209,76 +349,146 @@ bool IOManager::delEvent(int fd, Event event) {
 }
 bool IOManager::cancelEvent(int fd, Event event) {
     // SYLAR_LOG_ERROR(g_logger) << " cancelEvent begin";
-    RWMutexType::ReadLock lock(m_mutex);
-    if((int)m_fdContexts.size() <= fd) {
+    FdContext* fd_ctx = getFdContext(fd);   // 获得这个fd的上下文
+    if(!fd_ctx) {
         return false;
     }
-    FdContext* fd_ctx = m_fdContexts[fd];   // 获得这个fd的上下文
-    lock.unlock();
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+    return doCancelEvent(fd_ctx, event);
+}
+
+bool IOManager::doCancelEvent(FdContext* fd_ctx, Event event) {
     if(!(fd_ctx->events & event)) {    // fd中没有这个事件
         return false;   // 则不用删除
     }
 
     Event new_events = (Event)(fd_ctx->events & ~event);
-    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;        // 判断是修改这个fd,还是直接删除fd
-
-    // 重新设置这个fd上的事件
-    epoll_event epevent;
-    epevent.events = EPOLLET | new_events;
-    epevent.data.ptr = fd_ctx;
-
-    // 重新设置这个fd的监听情况
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if (rt) {
-        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd <<","
-            << op << ", " << fd << ", " << epevent.events<<")"
-            << rt << " (" << errno <<") (" <<strerror(errno) << ")";
-
-        return false;
+    // 持久注册模式下fd一直留在epoll中
+    if(!m_persistent) {
+        int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;        // 判断是修改这个fd,还是直接删除fd
+
+        // 重新设置这个fd上的事件
+        epoll_event epevent;
+        epevent.events = EPOLLET | new_events;
+        epevent.data.ptr = fd_ctx;
+
+        // 重新设置这个fd的监听情况
+        int epfd = getEpfd(fd_ctx);
+        ++m_epollCtlCount;
+        int rt = epoll_ctl(epfd, op, fd_ctx->fd, &epevent);
+        if (rt) {
+            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epfd <<","
+                << op << ", " << fd_ctx->fd << ", " << epevent.events<<")"
+                << rt << " (" << errno <<") (" <<strerror(errno) << ")";
+
+            return false;
+        }
     }
     // SYLAR_LOG_ERROR(g_logger) << " cancelEvent end ";
-    fd_ctx->triggerEvent(event);
+    fd_ctx->triggerEvent(event, this);
     --m_pendingEventCount;
     return true;
 }
 
+int IOManager::waitEvent(int fd, Event event, uint64_t timeout_ms) {
+    if(timeout_ms == ~0ull) {
+        if(addEvent(fd, event)) {
+            return -1;
+        }
+        Fiber::YieldToHold();
+        return 0;
+    }
+    FdContext* fd_ctx = getFdContext(fd, true);
+    if(!fd_ctx) {
+        SYLAR_LOG_ERROR(g_logger) << "waitEvent fd=" << fd << " out of range";
+        return -1;
+    }
+
+    Timer::ptr timer;
+    {
+        FdContext::MutexType::Lock lock(fd_ctx->mutex);
+        FdContext::EventContext& ctx = fd_ctx->getContext(event);
+        if(!ctx.timer) {
+            // 回调只有两个指针, 保存在std::function内部, 不需要额外分配
+            if(event == READ) {
+                ctx.timer = createTimer([this, fd_ctx](){
+                    onEventTimeout(fd_ctx, READ);
+                });
+            } else {
+                ctx.timer = createTimer([this, fd_ctx](){
+                    onEventTimeout(fd_ctx, WRITE);
+                });
+            }
+        }
+        ctx.deadline = getNowUs() + timeout_ms * 1000;
+        ctx.timedOut = false;
+        timer = ctx.timer;
+    }
+
+    if(addEvent(fd, event)) {
+        FdContext::MutexType::Lock lock(fd_ctx->mutex);
+        fd_ctx->getContext(event).deadline = ~0ull;
+        return -1;
+    }
+    timer->start(timeout_ms);
+    Fiber::YieldToHold();
+    timer->cancel();    // 事件先发生, 停止定时器, 回调留着下次使用
+
+    FdContext::MutexType::Lock lock(fd_ctx->mutex);
+    FdContext::EventContext& ctx = fd_ctx->getContext(event);
+    ctx.deadline = ~0ull;
+    return ctx.timedOut ? ETIMEDOUT : 0;
+}
+
+void IOManager::onEventTimeout(FdContext* fd_ctx, Event event) {
+    FdContext::MutexType::Lock lock(fd_ctx->mutex);
+    FdContext::EventContext& ctx = fd_ctx->getContext(event);
+    if(!(fd_ctx->events & event) || getNowUs() < ctx.deadline) {
+        return;
+    }
+    ctx.timedOut = true;
+    doCancelEvent(fd_ctx, event);
+}
+
 bool IOManager::cancelAll(int fd){
     
-    RWMutexType::ReadLock lock(m_mutex);
-    if((int)m_fdContexts.size() <= fd) {
+    FdContext* fd_ctx = getFdContext(fd);
+    if(!fd_ctx) {
         return false;
     }
-    FdContext* fd_ctx = m_fdContexts[fd];
-    lock.unlock();
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if(!fd_ctx->events) {       // 如果这个fd本身就没有事件
+    // 持久注册模式下没有事件也可能还在epoll中, fd关闭前要删除, 否则复用这个fd时不会重新注册
+    if(!fd_ctx->events && !fd_ctx->registered) {       // 如果这个fd本身就没有事件
         return false;
     }
+    fd_ctx->registered = false;
+    fd_ctx->ready = NONE;
 
     int op = EPOLL_CTL_DEL;     // 删除
     epoll_event epevent;
     epevent.events = 0;
     epevent.data.ptr = fd_ctx;
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    int epfd = getEpfd(fd_ctx);
+    ++m_epollCtlCount;
+    int rt = epoll_ctl(epfd, op, fd, &epevent);
     if(rt) {
-        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epfd << ", "
             << op << ", " << fd << ", " << epevent.events << "):"
             << rt << " (" << errno << ") (" << strerror(errno) << ")";
         return false;
     }
 
     if(fd_ctx->events & READ) {
-        fd_ctx->triggerEvent(READ);
+        fd_ctx->triggerEvent(READ, this);
         // FdContext::EventContext& event_ctx = fd_ctx->getContext(READ);
         // event_ctx->triggerEvent(event);     // 如果该事件被注册过回调，那就触发一次回调事件
         --m_pendingEventCount;
     }
     if(fd_ctx->events & WRITE) {
-        fd_ctx->triggerEvent(WRITE);
+        fd_ctx->triggerEvent(WRITE, this);
         // FdContext::EventContext& event_ctx = fd_ctx->getContext(WRITE);
         // event_ctx->triggerEvent(event);     // 如果该事件被注册过回调，那就触发一次回调事件
         --m_pendingEventCount;
@@ -293,25 +503,154 @@ IOManager* IOManager::GetThis() {
     return dynamic_cast<IOManager*>(Scheduler::GetThis());
 }
 
+int IOManager::getEpfd(FdContext* fd_ctx) const {
+    return m_sharded ? m_shards[fd_ctx->shard]->epfd : m_epfd;
+}
+
+void IOManager::assignShard(FdContext* fd_ctx) {
+    if(!m_sharded) {
+        return;
+    }
+    int idx = getCurrentWorker();
+    if(idx < 0) {
+        // use_caller时root线程要到stop()才开始调度, 不分配给它
+        size_t first = (m_rootThread != -1 && m_threadCount > 0) ? 1 : 0;
+        idx = first + m_nextShard++ % (m_shards.size() - first);
+    }
+    fd_ctx->shard = idx;
+    fd_ctx->thread = m_threadIds[idx];
+}
+
+int IOManager::uringWait(io_uring_sqe& sqe, uint64_t timeout_ms) {
+    UringWaiter waiter;
+    waiter.fiber = Fiber::GetThis();
+    sqe.user_data = (uint64_t)&waiter;
+
+    ++m_pendingEventCount;
+    int rt = m_uring->submit(sqe, timeout_ms);
+    if(rt) {
+        --m_pendingEventCount;
+        return rt;
+    }
+    // 完成后reapUring会设置结果并重新调度当前协程
+    Fiber::YieldToHold();
+    return waiter.res;
+}
+
+void IOManager::CancelAllFd(int fd) {
+    IOManagerList& list = GetIOManagerList();
+    RWMutex::ReadLock lock(list.mutex);
+    for(auto i : list.ioms) {
+        i->cancelAll(fd);
+    }
+}
+
+void IOManager::uringCancel(int fd) {
+    if(m_uring) {
+        m_uring->cancelFd(fd);
+    }
+}
+
+size_t IOManager::reapUring(std::vector<FiberAndThread>& batch) {
+    static const size_t MAX_CQES = 64;
+    io_uring_cqe cqes[MAX_CQES];
+    size_t count = 0;
+    while(size_t n = m_uring->reap(cqes, MAX_CQES)) {
+        for(size_t i = 0; i < n; ++i) {
+            // user_data为0的是链接的超时和取消请求
+            if(!cqes[i].user_data) {
+                continue;
+            }
+            UringWaiter* waiter = (UringWaiter*)cqes[i].user_data;
+            waiter->res = cqes[i].res;
+            batch.push_back(FiberAndThread(&waiter->fiber, -1));
+            ++count;
+        }
+    }
+    return count;
+}
+
 /// 有事件发生，则可以唤醒空闲的线程
 void IOManager::tickle() {
-    if(!hasIdleThreads()) {     // 必须有闲置的线程才有意义
+    if(m_sharded) {
+        // 唤醒一个空闲且没有未处理唤醒的线程, 多次调用会依次唤醒不同的线程
+        for(size_t i = 0; i < m_shards.size(); ++i) {
+            if(isWorkerIdle(i) && !m_shards[i]->tickled) {
+                tickleWorker(i);
+                return;
+            }
+        }
+        ++m_tickleSuppressed;
         return;
     }
+    // 每个空闲线程最多只有一个未处理的唤醒, 多余的唤醒直接合并掉
+    size_t pending = m_pendingTickles;
+    while(true) {
+        if(pending >= m_idleThreadCount) {  // 必须有闲置的线程才有意义
+            ++m_tickleSuppressed;
+            return;
+        }
+        if(m_pendingTickles.compare_exchange_weak(pending, pending + 1)) {
+            break;
+        }
+    }
     // SYLAR_LOG_INFO(g_logger) << " IOManager::tickle ";
-    int rt = write(m_tickleFds[1], "T", 1);     // 往管道中写一个数据，通知有事件加入
-    SYLAR_ASSERT(rt == 1);
+    uint64_t one = 1;
+    int rt = write(m_tickleFd, &one, sizeof(one));  // 计数加1, 唤醒一个空闲线程
+    SYLAR_ASSERT(rt == sizeof(one));
+    ++m_tickleSent;
 }
 
 
+void IOManager::tickleWorker(int idx) {
+    if(!m_sharded) {
+        // 共享epoll无法指定唤醒哪个线程
+        tickle();
+        return;
+    }
+    Shard* shard = m_shards[idx];
+    if(shard->tickled.exchange(true)) {
+        ++m_tickleSuppressed;
+        return;
+    }
+    uint64_t one = 1;
+    int rt = write(shard->tickleFd, &one, sizeof(one));
+    SYLAR_ASSERT(rt == sizeof(one));
+    ++m_tickleSent;
+}
+
 bool IOManager::stopping(uint64_t& timeout) {
-    timeout = getNextTimer();
+    timeout = getNextTimerUs();
     return timeout == ~0ull
         && m_pendingEventCount == 0
         && Scheduler::stopping();
 
 }
 
+/// 内核是否支持epoll_pwait2, 不支持时回退到毫秒精度的epoll_wait
+static std::atomic<bool> s_epoll_pwait2 = {true};
+
+/**
+ * @brief 等待epoll事件, 超时时间是微秒
+ * @details epoll_pwait2(Linux 5.11)的超时时间是timespec, 不足1毫秒的定时器也能睡到点;
+ *          回退到epoll_wait时向上取整到毫秒, 不会变成0毫秒的忙等
+ */
+static int EpollWait(int epfd, epoll_event* events, int maxevents, uint64_t timeout_us) {
+#ifdef SYS_epoll_pwait2
+    if(s_epoll_pwait2.load(std::memory_order_relaxed)) {
+        struct timespec ts;
+        ts.tv_sec = timeout_us / 1000000;
+        ts.tv_nsec = timeout_us % 1000000 * 1000;
+        int rt = syscall(SYS_epoll_pwait2, epfd, events, maxevents, &ts, nullptr, 0);
+        if(rt >= 0 || errno != ENOSYS) {
+            return rt;
+        }
+        s_epoll_pwait2 = false;
+    }
+#endif
+    return epoll_wait(epfd, events, maxevents, (int)((timeout_us + 999) / 1000));
+}
+
 bool IOManager::stopping() {
     uint64_t timeout = 0;
     return stopping(timeout);
@@ -330,10 +669,22 @@ void IOManager::idle() {
         delete[] ptr;       // 提供析构的方法
     });
 
+    // 一轮epoll_wait产生的定时任务和就绪事件, 只加一次锁批量投递; 两个容器循环复用
+    std::vector<std::function<void()> > cbs;
+    std::vector<FiberAndThread> batch;
+
+    // 分片模式下只在本线程的epoll上等待
+    Shard* shard = nullptr;
+    if(m_sharded) {
+        SYLAR_ASSERT(getCurrentWorker() >= 0);
+        shard = m_shards[getCurrentWorker()];
+    }
+    int epfd = shard ? shard->epfd : m_epfd;
+    int tickle_fd = shard ? shard->tickleFd : m_tickleFd;
+
     while(true) {
-        uint64_t next_timeout = 0;
+        uint64_t next_timeout = 0;     // 微秒
         if (stopping(next_timeout)) {   // 调度器结束了
-            next_timeout = getNextTimer();
             SYLAR_LOG_INFO(g_logger) << "name = " << getName() << "idle stopping exit";
             break;
         }
@@ -341,16 +692,13 @@ void IOManager::idle() {
         
         int rt = 0;
         do {
-            static const int MAX_TIMEOUT = 1000;    // 毫秒级的超时时间
-            if (next_timeout  != ~0ull) {
-                // 这里可能next_timeout=0???????
-                next_timeout = (int)next_timeout > MAX_TIMEOUT ? MAX_TIMEOUT : next_timeout;
-            } else {
+            static const uint64_t MAX_TIMEOUT = 1000 * 1000;    // 最多等待1秒
+            if (next_timeout > MAX_TIMEOUT) {
                 next_timeout = MAX_TIMEOUT;
             }
             //  SYLAR_LOG_DEBUG(g_logger) << "next_timeout = " << next_timeout;
             // epool_wait的超时时间会参考最近的定时器任务
-            rt = epoll_wait(m_epfd, events, MAX_EVNETS, (int)next_timeout);   // 如果没有事件，则陷入epoll_wait
+            rt = EpollWait(epfd, events, MAX_EVNETS, next_timeout);   // 如果没有事件，则陷入epoll_wait
             if (rt < 0 && errno == EINTR) {
 
             } else {
@@ -360,32 +708,59 @@ void IOManager::idle() {
         } while(true);
 
         // 检查满足条件的定时器任务
-        std::vector<std::function<void()> > cbs;
         listExpiredCb(cbs);
         if (!cbs.empty()) {
             // SYLAR_LOG_DEBUG(g_logger) << "on timer cbs.size=" << cbs.size();
-            schedule(cbs.begin(), cbs.end());    // 把定时任务加入调度
-            // for(auto& i : cbs)
-            //     schedule(i);
+            if(shard) {
+                // 定时器不分片, 定时任务可以在任意线程上执行
+                scheduleBatch(cbs.begin(), cbs.end());
+            } else {
+                for(auto& i : cbs) {
+                    batch.push_back(FiberAndThread(&i, -1));
+                }
+            }
             cbs.clear();
         }
+        // 定时任务已经从定时器中取出但还没有投递, 投递前计入等待事件, 避免被误判为可以停止
+        size_t pending = batch.size();
+        m_pendingEventCount += pending;
 
         // 此时rt返回所有就绪的事件的数量
         // SYLAR_LOG_INFO(g_logger) << "epoll wait events=" << rt << " pendingevnet = " << m_pendingEventCount;
         for (int i = 0; i < rt; i++) {
             epoll_event& event = events[i];
-            if(event.data.fd == m_tickleFds[0]) {   // 说明外部发消息来唤醒
+            if(event.data.fd == tickle_fd) {   // 说明外部发消息来唤醒
             //  SYLAR_LOG_INFO(g_logger) << "??epoll wait events=" << rt << " pendingevnet = " << m_pendingEventCount;
-                uint8_t dummy[256];
-                while(read(m_tickleFds[0], dummy, sizeof(dummy)) > 0);     // 收消息，while确保读干净
-                // ?? 还是不明白用信号量和管道通信的区别?
+                if(shard) {
+                    // 先清除标记再读, 之后的唤醒会重新写入
+                    shard->tickled = false;
+                    uint64_t dummy;
+                    while(read(tickle_fd, &dummy, sizeof(dummy)) > 0);
+                    continue;
+                }
+                // 只读走自己的一次唤醒, 剩下的留给其他空闲线程; 读失败说明已被其他线程取走
+                uint64_t dummy;
+                if(read(m_tickleFd, &dummy, sizeof(dummy)) == sizeof(dummy)) {
+                    --m_pendingTickles;
+                }
+                continue;
+            }
+
+            if(m_uring && event.data.fd == m_uring->getFd()) {
+                // 投递之后再减少m_pendingEventCount
+                pending += reapUring(batch);
                 continue;
             }
 
             FdContext* fd_ctx = (FdContext*)event.data.ptr;     // 取出fd事件上下文
             FdContext::MutexType::Lock lock(fd_ctx->mutex);
+            if(m_persistent && !fd_ctx->registered) {
+                // 同一轮epoll_wait中fd已经被cancelAll删除
+                continue;
+            }
             if (event.events & (EPOLLERR | EPOLLHUP)) {
-                event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->events;  // ???
+                // 持久注册模式下两个方向都记为就绪, 之后等待的协程也会被唤醒并看到错误
+                event.events |= (EPOLLIN | EPOLLOUT) & (m_persistent ? (READ | WRITE) : fd_ctx->events);  // ???
             }
 
             int real_events = NONE;
@@ -396,34 +771,52 @@ void IOManager::idle() {
                 real_events |= WRITE;
             }
 
+            if(m_persistent) {
+                // 没有协程在等的方向记下就绪状态, 留给下一次addEvent
+                fd_ctx->ready |= real_events & ~fd_ctx->events;
+                real_events &= fd_ctx->events;
+            }
+
             if((fd_ctx->events & real_events) == NONE) {    // 怎么会出现None?
                 continue;
             }
 
-            // 剩余事件
-            int left_events = (fd_ctx->events & ~real_events);
-            int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-            event.events = EPOLLET | left_events;  // 复用这个event,该fd上可能还有其他事件
-
-            int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
-            if(rt2) {
-                SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                    << op << ", " << fd_ctx->fd << ", " << event.events << "):"
-                    << rt2 << " (" << errno << ") (" << strerror(errno) << ")";
-                continue;
+            if(!m_persistent) {
+                // 剩余事件
+                int left_events = (fd_ctx->events & ~real_events);
+                int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+                event.events = EPOLLET | left_events;  // 复用这个event,该fd上可能还有其他事件
+
+                ++m_epollCtlCount;
+                int rt2 = epoll_ctl(epfd, op, fd_ctx->fd, &event);
+                if(rt2) {
+                    SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epfd << ", "
+                        << op << ", " << fd_ctx->fd << ", " << event.events << "):"
+                        << rt2 << " (" << errno << ") (" << strerror(errno) << ")";
+                    continue;
+                }
             }
 
             // 触发事件
+            // 投递之后再减少m_pendingEventCount
             if(real_events & READ) {
-                fd_ctx->triggerEvent(READ);
-                --m_pendingEventCount;
+                fd_ctx->triggerEvent(READ, this, &batch);
+                ++pending;
             }
             if(real_events & WRITE) {
-                fd_ctx->triggerEvent(WRITE);
-                --m_pendingEventCount;
+                fd_ctx->triggerEvent(WRITE, this, &batch);
+                ++pending;
             }
         }
 
+        if(!batch.empty()) {
+            // 分片模式下就绪的事件都在本线程上执行
+            scheduleBatch(batch.begin(), batch.end()
+                          ,shard ? sylar::GetThreadId() : -1);
+            batch.clear();
+        }
+        m_pendingEventCount -= pending;
+
             // 触发的事件都通过schduler()加入了任务队列，则可以让出控制权
         Fiber::ptr cur = Fiber::GetThis();
         auto raw_ptr = cur.get();
@@ -7,6 +7,7 @@
 
 #include "scheduler.h"
 #include "timer.h"
+#include "uring.h"
 
 namespace sylar {
 
@@ -34,6 +35,13 @@ private:
             Fiber::ptr fiber;
             /// 事件的回调函数
             std::function<void()> cb;            
+
+            /// waitEvent的超时定时器, 第一次带超时等待时创建, 之后反复使用
+            Timer::ptr timer;
+            /// waitEvent的超时时间(绝对时间), ~0ull表示没有在带超时等待
+            uint64_t deadline = ~0ull;
+            /// 是否因为超时被取消
+            bool timedOut = false;
         };
 
         /// 获取事件上下文类
@@ -44,7 +52,14 @@ private:
         /// 重置该fd上的某个事件上下文
         void resetContext(EventContext& ctx);
 
-        void triggerEvent(Event ctx);
+        /**
+         * @brief 触发事件
+         * @param[in] event 事件类型
+         * @param[in] owner fd所属的IOManager, 事件属于owner时在fd所在分片的线程上执行
+         * @param[out] batch 事件属于owner时不立即schedule, 放入batch中由调用者批量投递
+         */
+        void triggerEvent(Event event, IOManager* owner
+                          ,std::vector<FiberAndThread>* batch = nullptr);
         
         /// 每个fd上只会有两种事件，但是可以同时存在
         /// 读事件上下文
@@ -58,10 +73,32 @@ private:
         /// 当前的事件
         Event events = NONE;
 
+        /// 分片模式下注册到哪个工作线程的epoll, 没有事件时为-1
+        int shard = -1;
+        /// 分片所属线程的id, 事件在该线程上执行; 非分片模式为-1
+        int thread = -1;
+
+        /// 持久注册模式下fd是否已经(以读写两个方向)注册到epoll, 直到cancelAll才删除(fd关闭时CancelAllFd)
+        bool registered = false;
+        /// 持久注册模式下没有等待者时epoll报告的就绪事件, 下次addEvent时直接触发
+        int ready = NONE;
+
         /// 事件的Mutex
         MutexType mutex;
 
     };
+    /**
+     * @brief 分片模式下每个工作线程独占的epoll
+     * @details fd注册在哪个线程的分片上, 它的事件就只在这个线程上触发和执行
+     */
+    struct Shard {
+        /// epoll句柄
+        int epfd = -1;
+        /// 唤醒该线程的eventfd
+        int tickleFd = -1;
+        /// 是否已经有未处理的唤醒
+        std::atomic<bool> tickled = {false};
+    };
 public:
 
     IOManager(size_t threads = 1, bool use_caller = true, const std::string& name = "");
@@ -75,36 +112,135 @@ public:
 
     bool cancelAll(int fd); // 取消某个文件描述符下的所有事件
 
+    /**
+     * @brief fd关闭前在所有存活的IOManager中取消它的事件
+     * @details fd可能在别的IOManager、没有IOManager或者没有开启hook的线程中关闭,
+     *          只取消当前IOManager的话, 其他IOManager持久注册的标记不会清除,
+     *          复用这个fd号时不会重新注册到epoll
+     */
+    static void CancelAllFd(int fd);
+
+    /**
+     * @brief 当前协程等待fd上的事件, 直到事件发生、超时或被取消
+     * @details 超时状态保存在fd的事件上下文中, 定时器每个fd每种事件只创建一次,
+     *          稳定状态下一次等待没有内存分配
+     * @param[in] timeout_ms 超时时间, ~0ull表示不超时
+     * @return 事件发生或被取消返回0, 超时返回ETIMEDOUT, 添加事件失败返回-1
+     */
+    int waitEvent(int fd, Event event, uint64_t timeout_ms);
+
     static IOManager* GetThis();
 
+    /// 实际写入eventfd的唤醒次数
+    uint64_t getTickleSentCount() const { return m_tickleSent;}
+    /// 因为已有足够的未处理唤醒(或没有空闲线程)而被合并掉的唤醒次数
+    uint64_t getTickleSuppressedCount() const { return m_tickleSuppressed;}
+
+    /// 是否开启了分片模式(iomanager.shard_per_thread)
+    bool isSharded() const { return m_sharded;}
+
+    /// 是否开启了持久注册模式(iomanager.persistent_epoll)
+    bool isPersistent() const { return m_persistent;}
+
+    /// 调用epoll_ctl的次数
+    uint64_t getEpollCtlCount() const { return m_epollCtlCount;}
+
+    /// 是否使用io_uring(iomanager.io_uring, 内核不支持时回退到epoll)
+    bool isUring() const { return m_uring != nullptr;}
+
+    /**
+     * @brief 通过io_uring提交请求, 当前协程让出, 请求完成后恢复
+     * @param[in,out] sqe 请求内容, user_data由本函数设置
+     * @param[in] timeout_ms 超时时间, ~0ull表示不超时, 超时的请求返回-ECANCELED
+     * @return 完成事件的结果(cqe.res), 提交失败返回-errno
+     * @pre isUring()
+     */
+    int uringWait(io_uring_sqe& sqe, uint64_t timeout_ms);
+
+    /// 取消fd上所有未完成的io_uring请求
+    void uringCancel(int fd);
+
 protected:
     void tickle() override;
+    void tickleWorker(int idx) override;
     bool stopping() override;
     void idle() override;
 
     /// Timer.h中的虚函数
     void onTimerInsertedAtFront() override;
 
-    /// 重置socket句柄上下文的容器大小
-    void contextResize(size_t size);
+    /**
+     * @brief 取得fd的上下文
+     * @param[in] fd 文件句柄
+     * @param[in] auto_create 所在的段不存在时是否创建
+     * @return fd超出范围, 或者段不存在且不创建时返回nullptr
+     * @details 两级表: 段一旦创建就不会移动和释放, 查找只需要一次原子读, 不加锁
+     */
+    FdContext* getFdContext(int fd, bool auto_create = false);
 
     /**
      * @brief 判断是否可以停止
-     * @param[out] timeout 最近要出发的定时器事件间隔
+     * @param[out] timeout 最近要出发的定时器事件间隔(微秒)
      * @return 返回是否可以停止
      */
     bool stopping(uint64_t& timeout);
+
+    /// fd事件所在的epoll句柄
+    int getEpfd(FdContext* fd_ctx) const;
+
+    /**
+     * @brief 分片模式下为还没有事件的fd选择分片
+     * @details 本调度器的工作线程注册到自己的分片, 其他线程轮流分配
+     */
+    void assignShard(FdContext* fd_ctx);
+
+    /**
+     * @brief 取出io_uring的完成事件, 等待的协程放入batch
+     * @return 放入batch的数量
+     */
+    size_t reapUring(std::vector<FiberAndThread>& batch);
+
+    /**
+     * @brief 取消fd上的事件并触发一次
+     * @pre 调用者持有fd_ctx->mutex
+     */
+    bool doCancelEvent(FdContext* fd_ctx, Event event);
+
+    /**
+     * @brief waitEvent的定时器到期
+     * @details 事件已经结束, 或者已经开始了新的等待(还没到新的超时时间)时忽略
+     */
+    void onEventTimeout(FdContext* fd_ctx, Event event);
 private:
-    int m_epfd = 0;     // epoll的文件句柄
-    /// pipe 文件句柄
-    int m_tickleFds[2]; // 有消息时，向管道中写入数据，
+    int m_epfd = -1;     // epoll的文件句柄
+    /// 唤醒用的eventfd(信号量模式): 每写入1唤醒一个空闲线程, 每个被唤醒的线程读走1
+    int m_tickleFd = -1;
+    /// 已写入eventfd但还没有被读走的唤醒数, 不超过空闲线程数
+    std::atomic<size_t> m_pendingTickles = {0};
+    /// 实际写入eventfd的唤醒次数
+    std::atomic<uint64_t> m_tickleSent = {0};
+    /// 被合并掉的唤醒次数
+    std::atomic<uint64_t> m_tickleSuppressed = {0};
+    /// 是否每个工作线程使用独立的epoll
+    bool m_sharded = false;
+    /// 分片, 下标和工作线程下标一致
+    std::vector<Shard*> m_shards;
+    /// 非工作线程注册fd时轮流选择分片
+    std::atomic<size_t> m_nextShard = {0};
+    /// fd是否在第一次addEvent时以EPOLLIN|EPOLLOUT|EPOLLET注册并一直保持
+    bool m_persistent = false;
+    /// 调用epoll_ctl的次数
+    std::atomic<uint64_t> m_epollCtlCount = {0};
+    /// io_uring, 没有开启或者不可用时为nullptr
+    IoUring* m_uring = nullptr;
     /// 当前等待执行的(读写)事件数量
     std::atomic<size_t> m_pendingEventCount = {0};
-    /// IOManager的Mutex
-    RWMutexType m_mutex;
-
-    /// socket事件上下文的容器!!!
-    std::vector<FdContext*> m_fdContexts;
+    /// 每段的FdContext数量
+    static const size_t FD_SEGMENT_SIZE = 256;
+    /// 段的数量, 可以容纳的fd为[0, FD_SEGMENT_SIZE * FD_SEGMENT_COUNT)
+    static const size_t FD_SEGMENT_COUNT = 4096;
+    /// socket事件上下文的两级表, 第fd / FD_SEGMENT_SIZE段按需创建, 直到析构才释放
+    std::atomic<FdContext*> m_fdSegments[FD_SEGMENT_COUNT];
 };
 
 
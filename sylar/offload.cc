@@ -0,0 +1,81 @@
+#include "offload.h"
+#include "config.h"
+#include "log.h"
+#include "util.h"
+#include "macro.h"
+
+namespace sylar {
+
+static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+static ConfigVar<uint32_t>::ptr g_offload_threads =
+    Config::Lookup<uint32_t>("offload.threads", 4, "offload thread pool size");
+
+OffloadPool::OffloadPool(size_t threads, const std::string& name) {
+    if(threads == 0) {
+        threads = 1;
+    }
+    m_threads.reserve(threads);
+    for(size_t i = 0; i < threads; ++i) {
+        m_threads.push_back(std::make_shared<Thread>(std::bind(&OffloadPool::run, this)
+                                , name + "_" + std::to_string(i)));
+    }
+}
+
+OffloadPool::~OffloadPool() {
+    {
+        MutexType::Lock lock(m_mutex);
+        m_stopping = true;
+    }
+    for(size_t i = 0; i < m_threads.size(); ++i) {
+        m_sem.notify();
+    }
+    for(auto& i : m_threads) {
+        i->join();
+    }
+}
+
+void OffloadPool::submit(std::function<void()> cb) {
+    SYLAR_ASSERT(cb);
+    {
+        MutexType::Lock lock(m_mutex);
+        SYLAR_ASSERT2(!m_stopping, "OffloadPool is stopping");
+        m_tasks.push_back(std::move(cb));
+    }
+    ++m_taskCount;
+    m_sem.notify();
+}
+
+void OffloadPool::run() {
+    while(true) {
+        m_sem.wait();
+        std::function<void()> cb;
+        {
+            MutexType::Lock lock(m_mutex);
+            if(m_tasks.empty()) {
+                // 只有停止时才会在没有任务的情况下被唤醒
+                SYLAR_ASSERT(m_stopping);
+                return;
+            }
+            cb.swap(m_tasks.front());
+            m_tasks.pop_front();
+        }
+        try {
+            cb();
+        } catch (std::exception& ex) {
+            SYLAR_LOG_ERROR(g_logger) << "OffloadPool task except: " << ex.what()
+                << std::endl << BacktraceToString();
+        } catch (...) {
+            SYLAR_LOG_ERROR(g_logger) << "OffloadPool task except"
+                << std::endl << BacktraceToString();
+        }
+    }
+}
+
+OffloadPool* OffloadPool::GetDefault() {
+    // 不析构: 退出时可能还有线程阻塞在任务中, 静态析构阶段join会卡住
+    static OffloadPool* s_pool = new OffloadPool(g_offload_threads->getValue());
+    return s_pool;
+}
+
+}
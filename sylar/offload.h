@@ -0,0 +1,114 @@
+/**
+ * @file offload.h
+ * @brief 执行阻塞操作的专用线程池
+ * @details hook只能把socket变成异步的, 普通文件读写、getaddrinfo、yaml解析等仍然会阻塞
+ *          整个工作线程以及它上面的所有协程
+ *          Offload把这类操作交给独立的线程池执行, 调用的协程只让出, 完成后回到原来的调度器继续
+ *          线程池的线程不开启hook, 在其中执行的都是原始的阻塞调用
+ */
+#ifndef __SYLAR_OFFLOAD_H__
+#define __SYLAR_OFFLOAD_H__
+
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <type_traits>
+#include "thread.h"
+#include "mutex.h"
+#include "noncopyable.h"
+#include "future.h"
+
+namespace sylar {
+
+/**
+ * @brief 执行阻塞任务的线程池
+ */
+class OffloadPool : Noncopyable {
+public:
+    typedef Mutex MutexType;
+
+    /**
+     * @brief 构造函数, 立即启动线程
+     * @param[in] threads 线程数, 至少为1
+     * @param[in] name 线程名称前缀
+     */
+    OffloadPool(size_t threads, const std::string& name = "offload");
+
+    /// 执行完已提交的任务后停止线程
+    ~OffloadPool();
+
+    /**
+     * @brief 提交任务, 线程安全
+     * @details 任务在线程池的线程中执行, 不能抛出异常
+     */
+    void submit(std::function<void()> cb);
+
+    size_t getThreadCount() const { return m_threads.size();}
+
+    /// 累计提交的任务数
+    uint64_t getTaskCount() const { return m_taskCount;}
+
+    /**
+     * @brief 全局线程池
+     * @details 第一次使用时按offload.threads创建, 进程退出时不回收
+     */
+    static OffloadPool* GetDefault();
+private:
+    /// 线程执行函数
+    void run();
+private:
+    MutexType m_mutex;
+    /// 任务数
+    Semaphore m_sem;
+    /// 等待执行的任务
+    std::deque<std::function<void()> > m_tasks;
+    std::vector<Thread::ptr> m_threads;
+    /// 是否正在停止
+    bool m_stopping = false;
+    std::atomic<uint64_t> m_taskCount = {0};
+};
+
+/**
+ * @brief 在全局线程池中执行func, 当前协程等待结果
+ * @details 协程让出后由原来的调度器(共享栈模式下是原来的线程)唤醒
+ *          不在任务协程中(例如main线程, 包括use_caller调度器的caller线程, 或者线程池自己的线程)时直接执行
+ *          func在另一个线程执行时当前协程已经切出, 共享栈模式下它的栈不在原地,
+ *          func需要按值捕获, 不能引用当前协程栈上的变量
+ * @return func的返回值, 需要可默认构造
+ * @exception func抛出的异常在调用的协程中重新抛出
+ */
+template<class F>
+auto Offload(F func) -> typename std::enable_if<!std::is_void<decltype(func())>::value
+                                               ,decltype(func())>::type {
+    Scheduler* scheduler = Scheduler::GetTaskScheduler();
+    if(!scheduler) {
+        return func();
+    }
+    Promise<decltype(func())> promise;
+    scheduler->addExternalWait();
+    OffloadPool::GetDefault()->submit([promise, func, scheduler]() mutable {
+        try {
+            promise.setValue(func());
+        } catch (...) {
+            // 和直接执行时一样, 异常交给调用的协程
+            promise.setException(std::current_exception());
+        }
+        // 协程已经回到调度队列, 调度器之后可以停止
+        scheduler->delExternalWait();
+    });
+    return promise.getFuture().get();
+}
+
+/// 没有返回值的func
+template<class F>
+auto Offload(F func) -> typename std::enable_if<std::is_void<decltype(func())>::value>::type {
+    Offload([func]() mutable {
+        func();
+        return true;
+    });
+}
+
+}
+
+#endif
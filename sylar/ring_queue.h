@@ -0,0 +1,89 @@
+/**
+ * @file ring_queue.h
+ * @brief 环形队列(基于连续内存, 入队出队不分配内存)
+ */
+#ifndef __SYLAR_RING_QUEUE_H__
+#define __SYLAR_RING_QUEUE_H__
+
+#include <vector>
+#include <utility>
+#include <stddef.h>
+
+namespace sylar {
+
+/**
+ * @brief 可自动扩容的环形队列
+ * @details 容量为2的幂, 只在队列满时成倍扩容, 扩容后不再缩小,
+ *          所以稳定状态下push/pop没有内存分配(std::list每个结点都要分配一次)
+ *          T需要可默认构造、可移动赋值; 出队的位置会被重置为T(), 及时释放资源
+ *          非线程安全, 由使用者加锁
+ */
+template<class T>
+class RingQueue {
+public:
+    RingQueue(size_t capacity = 32) {
+        size_t cap = 1;
+        while(cap < capacity) {
+            cap <<= 1;
+        }
+        m_buf.resize(cap);
+    }
+
+    bool empty() const { return m_size == 0;}
+    size_t size() const { return m_size;}
+    size_t capacity() const { return m_buf.size();}
+
+    T& front() { return m_buf[m_head];}
+    T& back() { return m_buf[(m_head + m_size - 1) & (m_buf.size() - 1)];}
+
+    void push_back(const T& v) {
+        reserve(m_size + 1);
+        m_buf[(m_head + m_size) & (m_buf.size() - 1)] = v;
+        ++m_size;
+    }
+
+    void push_back(T&& v) {
+        reserve(m_size + 1);
+        m_buf[(m_head + m_size) & (m_buf.size() - 1)] = std::move(v);
+        ++m_size;
+    }
+
+    void pop_front() {
+        m_buf[m_head] = T();
+        m_head = (m_head + 1) & (m_buf.size() - 1);
+        --m_size;
+    }
+
+    void pop_back() {
+        back() = T();
+        --m_size;
+    }
+
+    /// 确保至少可以容纳n个元素
+    void reserve(size_t n) {
+        if(n <= m_buf.size()) {
+            return;
+        }
+        size_t cap = m_buf.size();
+        while(cap < n) {
+            cap <<= 1;
+        }
+        std::vector<T> buf(cap);
+        for(size_t i = 0; i < m_size; ++i) {
+            buf[i] = std::move(m_buf[(m_head + i) & (m_buf.size() - 1)]);
+        }
+        m_buf.swap(buf);
+        m_head = 0;
+    }
+private:
+    /// 存储空间, 大小是2的幂
+    std::vector<T> m_buf;
+    /// 队头下标
+    size_t m_head = 0;
+    /// 元素个数
+    size_t m_size = 0;
+};
+
+}
+
+#endif
@@ -2,12 +2,23 @@
 #include "log.h"
 #include "macro.h"
 #include "hook.h"
+#include "config.h"
 namespace sylar {
 
 static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 
+/// 是否开启工作窃取: 每个工作线程维护本地队列, 空闲时从其他线程窃取任务
+static ConfigVar<bool>::ptr g_scheduler_work_stealing =
+    Config::Lookup<bool>("scheduler.work_stealing", false, "scheduler work stealing");
+
+/// 是否让任务协程运行在线程的共享栈上: 切出时只保存实际用到的栈, 适合大量空闲连接
+static ConfigVar<bool>::ptr g_scheduler_shared_stack =
+    Config::Lookup<bool>("scheduler.shared_stack", false, "scheduler task fibers use shared stack");
+
 static thread_local Scheduler* t_scheduler = nullptr;
 static thread_local Fiber* t_fiber = nullptr;
+/// 当前线程在所属调度器中的工作线程下标
+static thread_local int t_worker = -1;
 
 Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name)
     :m_name(name) {
@@ -30,6 +41,20 @@ Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name)
         m_rootThread = -1;
     }
     m_threadCount = threads;
+
+    m_workStealing = g_scheduler_work_stealing->getValue();
+    m_sharedStack = g_scheduler_shared_stack->getValue();
+#ifndef SYLAR_FIBER_USE_FCONTEXT
+    if(m_sharedStack) {
+        SYLAR_LOG_WARN(g_logger) << "scheduler.shared_stack needs SYLAR_FIBER_ASM, disabled";
+        m_sharedStack = false;
+    }
+#endif
+    // 下标和m_threadIds一致: use_caller时0号是root线程
+    m_workers.resize(m_threadIds.size() + m_threadCount);
+    for(auto& i : m_workers) {
+        i = new WorkerQueue;
+    }
 }
 
 Scheduler::~Scheduler() {
@@ -37,6 +62,9 @@ Scheduler::~Scheduler() {
     if(GetThis() == this) {
         t_scheduler = nullptr;
     }
+    for(auto& i : m_workers) {
+        delete i;
+    }
 }
 
 Scheduler* Scheduler::GetThis() {
@@ -47,6 +75,13 @@ Fiber* Scheduler::GetMainFiber() {
     return t_fiber;
 }
 
+Scheduler* Scheduler::GetTaskScheduler() {
+    if(!t_scheduler || Fiber::InMainFiber() || Fiber::GetThis().get() == t_fiber) {
+        return nullptr;
+    }
+    return t_scheduler;
+}
+
 void Scheduler::start() {
     MutexType::Lock lock(m_mutex);
     if(!m_stopping) {
@@ -133,6 +168,176 @@ void Scheduler::setThis() {
     t_scheduler = this;
 }
 
+int Scheduler::getWorkerIndex(int thread) const {
+    for(size_t i = 0; i < m_threadIds.size(); ++i) {
+        if(m_threadIds[i] == thread) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool Scheduler::scheduleToWorker(FiberAndThread& ft) {
+    if(!ft.fiber && !ft.cb) {
+        return false;
+    }
+
+    WorkerQueue* wq = nullptr;
+    int idx = -1;
+    if(ft.thread != -1) {
+        idx = getWorkerIndex(ft.thread);
+        if(idx >= 0 && idx < (int)m_workers.size()) {
+            wq = m_workers[idx];
+        }
+    } else if(m_workStealing && t_scheduler == this && t_worker >= 0) {
+        wq = m_workers[t_worker];
+    }
+    bool is_pinned = wq && ft.thread != -1;
+
+    if(!wq) {
+        // 非工作线程投递的任务, 进入全局队列
+        MutexType::Lock lock(m_mutex);
+        bool need_tickle = m_fibers.empty();
+        m_fibers.push_back(std::move(ft));
+        return need_tickle;
+    }
+
+    bool was_empty = false;
+    {
+        WorkerQueue::MutexType::Lock lock(wq->mutex);
+        if(is_pinned) {
+            wq->pinned.push_back(std::move(ft));
+            ++wq->pinnedCount;
+        } else {
+            was_empty = wq->local.empty();
+            wq->local.push_back(std::move(ft));
+        }
+        ++m_workerTaskCount;
+    }
+    if(is_pinned) {
+        // 目标线程忙碌时, 执行完当前任务就会检查收件箱, 不需要唤醒
+        if(wq->idle) {
+            tickleWorker(idx);
+        }
+        return false;
+    }
+    // 本地队列由空变为非空时, 唤醒空闲线程来窃取
+    return was_empty && hasIdleThreads();
+}
+
+bool Scheduler::popLocal(FiberAndThread& ft) {
+    if(t_worker < 0) {
+        return false;
+    }
+    WorkerQueue* wq = m_workers[t_worker];
+    WorkerQueue::MutexType::Lock lock(wq->mutex);
+    RingQueue<FiberAndThread>* queues[] = {&wq->pinned, &wq->local};
+    for(auto q : queues) {
+        // 正在其他线程上切出的协程暂时不能执行, 放到队尾
+        for(size_t n = q->size(); n > 0; --n) {
+            ft = std::move(q->front());
+            q->pop_front();
+            if(ft.fiber && ft.fiber->getState() == Fiber::EXEC) {
+                q->push_back(std::move(ft));
+                ft.reset();
+                continue;
+            }
+            if(q == &wq->pinned) {
+                --wq->pinnedCount;
+            }
+            ++m_activeThreadCount;
+            --m_workerTaskCount;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Scheduler::steal(FiberAndThread& ft) {
+    if(t_worker < 0) {
+        return false;
+    }
+    size_t count = m_workers.size();
+    std::vector<FiberAndThread> stolen;
+    for(size_t i = 1; i < count && stolen.empty(); ++i) {
+        WorkerQueue* victim = m_workers[(t_worker + i) % count];
+        WorkerQueue::MutexType::Lock lock(victim->mutex);
+        // 从队尾窃取一半, 队头留给队列的拥有者
+        size_t n = (victim->local.size() + 1) / 2;
+        while(n-- > 0) {
+            FiberAndThread& back = victim->local.back();
+            if(back.fiber && back.fiber->getState() == Fiber::EXEC) {
+                break;
+            }
+            stolen.push_back(std::move(back));
+            victim->local.pop_back();
+        }
+    }
+    if(stolen.empty()) {
+        return false;
+    }
+
+    WorkerQueue* wq = m_workers[t_worker];
+    WorkerQueue::MutexType::Lock lock(wq->mutex);
+    ft = std::move(stolen.back());
+    ++m_activeThreadCount;
+    --m_workerTaskCount;
+    for(size_t i = 1; i < stolen.size(); ++i) {
+        wq->local.push_back(std::move(stolen[stolen.size() - 1 - i]));
+    }
+    return true;
+}
+
+Scheduler::WorkerQueue* Scheduler::localQueue() {
+    if(m_workStealing && t_scheduler == this && t_worker >= 0) {
+        return m_workers[t_worker];
+    }
+    return nullptr;
+}
+
+int Scheduler::getCurrentWorker() const {
+    return t_scheduler == this ? t_worker : -1;
+}
+
+void Scheduler::tickleBatch(size_t count, int idx) {
+    // 只唤醒已经处于idle的线程, 忙碌的线程执行完当前任务就会取到新任务
+    int self = getCurrentWorker();
+    if(idx >= 0) {
+        if(idx != self && m_workers[idx]->idle) {
+            tickleWorker(idx);
+        }
+        return;
+    }
+    for(size_t i = 0; i < m_workers.size() && count > 0; ++i) {
+        if((int)i != self && m_workers[i]->idle) {
+            tickleWorker(i);
+            --count;
+        }
+    }
+}
+
+bool Scheduler::enterIdle() {
+    if(t_worker < 0) {
+        return true;
+    }
+    // 先标记idle再检查收件箱, 投递方先入队再检查idle, 两边至少有一方能看到对方
+    WorkerQueue* wq = m_workers[t_worker];
+    wq->idle = true;
+    if(wq->pinnedCount > 0) {
+        wq->idle = false;
+        return false;
+    }
+
+    // 唤醒可能落到了其他线程上, 转交给仍在idle且收件箱非空的线程
+    for(size_t i = 0; i < m_workers.size(); ++i) {
+        if((int)i != t_worker && m_workers[i]->idle
+                && m_workers[i]->pinnedCount > 0) {
+            tickleWorker(i);
+        }
+    }
+    return true;
+}
+
 void Scheduler::run() {
     SYLAR_LOG_INFO(g_logger) << "run";
     // 所有线程都默认启动hook
@@ -142,6 +347,11 @@ void Scheduler::run() {
     if(sylar::GetThreadId() != m_rootThread) {
         t_fiber = Fiber::GetThis().get();       // 创建主协程
     }
+    {
+        // start()持有m_mutex直到m_threadIds填充完毕
+        MutexType::Lock lock(m_mutex);
+        t_worker = getWorkerIndex(sylar::GetThreadId());
+    }
 
     Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));    // 创建空闲协程
     Fiber::ptr cb_fiber;
@@ -149,37 +359,32 @@ void Scheduler::run() {
     FiberAndThread ft;
     while(true) {
         ft.reset();
-        bool tickle_me = false;
         bool is_active = false;
-        {
+        if(popLocal(ft)) {
+            is_active = true;
+        }
+        if(!is_active) {
             MutexType::Lock lock(m_mutex);
-            auto it = m_fibers.begin();
-            // SYLAR_LOG_INFO(g_logger) << "before find " << m_fibers.size();
-            while(it != m_fibers.end()) {
-                // SYLAR_LOG_INFO(g_logger) << "find!! " << m_fibers.size();
-                if(it->thread != -1 && it->thread != sylar::GetThreadId()) {
-                    ++it;
-                    tickle_me = true;
+            // 最多检查一轮, 暂时不能执行的任务轮转到队尾
+            for(size_t n = m_fibers.size(); n > 0; --n) {
+                ft = std::move(m_fibers.front());
+                m_fibers.pop_front();
+                SYLAR_ASSERT(ft.fiber || ft.cb);
+                // 指定线程的任务都在各自的收件箱中, 这里只剩下未知线程的任务
+                if((ft.thread != -1 && ft.thread != sylar::GetThreadId())
+                        || (ft.fiber && ft.fiber->getState() == Fiber::EXEC)) {
+                    m_fibers.push_back(std::move(ft));
+                    ft.reset();
                     continue;
                 }
-
-                SYLAR_ASSERT(it->fiber || it->cb);
-                if(it->fiber && it->fiber->getState() == Fiber::EXEC) {
-                    ++it;
-                    continue;
-                }
-
-                ft = *it;
-                m_fibers.erase(it);
-                // SYLAR_LOG_INFO(g_logger) << "find!!2 " << m_fibers.size();
                 ++m_activeThreadCount;
                 is_active = true;
                 break;
             }
         }
 
-        if(tickle_me) {
-            tickle();
+        if(!is_active && m_workStealing && steal(ft)) {
+            is_active = true;
         }
 
         if(ft.fiber && (ft.fiber->getState() != Fiber::TERM
@@ -198,7 +403,7 @@ void Scheduler::run() {
             if(cb_fiber) {
                 cb_fiber->reset(ft.cb);     // 设置这个协程需要执行的代码
             } else {
-                cb_fiber.reset(new Fiber(ft.cb));     // 这里是否意味着，实际上每个线程中只有一个工作协程??
+                cb_fiber.reset(new Fiber(ft.cb, 0, false, m_sharedStack));     // 这里是否意味着，实际上每个线程中只有一个工作协程??
                 // ?? 那这里的协程的优点还是没有体现出来呀?
             }
             ft.reset();
@@ -222,12 +427,21 @@ void Scheduler::run() {
             if(idle_fiber->getState() == Fiber::TERM) {
                 SYLAR_LOG_INFO(g_logger) << "idle fiber term";
                 tickle();   // 某个idle结束，说明已经没有可执行的任务了，则可以立刻唤醒其他陷入epoll_wait的线程
+                t_worker = -1;
                 break;
             }
 
+            // 先计入空闲线程数再标记idle: 投递方看到idle时, tickle()不会因为空闲线程数为0而合并掉唤醒
             ++m_idleThreadCount;
+            if(!enterIdle()) {
+                --m_idleThreadCount;
+                continue;
+            }
             idle_fiber->swapIn();
             --m_idleThreadCount;
+            if(t_worker >= 0) {
+                m_workers[t_worker]->idle = false;
+            }
             if(idle_fiber->getState() != Fiber::TERM
                     && idle_fiber->getState() != Fiber::EXCEPT) {
                 idle_fiber->m_state = Fiber::HOLD;
@@ -242,12 +456,18 @@ void Scheduler::tickle() {
     SYLAR_LOG_INFO(g_logger) << "tickle ";
 }
 
+void Scheduler::tickleWorker(int idx) {
+    tickle();
+}
+
 bool Scheduler::stopping() {
     MutexType::Lock lock(m_mutex);
     // SYLAR_LOG_INFO(g_logger) << m_autoStop << " " << m_stopping 
     //                 << " " << m_fibers.size() << " " << m_activeThreadCount;
     return m_autoStop && m_stopping 
-        && m_fibers.empty() && m_activeThreadCount == 0;
+        && m_fibers.empty() && m_workerTaskCount == 0
+        && m_externalWaitCount == 0
+        && m_activeThreadCount == 0;
 }
 
 void Scheduler::idle() {
@@ -3,9 +3,9 @@
 
 #include <memory>
 #include <vector>
-#include <list>
 #include "fiber.h"
 #include "thread.h"
+#include "ring_queue.h"
 
 #include <iostream>
 
@@ -24,16 +24,42 @@ public:
     static Scheduler* GetThis();
     static Fiber* GetMainFiber();
 
+    /**
+     * @brief 当前任务协程所在的调度器
+     * @details 线程主协程和调度协程中返回nullptr: use_caller的调度器在stop()之前,
+     *          caller线程的GetThis()也不为空, 但在那里让出后不会再被调度回来
+     */
+    static Scheduler* GetTaskScheduler();
+
     void start();
     void stop();
 
+    /// 是否开启了工作窃取模式(scheduler.work_stealing)
+    bool isWorkStealing() const { return m_workStealing;}
+    /// 任务协程是否运行在共享栈上(scheduler.shared_stack)
+    bool isSharedStack() const { return m_sharedStack;}
+
+    /**
+     * @brief 协程等待调度器之外的线程唤醒时计数
+     * @details 计数不为0时调度器不会停止, 例如协程在等待offload线程池的结果;
+     *          唤醒方先把协程放回调度队列再减计数
+     */
+    void addExternalWait() { ++m_externalWaitCount;}
+    void delExternalWait() { --m_externalWaitCount;}
+
     template<class FiberOrCb>
     void schedule(FiberOrCb fc, int thread = -1) {
         // std::cout<<m_fibers.size()<<std::endl;
         bool need_tickle = false;
-        {
+        // 共享栈协程运行过之后只能回到原来的线程, ft.thread可能和thread不同
+        FiberAndThread ft(fc, thread);
+        if(m_workStealing || ft.thread != -1) {
+            // 指定线程的任务进入目标线程的收件箱;
+            // 工作窃取模式下的任务直接进入线程本地队列, 不竞争全局锁
+            need_tickle = scheduleToWorker(ft);
+        } else {
             MutexType::Lock lock(m_mutex);
-            need_tickle = scheduleNoLock(fc, thread);
+            need_tickle = scheduleNoLock(ft);
         }
 
         if(need_tickle) {
@@ -44,40 +70,49 @@ public:
 
     template<class InputIterator>
     void schedule(InputIterator begin, InputIterator end) {
-        bool need_tickle = false;
-        {
-            MutexType::Lock lock(m_mutex);
-            while(begin != end) {
-                need_tickle = scheduleNoLock(&*begin, -1) || need_tickle;
-                ++begin;
-                // std::cout<<m_fibers.size()<<std::endl;
+        scheduleBatch(begin, end);
+    }
+
+    /**
+     * @brief 批量投递任务
+     * @param[in] thread 整批任务在哪个线程执行, -1表示任意线程
+     * @details 整批任务只加一次锁, 追加到环形队列中不需要为每个任务分配结点;
+     *          投递完成后最多唤醒min(任务数, 空闲线程数)个线程. 容器中的元素会被swap走
+     */
+    template<class InputIterator>
+    void scheduleBatch(InputIterator begin, InputIterator end, int thread = -1) {
+        size_t count = 0;
+        int idx = thread == -1 ? -1 : getWorkerIndex(thread);
+        // 指定了不是工作线程的thread时和schedule一样进入全局队列, 不能放进本地队列丢掉thread
+        WorkerQueue* wq = idx >= 0 ? m_workers[idx] : (thread == -1 ? localQueue() : nullptr);
+        std::vector<FiberAndThread> diverted;
+        if(wq) {
+            // 指定线程的任务进入目标线程的收件箱;
+            // 工作窃取模式下, 工作线程投递的任务进入本地队列
+            WorkerQueue::MutexType::Lock lock(wq->mutex);
+            if(idx >= 0) {
+                count = pushBatchNoLock(wq->pinned, begin, end, thread, &diverted);
+                wq->pinnedCount += count;
+            } else {
+                count = pushBatchNoLock(wq->local, begin, end, -1, &diverted);
             }
+            m_workerTaskCount += count;
+        } else {
+            MutexType::Lock lock(m_mutex);
+            count = pushBatchNoLock(m_fibers, begin, end, thread, &diverted);
         }
-        if(need_tickle) {
-            tickle();
+        if(count) {
+            tickleBatch(count, idx);
         }
-    }
-protected:
-    virtual void tickle();
-    void run();
-    virtual bool stopping();
-    virtual void idle();
-
-    void setThis();
-
-    bool hasIdleThreads() { return m_idleThreadCount > 0;}
-private:
-    template<class FiberOrCb>
-    bool scheduleNoLock(FiberOrCb fc, int thread) {
-        bool need_tickle = m_fibers.empty();
-        FiberAndThread ft(fc, thread);
-        if(ft.fiber || ft.cb) {
-            m_fibers.push_back(ft);
-            // std::cout<<"push";
+        // 绑定在其他线程上的共享栈协程, 送回各自线程的收件箱
+        for(auto& i : diverted) {
+            if(scheduleToWorker(i)) {
+                tickle();
+            }
         }
-        return need_tickle;
     }
-private:
+protected:
+    /// 协程/函数/线程组
     struct FiberAndThread {
         Fiber::ptr fiber;
         std::function<void()> cb;
@@ -85,11 +120,13 @@ private:
 
         FiberAndThread(Fiber::ptr f, int thr)
             :fiber(f), thread(thr) {
+            bindThread();
         }
 
         FiberAndThread(Fiber::ptr* f, int thr)
             :thread(thr) {
             fiber.swap(*f);
+            bindThread();
         }
 
         FiberAndThread(std::function<void()> f, int thr)
@@ -101,6 +138,13 @@ private:
             cb.swap(*f);
         }
 
+        FiberAndThread(FiberAndThread* f, int thr)
+            :thread(thr) {
+            fiber.swap(f->fiber);
+            cb.swap(f->cb);
+            bindThread();
+        }
+
         FiberAndThread()
             :thread(-1) {
         }
@@ -110,11 +154,130 @@ private:
             cb = nullptr;
             thread = -1;
         }
+
+        /// 共享栈协程的栈里保存的是共享栈上的绝对地址, 只能在绑定的线程上恢复
+        void bindThread() {
+            if(fiber && fiber->getBoundThread() != -1) {
+                thread = fiber->getBoundThread();
+            }
+        }
+    };
+protected:
+    virtual void tickle();
+    /**
+     * @brief 唤醒指定的工作线程
+     * @param[in] idx 工作线程下标(和m_threadIds一致)
+     * @details 只在目标线程空闲时调用, 默认实现退化为tickle()
+     */
+    virtual void tickleWorker(int idx);
+    void run();
+    virtual bool stopping();
+    virtual void idle();
+
+    void setThis();
+
+    bool hasIdleThreads() { return m_idleThreadCount > 0;}
+
+    /// 工作线程数(包括use_caller时的root线程)
+    size_t getWorkerCount() const { return m_workers.size();}
+    /// 当前线程在本调度器中的工作线程下标, 不是本调度器的工作线程返回-1
+    int getCurrentWorker() const;
+    /// 工作线程是否处于idle
+    bool isWorkerIdle(int idx) const { return m_workers[idx]->idle;}
+private:
+    bool scheduleNoLock(FiberAndThread& ft) {
+        bool need_tickle = m_fibers.empty();
+        if(ft.fiber || ft.cb) {
+            m_fibers.push_back(std::move(ft));
+            // std::cout<<"push";
+        }
+        return need_tickle;
+    }
+
+    /**
+     * @param[out] diverted 不为空时, 绑定在其他线程上的协程放到这里而不进入q
+     */
+    template<class InputIterator>
+    static size_t pushBatchNoLock(RingQueue<FiberAndThread>& q
+                                  ,InputIterator begin, InputIterator end, int thread
+                                  ,std::vector<FiberAndThread>* diverted = nullptr) {
+        size_t count = 0;
+        for(; begin != end; ++begin) {
+            FiberAndThread ft(&*begin, thread);
+            if(diverted && ft.thread != thread) {
+                diverted->push_back(std::move(ft));
+            } else if(ft.fiber || ft.cb) {
+                q.push_back(std::move(ft));
+                ++count;
+            }
+        }
+        return count;
+    }
+private:
+    struct WorkerQueue;
+
+    /// 工作窃取模式下当前工作线程的队列, 其他情况返回nullptr
+    WorkerQueue* localQueue();
+
+    /**
+     * @brief 批量投递后的唤醒
+     * @param[in] count 投递的任务数
+     * @param[in] idx 任务所在收件箱的工作线程下标, -1表示唤醒最多count个空闲线程
+     */
+    void tickleBatch(size_t count, int idx);
+
+    /// 根据线程id找到对应的工作线程下标, 不存在返回-1
+    int getWorkerIndex(int thread) const;
+
+    /**
+     * @brief 投递到工作线程的队列
+     * @details 指定了线程的任务进入目标线程的收件箱, 并只唤醒目标线程;
+     *          工作窃取模式下, 工作线程自己投递的任务进入本线程的本地队列;
+     *          其他任务进入全局队列
+     * @return 是否需要tickle
+     */
+    bool scheduleToWorker(FiberAndThread& ft);
+
+    /// 从当前线程的收件箱和本地队列中取出一个任务
+    bool popLocal(FiberAndThread& ft);
+
+    /// 进入idle前的检查, 返回false表示收件箱中有新任务, 不能进入idle
+    bool enterIdle();
+
+    /// 从其他线程的本地队列中窃取任务
+    bool steal(FiberAndThread& ft);
+private:
+    /**
+     * @brief 工作线程的任务队列
+     * @details 每个工作线程一个, 锁只在本线程与投递者/窃取者之间竞争
+     */
+    struct WorkerQueue {
+        typedef Spinlock MutexType;
+        MutexType mutex;
+        /// 本线程产生的任务, 空闲线程可以从队尾窃取(只在工作窃取模式下使用)
+        RingQueue<FiberAndThread> local;
+        /// 收件箱: 指定在本线程执行的任务, 不可被窃取
+        RingQueue<FiberAndThread> pinned;
+        /// 收件箱中的任务数, 不加锁即可判断是否为空
+        std::atomic<size_t> pinnedCount = {0};
+        /// 是否处于idle
+        std::atomic<bool> idle = {false};
     };
 private:
     MutexType m_mutex;
     std::vector<Thread::ptr> m_threads;
-    std::list<FiberAndThread> m_fibers;
+    /// 全局任务队列
+    RingQueue<FiberAndThread> m_fibers;
+    /// 工作线程的队列, 下标和m_threadIds一致
+    std::vector<WorkerQueue*> m_workers;
+    /// 所有本地队列中的任务总数
+    std::atomic<size_t> m_workerTaskCount = {0};
+    /// 等待外部线程唤醒的协程数
+    std::atomic<size_t> m_externalWaitCount = {0};
+    /// 是否开启工作窃取
+    bool m_workStealing = false;
+    /// 任务协程是否运行在共享栈上
+    bool m_sharedStack = false;
     Fiber::ptr m_rootFiber;
     std::string m_name;
 protected:
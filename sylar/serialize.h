@@ -0,0 +1,371 @@
+/**
+ * @file serialize.h
+ * @brief 基于ByteArray的结构体二进制序列化
+ * @details 在结构体中用SYLAR_SERIALIZE_FIELDS声明一次字段, 编译期生成编码、解码和计算编码长度的代码
+ *          字段按声明顺序编码, 没有字段号和类型信息, 两端需要使用相同的定义
+ *          编码规则:
+ *            bool, int8_t, uint8_t, int16_t, uint16_t: 定长
+ *            int32_t, int64_t: zigzag varint; uint32_t, uint64_t: varint
+ *            float, double: 定长
+ *            枚举: 按底层类型
+ *            std::string: varint长度 + 数据
+ *            std::vector, std::map: varint元素个数 + 元素
+ *            Optional: 1字节是否有值 + 值
+ *            结构体: 依次编码每个字段
+ *          Serialize先计算编码长度, 一次reserve之后逐个字段写入, 写入过程中不再分配结点
+ */
+#ifndef __SYLAR_SERIALIZE_H__
+#define __SYLAR_SERIALIZE_H__
+
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <type_traits>
+#include "bytearray.h"
+
+/**
+ * @brief 在结构体中声明需要序列化的字段
+ * @details 示例:
+ *          struct User {
+ *              std::string name;
+ *              int32_t age;
+ *              sylar::Optional<std::string> email;
+ *              SYLAR_SERIALIZE_FIELDS(name, age, email)
+ *          };
+ */
+#define SYLAR_SERIALIZE_FIELDS(...) \
+    typedef void SylarSerializeTag; \
+    template<class Visitor> \
+    void sylarVisitFields(Visitor& v) { v(__VA_ARGS__);} \
+    template<class Visitor> \
+    void sylarVisitFields(Visitor& v) const { v(__VA_ARGS__);}
+
+namespace sylar {
+
+/**
+ * @brief 可选字段
+ * @details C++11没有std::optional; 没有值时只编码1个字节
+ */
+template<class T>
+class Optional {
+public:
+    Optional() {}
+    Optional(const T& v) : m_has(true), m_value(v) {}
+
+    bool hasValue() const { return m_has;}
+    explicit operator bool() const { return m_has;}
+
+    const T& get() const { return m_value;}
+    T& get() { return m_value;}
+
+    void set(const T& v) {
+        m_value = v;
+        m_has = true;
+    }
+
+    /// 清除值
+    void reset() {
+        m_value = T();
+        m_has = false;
+    }
+
+    bool operator==(const Optional& rhs) const {
+        return m_has == rhs.m_has && (!m_has || m_value == rhs.m_value);
+    }
+    bool operator!=(const Optional& rhs) const { return !(*this == rhs);}
+private:
+    bool m_has = false;
+    T m_value = T();
+};
+
+/// 无符号varint的编码长度
+inline size_t VarintSize(uint64_t v) {
+    return ((64 - __builtin_clzll(v | 1)) * 9 + 64) / 64;
+}
+
+/// zigzag编码后的varint长度
+inline size_t ZigzagVarintSize(int64_t v) {
+    return VarintSize(((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+/**
+ * @brief 类型T的编解码
+ * @details Size: 编码长度; Encode: 写入ba; Decode: 从ba读出, 数据不足时抛出std::out_of_range
+ *          没有特化的类型编译失败
+ */
+template<class T, class Enable = void>
+class Serializer;
+
+#define XX(type, write_fun, read_fun, size) \
+    template<> \
+    class Serializer<type> { \
+    public: \
+        static size_t Size(const type& v) { return size;} \
+        static void Encode(ByteArray& ba, const type& v) { ba.write_fun(v);} \
+        static void Decode(ByteArray& ba, type& v) { v = ba.read_fun();} \
+    };
+
+XX(int8_t, writeFint8, readFint8, 1)
+XX(uint8_t, writeFuint8, readFuint8, 1)
+XX(int16_t, writeFint16, readFint16, 2)
+XX(uint16_t, writeFuint16, readFuint16, 2)
+XX(int32_t, writeInt32, readInt32, ZigzagVarintSize(v))
+XX(uint32_t, writeUint32, readUint32, VarintSize(v))
+XX(int64_t, writeInt64, readInt64, ZigzagVarintSize(v))
+XX(uint64_t, writeUint64, readUint64, VarintSize(v))
+XX(float, writeFloat, readFloat, 4)
+XX(double, writeDouble, readDouble, 8)
+#undef XX
+
+template<>
+class Serializer<std::string> {
+public:
+    static size_t Size(const std::string& v) {
+        return VarintSize(v.size()) + v.size();
+    }
+    static void Encode(ByteArray& ba, const std::string& v) {
+        ba.writeStringVint(v);
+    }
+    static void Decode(ByteArray& ba, std::string& v) {
+        uint64_t len = ba.readUint64();
+        // 长度来自数据, 损坏时可能很大, 先检查再分配
+        if(len > ba.getReadSize()) {
+            throw std::out_of_range("not enough len");
+        }
+        v.resize(len);
+        if(len) {
+            ba.read(&v[0], len);
+        }
+    }
+};
+
+template<>
+class Serializer<bool> {
+public:
+    static size_t Size(const bool& v) { return 1;}
+    static void Encode(ByteArray& ba, const bool& v) { ba.writeFuint8(v ? 1 : 0);}
+    static void Decode(ByteArray& ba, bool& v) { v = ba.readFuint8() != 0;}
+};
+
+/// 枚举按底层类型编码
+template<class T>
+class Serializer<T, typename std::enable_if<std::is_enum<T>::value>::type> {
+public:
+    typedef typename std::underlying_type<T>::type base_type;
+
+    static size_t Size(const T& v) {
+        return Serializer<base_type>::Size((base_type)v);
+    }
+    static void Encode(ByteArray& ba, const T& v) {
+        Serializer<base_type>::Encode(ba, (base_type)v);
+    }
+    static void Decode(ByteArray& ba, T& v) {
+        base_type tmp;
+        Serializer<base_type>::Decode(ba, tmp);
+        v = (T)tmp;
+    }
+};
+
+template<class T>
+class Serializer<Optional<T> > {
+public:
+    static size_t Size(const Optional<T>& v) {
+        return 1 + (v ? Serializer<T>::Size(v.get()) : 0);
+    }
+    static void Encode(ByteArray& ba, const Optional<T>& v) {
+        ba.writeFuint8(v ? 1 : 0);
+        if(v) {
+            Serializer<T>::Encode(ba, v.get());
+        }
+    }
+    static void Decode(ByteArray& ba, Optional<T>& v) {
+        if(ba.readFuint8()) {
+            T tmp;
+            Serializer<T>::Decode(ba, tmp);
+            v.set(tmp);
+        } else {
+            v.reset();
+        }
+    }
+};
+
+template<class T>
+class Serializer<std::vector<T> > {
+public:
+    // std::vector<bool>的元素是临时的代理对象, 只能用const引用
+    static size_t Size(const std::vector<T>& v) {
+        size_t size = VarintSize(v.size());
+        for(const auto& i : v) {
+            size += Serializer<T>::Size(i);
+        }
+        return size;
+    }
+    static void Encode(ByteArray& ba, const std::vector<T>& v) {
+        ba.writeUint64(v.size());
+        for(const auto& i : v) {
+            Serializer<T>::Encode(ba, i);
+        }
+    }
+    static void Decode(ByteArray& ba, std::vector<T>& v) {
+        size_t count = ba.readUint64();
+        v.clear();
+        // 个数来自数据, 损坏时可能很大, 预分配的内存不超过剩余的字节数
+        v.reserve(std::min(count, ba.getReadSize() / sizeof(T)));
+        for(size_t i = 0; i < count; ++i) {
+            T tmp;
+            Serializer<T>::Decode(ba, tmp);
+            v.push_back(std::move(tmp));
+        }
+    }
+};
+
+/// uint64_t数组使用批量varint编解码
+template<>
+class Serializer<std::vector<uint64_t> > {
+public:
+    static size_t Size(const std::vector<uint64_t>& v) {
+        size_t size = VarintSize(v.size());
+        for(auto& i : v) {
+            size += VarintSize(i);
+        }
+        return size;
+    }
+    static void Encode(ByteArray& ba, const std::vector<uint64_t>& v) {
+        ba.writeUint64(v.size());
+        if(!v.empty()) {
+            ba.writeVarints(&v[0], v.size());
+        }
+    }
+    static void Decode(ByteArray& ba, std::vector<uint64_t>& v) {
+        size_t count = ba.readUint64();
+        // 每个值至少1个字节
+        if(count > ba.getReadSize()) {
+            throw std::out_of_range("not enough len");
+        }
+        v.resize(count);
+        if(count) {
+            ba.readVarints(&v[0], count);
+        }
+    }
+};
+
+template<class K, class V>
+class Serializer<std::map<K, V> > {
+public:
+    static size_t Size(const std::map<K, V>& v) {
+        size_t size = VarintSize(v.size());
+        for(auto& i : v) {
+            size += Serializer<K>::Size(i.first) + Serializer<V>::Size(i.second);
+        }
+        return size;
+    }
+    static void Encode(ByteArray& ba, const std::map<K, V>& v) {
+        ba.writeUint64(v.size());
+        for(auto& i : v) {
+            Serializer<K>::Encode(ba, i.first);
+            Serializer<V>::Encode(ba, i.second);
+        }
+    }
+    static void Decode(ByteArray& ba, std::map<K, V>& v) {
+        size_t count = ba.readUint64();
+        v.clear();
+        for(size_t i = 0; i < count; ++i) {
+            K key;
+            V value;
+            Serializer<K>::Decode(ba, key);
+            Serializer<V>::Decode(ba, value);
+            // 编码时是有序的, 插入到末尾
+            v.emplace_hint(v.end(), std::move(key), std::move(value));
+        }
+    }
+};
+
+/// 累加字段的编码长度
+class SizeVisitor {
+public:
+    template<class... Args>
+    void operator()(const Args&... args) {
+        // 花括号初始化保证从左到右求值
+        int expand[] = {0, (size += Serializer<Args>::Size(args), 0)...};
+        (void)expand;
+    }
+    size_t size = 0;
+};
+
+/// 依次编码字段
+class EncodeVisitor {
+public:
+    EncodeVisitor(ByteArray& ba) : m_ba(ba) {}
+
+    template<class... Args>
+    void operator()(const Args&... args) {
+        int expand[] = {0, (Serializer<Args>::Encode(m_ba, args), 0)...};
+        (void)expand;
+    }
+private:
+    ByteArray& m_ba;
+};
+
+/// 依次解码字段
+class DecodeVisitor {
+public:
+    DecodeVisitor(ByteArray& ba) : m_ba(ba) {}
+
+    template<class... Args>
+    void operator()(Args&... args) {
+        int expand[] = {0, (Serializer<Args>::Decode(m_ba, args), 0)...};
+        (void)expand;
+    }
+private:
+    ByteArray& m_ba;
+};
+
+/// 用SYLAR_SERIALIZE_FIELDS声明了字段的结构体(SylarSerializeTag是void)
+template<class T>
+class Serializer<T, typename T::SylarSerializeTag> {
+public:
+    static size_t Size(const T& v) {
+        SizeVisitor visitor;
+        v.sylarVisitFields(visitor);
+        return visitor.size;
+    }
+    static void Encode(ByteArray& ba, const T& v) {
+        EncodeVisitor visitor(ba);
+        v.sylarVisitFields(visitor);
+    }
+    static void Decode(ByteArray& ba, T& v) {
+        DecodeVisitor visitor(ba);
+        v.sylarVisitFields(visitor);
+    }
+};
+
+/// 编码长度
+template<class T>
+size_t SerializeSize(const T& v) {
+    return Serializer<T>::Size(v);
+}
+
+/**
+ * @brief 把v编码到ba的当前位置
+ * @details 先按编码长度预留容量, 之后的写入不再分配结点
+ */
+template<class T>
+void Serialize(ByteArray& ba, const T& v) {
+    ba.reserve(Serializer<T>::Size(v));
+    Serializer<T>::Encode(ba, v);
+}
+
+/**
+ * @brief 从ba的当前位置解码出v
+ * @exception 数据不足时抛出std::out_of_range, v中可能只有部分字段被赋值
+ */
+template<class T>
+void Deserialize(ByteArray& ba, T& v) {
+    Serializer<T>::Decode(ba, v);
+}
+
+}
+
+#endif
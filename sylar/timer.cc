@@ -1,45 +1,48 @@
 #include "timer.h"
 #include "util.h"
+#include "config.h"
+#include <algorithm>
+#include <string.h>
 
 namespace sylar {
 
-bool Timer::Comparator::operator()(const Timer::ptr& lhs, const Timer::ptr& rhs) const {
-    if(!lhs && !rhs) {
-        return false;
-    }
-    if(!lhs) {
-        return true;
-    }
-    if(!rhs) {
-        return false;
-    }
-    // 为什么会出现空的情况呢?
-
+/// 时间轮一个刻度的毫秒数, 时间轮中的定时器最多推迟这么久触发
+static ConfigVar<uint32_t>::ptr g_timer_wheel_tick =
+    Config::Lookup<uint32_t>("timer.wheel_tick", 10, "timer wheel tick ms");
 
-    if(lhs->m_next < rhs->m_next) { // 按执行时间近的排序
-        return true;
-    }
-    if(rhs->m_next < lhs->m_next) {
-        return false;
-    }
+/// AUTO精度的定时器超时时间不小于这个值(毫秒)时放入时间轮, 0表示都放在堆中
+static ConfigVar<uint64_t>::ptr g_timer_wheel_threshold =
+    Config::Lookup<uint64_t>("timer.wheel_threshold", 0, "timer wheel threshold ms");
 
-    return lhs.get() < rhs.get();
+/// 定时器是否使用CLOCK_MONOTONIC_COARSE, 读时钟更快, 但是会推迟最多一个时钟中断触发
+static ConfigVar<bool>::ptr g_timer_coarse_clock =
+    Config::Lookup<bool>("timer.coarse_clock", false, "timer use CLOCK_MONOTONIC_COARSE");
 
-}
+/// 堆的叉数
+static const size_t HEAP_ARITY = 4;
+/// 墓碑数超过这个值并且超过堆的一半时重建堆
+static const size_t PURGE_MIN = 64;
 
-Timer::Timer(uint64_t ms, std::function<void()> cb, 
+Timer::Timer(uint64_t us, std::function<void()> cb, 
              bool recurring, TimerManager* manager) 
-    : m_recurring(recurring), m_ms(ms), m_cb(cb), m_manager(manager){
-    m_next = sylar::GetCurrentMS() + m_ms;      
+    : m_recurring(recurring), m_us(us), m_cb(cb), m_manager(manager){
+    m_next = m_manager->getNowUs() + m_us;      
 }   
 
 bool Timer::cancel() {
     TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-    if (m_cb) {
-        m_cb = nullptr;
-
-        auto it = m_manager->m_timers.find(shared_from_this());
-        m_manager->m_timers.erase(it);
+    if (m_active) {
+        TimerManager::deactivate(this);     // 释放回调持有的资源, 定时器作为墓碑留在堆中
+
+        if(m_coarse) {
+            // 时间轮中直接摘除, 调用者持有引用, 释放时间轮的引用后定时器仍然有效
+            if(m_wheelSlot != WHEEL_NPOS) {
+                m_manager->wheelRemove(this);
+            }
+        } else if(m_index != NPOS) {
+            ++m_manager->m_cancelled;
+            m_manager->purgeCancelled();
+        }
         return true;
     }
     return false;
@@ -47,65 +50,100 @@ bool Timer::cancel() {
 
 bool Timer::refresh() { // 重新设置时间
     TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-    if(!m_cb) {
-        return false;
+    if(m_coarse) {
+        if(!m_active || m_wheelSlot == WHEEL_NPOS) {
+            return false;
+        }
+        m_next = m_manager->getNowUs() + m_us;
+        m_manager->wheelAdd(m_manager->wheelRemove(this));
+        return true;
     }
-
-    auto it = m_manager->m_timers.find(shared_from_this());
-    if(it == m_manager->m_timers.end()) {
+    if(!m_active || m_index == NPOS) {
         return false;
     }
-    m_manager->m_timers.erase(it);
-    // 先删除再加入是为了重新排序
 
-    m_next = sylar::GetCurrentMS() + m_ms;     // 基于当前时间重新设置
-    m_manager->addTimer(shared_from_this(), lock);
+    m_next = m_manager->getNowUs() + m_us;     // 基于当前时间重新设置
+    // 原地调整位置, 不需要删除再插入
+    m_manager->heapFix(m_index);
+    m_manager->purgeCancelled();
     return true;
 }
 
 bool Timer::reset(uint64_t ms, bool from_now) {
-    if(ms == m_ms && !from_now) {
+    uint64_t us = ms * 1000;
+    if(us == m_us && !from_now) {
         return true;
     }
     TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-    if(!m_cb) {
-        return false;
-    }
-    auto it = m_manager->m_timers.find(shared_from_this());
-    if(it == m_manager->m_timers.end()) {
+    if(!m_active || (m_coarse ? m_wheelSlot == WHEEL_NPOS : m_index == NPOS)) {
         return false;
     }
-    m_manager->m_timers.erase(it);
 
     uint64_t start = 0;
     if(from_now) {
-        start = sylar::GetCurrentMS();
+        start = m_manager->getNowUs();
     } else {
-        start = m_next - m_ms;      // 基于之前设置的时间
+        start = m_next - m_us;      // 基于之前设置的时间
     }
-    m_ms = ms;
-    m_next = start + m_ms;
-    it = m_manager->m_timers.insert(shared_from_this()).first;
-    
+    m_us = us;
+    m_next = start + m_us;
+    if(m_coarse) {
+        m_manager->wheelAdd(m_manager->wheelRemove(this));
+        return true;
+    }
+    m_manager->heapFix(m_index);
+    m_manager->purgeCancelled();
     return true;
 }
 
-Timer::Timer(uint64_t next) : m_next(next) {
-
+bool Timer::start(uint64_t ms) {
+    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
+    if(m_active) {
+        return false;
+    }
+    m_active = true;
+    m_us = ms * 1000;
+    m_next = m_manager->getNowUs() + m_us;
+    if(m_index == NPOS) {
+        // 不在堆中(墓碑会原地恢复)时重新选择放在堆中还是时间轮中
+        m_coarse = m_manager->useWheel((TimerManager::Precision)m_precision, m_us);
+    }
+    m_manager->addTimer(shared_from_this(), lock);
+    return true;
 }
 
 TimerManager::TimerManager() {
-    m_previouseTime = sylar::GetCurrentMS();
+    m_coarseClock = g_timer_coarse_clock->getValue();
+    m_wheelTick = std::max(g_timer_wheel_tick->getValue(), 1u) * 1000ull;
+    m_wheelThreshold = g_timer_wheel_threshold->getValue() * 1000;
+    m_wheelCurrent = getNowUs() / m_wheelTick;
+    memset(m_wheel, 0, sizeof(m_wheel));
+    memset(m_wheelBitmap, 0, sizeof(m_wheelBitmap));
 }
 TimerManager::~TimerManager() {
-
+    // 打断时间轮中定时器对自己的引用
+    for(size_t i = 0; i < WHEEL_LEVELS * WHEEL_SLOTS; ++i) {
+        Timer* timer = wheelTake(i);
+        while(timer) {
+            Timer* next = timer->m_wheelNext;
+            timer->m_wheelSelf.reset();
+            timer = next;
+        }
+    }
 }
 
 // void onTimerInsertedAtFront();
 
 
-Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb, bool recurring) {
-    Timer::ptr timer(new Timer(ms, cb, recurring, this));
+Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb, bool recurring
+                                  ,Precision precision) {
+    return addTimerUs(ms * 1000, cb, recurring, precision);
+}
+
+Timer::ptr TimerManager::addTimerUs(uint64_t us, std::function<void()> cb, bool recurring
+                                    ,Precision precision) {
+    Timer::ptr timer(new Timer(us, cb, recurring, this));
+    timer->m_coarse = useWheel(precision, us);
     RWMutexType::WriteLock lock(m_mutex);
     addTimer(timer, lock);
     // auto it = m_timers.insert(timer).first;
@@ -121,6 +159,14 @@ Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb, bool re
     return timer;
 }
 
+Timer::ptr TimerManager::createTimer(std::function<void()> cb, Precision precision) {
+    Timer::ptr timer(new Timer(0, cb, false, this));
+    timer->m_active = false;
+    timer->m_reusable = true;
+    timer->m_precision = precision;
+    return timer;
+}
+
 static void OnTimer(std::weak_ptr<void> weak_cond, std::function<void()> cb) {
     std::shared_ptr<void> tmp = weak_cond.lock();   
     if (tmp) {  // 如果这个智能指针没释放，则说明条件满足
@@ -131,79 +177,109 @@ static void OnTimer(std::weak_ptr<void> weak_cond, std::function<void()> cb) {
 /// 条件触发器
 Timer::ptr TimerManager::addConditionTimer(uint64_t ms, std::function<void()> cb
                                             ,std::weak_ptr<void> weak_cond      // !!!注意这里使用智能指针
-                                            ,bool recurring){
-    return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring);
+                                            ,bool recurring
+                                            ,Precision precision){
+    return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring, precision);
 }
 
 uint64_t TimerManager::getNextTimer() {
+    uint64_t next = getNextTimerUs();
+    if(next == ~0ull) {
+        return ~0ull;
+    }
+    // 向上取整, 不足1毫秒的定时器不会变成0毫秒的忙等
+    return (next + 999) / 1000;
+}
+
+uint64_t TimerManager::getNextTimerUs() {
     RWMutexType::ReadLock lock(m_mutex);
     m_tickled = false;      // ??? 这里是干什么
-    if (m_timers.empty()) {
+    // 堆顶不会是墓碑
+    uint64_t next = m_timers.empty() ? ~0ull : m_timers[0].next;
+    next = std::min(next, wheelNext());
+    if (next == ~0ull) {
         return ~0ull;
     }
 
-    const Timer::ptr& next = *m_timers.begin();
-    uint64_t now_ms = sylar::GetCurrentMS();
-    if (now_ms >= next->m_next) {
+    uint64_t now_us = getNowUs();
+    if (now_us >= next) {
         return 0;
     } else {
-        return next->m_next - now_ms;
+        return next - now_us;
     }
 }
 
+uint64_t TimerManager::getNowUs() const {
+    return GetMonotonicUS(m_coarseClock);
+}
+
 void TimerManager::listExpiredCb(std::vector<std::function<void()> >& cbs) {
-    uint64_t now_ms = sylar::GetCurrentMS();
-    std::vector<Timer::ptr> expired;
+    uint64_t now_us = getNowUs();
     {
         RWMutexType::ReadLock lock(m_mutex);
-        if (m_timers.empty()) {
+        if (m_timers.empty() && !m_wheelCount) {
             return;
         }
     }
     RWMutexType::WriteLock lock(m_mutex);
-    if(m_timers.empty()) {
+    if(m_timers.empty() && !m_wheelCount) {
         return;
     }
 
-    // 检查是否没有改过时间，并且没有超时
-    bool rollover = detectClockRollover(now_ms);
-    if(!rollover && ((*m_timers.begin())->m_next > now_ms)) {
+    // 单调时钟不会被往回调, 不需要检测时间回退
+    if((m_timers.empty() || m_timers[0].next > now_us)
+            && now_us / m_wheelTick <= m_wheelCurrent) {
         return;
     }
 
-    Timer::ptr now_timer(new Timer(now_ms));
-    auto it = rollover ? m_timers.end() : m_timers.lower_bound(now_timer);
-    while(it != m_timers.end() && (*it)->m_next == now_ms) {
-        ++it;
-    }
-
-    expired.insert(expired.begin(), m_timers.begin(), it);  // 加入记录
-    m_timers.erase(m_timers.begin(), it);   // 删除定时器
-    cbs.reserve(expired.size());
+    wheelAdvance(now_us, cbs);
 
-    for (auto& timer : expired) {
+    while(!m_timers.empty() && m_timers[0].next <= now_us) {
+        Timer* timer = m_timers[0].timer.get();
+        if(!timer->m_active) {
+            heapPop();
+            --m_cancelled;
+            continue;
+        }
         cbs.push_back(timer->m_cb);
         if (timer->m_recurring) {
-            timer->m_next = now_ms + timer->m_ms;
-            m_timers.insert(timer);
+            // 循环定时器留在堆中, 只需要向下调整
+            timer->m_next = now_us + timer->m_us;
+            m_timers[0].next = timer->m_next;
+            siftDown(0);
         }else{
-            timer->m_cb = nullptr;  // 清除可能的智能指针引用计数 ?? 为什么这里要手动减1呢?感觉每必要呀
+            deactivate(timer);  // 清除可能的智能指针引用计数 ?? 为什么这里要手动减1呢?感觉每必要呀
+            heapPop();
         }
     }
+    purgeCancelled();
 }   
 
 
 
 bool TimerManager::hasTimer() {
     RWMutex::ReadLock lock(m_mutex);
-    return !m_timers.empty();
+    return !m_timers.empty() || m_wheelCount;
 
 }
 
 void TimerManager::addTimer(Timer::ptr val, RWMutexType::WriteLock& lock) {
-    auto it = m_timers.insert(val).first;
-
-    bool at_front = (it == m_timers.begin()) && !m_tickled;
+    bool at_front = false;
+    if(val->m_coarse) {
+        // 比堆顶和时间轮原来的下一次处理时间都早, 才需要唤醒
+        uint64_t next = m_timers.empty() ? ~0ull : m_timers[0].next;
+        next = std::min(next, wheelNext());
+        wheelAdd(val);
+        at_front = wheelNext() < next;
+    } else if(val->m_index != Timer::NPOS) {
+        // 重新启动还留在堆中的墓碑, 原地调整位置
+        --m_cancelled;
+        heapFix(val->m_index);
+        at_front = val->m_index == 0 && wheelNext() > val->m_next;
+    } else {
+        at_front = heapPush(val) && wheelNext() > val->m_next;
+    }
+    at_front = at_front && !m_tickled;
     if(at_front) {
         m_tickled = true;       // ???这里有什么用??
         //。实际实现时，只需要在onTimerInsertedAtFront()方法内执行一次tickle就行了，
@@ -217,16 +293,255 @@ void TimerManager::addTimer(Timer::ptr val, RWMutexType::WriteLock& lock) {
     }
 }
 
-bool TimerManager::detectClockRollover(uint64_t now_ms) {
-    bool rollover = false;
-    if(now_ms < m_previouseTime && 
-      now_ms < (m_previouseTime - 60 * 60 * 1000)) {
-        // 检查一下系统时间有没有被往回调。如果系统时间往回调了1个小时以上，那就触发全部定时器
-        rollover = true;
+bool TimerManager::useWheel(Precision precision, uint64_t us) const {
+    return precision == COARSE
+        || (precision == AUTO && m_wheelThreshold && us >= m_wheelThreshold);
+}
+
+void TimerManager::deactivate(Timer* timer) {
+    timer->m_active = false;
+    if(!timer->m_reusable) {
+        timer->m_cb = nullptr;
+    }
+}
+
+bool TimerManager::heapPush(const Timer::ptr& timer) {
+    timer->m_index = m_timers.size();
+    m_timers.push_back(HeapEntry{timer->m_next, timer});
+    siftUp(timer->m_index);
+    return timer->m_index == 0;
+}
+
+void TimerManager::heapPop() {
+    m_timers[0].timer->m_index = Timer::NPOS;
+    if(m_timers.size() > 1) {
+        m_timers[0] = std::move(m_timers.back());
+        m_timers[0].timer->m_index = 0;
+        m_timers.pop_back();
+        siftDown(0);
+    } else {
+        m_timers.pop_back();
+    }
+}
+
+void TimerManager::heapFix(size_t idx) {
+    HeapEntry& entry = m_timers[idx];
+    entry.next = entry.timer->m_next;
+    if(idx > 0 && entry.next < m_timers[(idx - 1) / HEAP_ARITY].next) {
+        siftUp(idx);
+    } else {
+        siftDown(idx);
+    }
+}
+
+void TimerManager::siftUp(size_t idx) {
+    HeapEntry entry = std::move(m_timers[idx]);
+    while(idx > 0) {
+        size_t parent = (idx - 1) / HEAP_ARITY;
+        if(!(entry.next < m_timers[parent].next)) {
+            break;
+        }
+        m_timers[idx] = std::move(m_timers[parent]);
+        m_timers[idx].timer->m_index = idx;
+        idx = parent;
+    }
+    entry.timer->m_index = idx;
+    m_timers[idx] = std::move(entry);
+}
+
+void TimerManager::siftDown(size_t idx) {
+    size_t size = m_timers.size();
+    HeapEntry entry = std::move(m_timers[idx]);
+    while(true) {
+        size_t first = idx * HEAP_ARITY + 1;
+        if(first >= size) {
+            break;
+        }
+        // 找出最早执行的子结点
+        size_t last = std::min(first + HEAP_ARITY, size);
+        size_t min = first;
+        for(size_t i = first + 1; i < last; ++i) {
+            if(m_timers[i].next < m_timers[min].next) {
+                min = i;
+            }
+        }
+        if(!(m_timers[min].next < entry.next)) {
+            break;
+        }
+        m_timers[idx] = std::move(m_timers[min]);
+        m_timers[idx].timer->m_index = idx;
+        idx = min;
+    }
+    entry.timer->m_index = idx;
+    m_timers[idx] = std::move(entry);
+}
+
+void TimerManager::purgeCancelled() {
+    while(!m_timers.empty() && !m_timers[0].timer->m_active) {
+        heapPop();
+        --m_cancelled;
+    }
+    if(m_cancelled < PURGE_MIN || m_cancelled * 2 < m_timers.size()) {
+        return;
+    }
+    // 墓碑太多, 压缩后重新建堆
+    size_t n = 0;
+    for(auto& i : m_timers) {
+        if(i.timer->m_active) {
+            m_timers[n++] = std::move(i);
+        } else {
+            i.timer->m_index = Timer::NPOS;
+        }
+    }
+    m_timers.erase(m_timers.begin() + n, m_timers.end());
+    m_cancelled = 0;
+    for(size_t i = 0; i < n; ++i) {
+        m_timers[i].timer->m_index = i;
+    }
+    if(n > 1) {
+        // 从最后一个非叶子结点开始向下调整
+        for(size_t i = (n - 2) / HEAP_ARITY + 1; i-- > 0;) {
+            siftDown(i);
+        }
+    }
+}
+
+void TimerManager::wheelAdd(const Timer::ptr& timer, bool cascading) {
+    // 向上取整, 时间轮中的定时器不会提前触发
+    uint64_t expire = (timer->m_next + m_wheelTick - 1) / m_wheelTick;
+    uint64_t min_tick = cascading ? m_wheelCurrent : m_wheelCurrent + 1;
+    if(expire < min_tick) {
+        expire = min_tick;
+    }
+    uint64_t delta = expire - m_wheelCurrent;
+    size_t level = 0;
+    while(level < WHEEL_LEVELS - 1 && delta >= (1ull << (WHEEL_BITS * (level + 1)))) {
+        ++level;
+    }
+    if(delta >= (1ull << (WHEEL_BITS * WHEEL_LEVELS))) {
+        // 超出时间轮的范围, 先放在最高层最晚处理的槽位, 级联时重新计算
+        expire = m_wheelCurrent + (1ull << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+    size_t idx = (expire >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    size_t slot = level * WHEEL_SLOTS + idx;
+
+    Timer* head = m_wheel[slot];
+    timer->m_wheelPrev = nullptr;
+    timer->m_wheelNext = head;
+    if(head) {
+        head->m_wheelPrev = timer.get();
+    }
+    m_wheel[slot] = timer.get();
+    m_wheelBitmap[level] |= 1ull << idx;
+    timer->m_wheelSlot = slot;
+    timer->m_wheelSelf = timer;
+    ++m_wheelCount;
+}
+
+Timer::ptr TimerManager::wheelRemove(Timer* timer) {
+    size_t slot = timer->m_wheelSlot;
+    if(timer->m_wheelPrev) {
+        timer->m_wheelPrev->m_wheelNext = timer->m_wheelNext;
+    } else {
+        m_wheel[slot] = timer->m_wheelNext;
+        if(!m_wheel[slot]) {
+            m_wheelBitmap[slot / WHEEL_SLOTS] &= ~(1ull << (slot % WHEEL_SLOTS));
+        }
+    }
+    if(timer->m_wheelNext) {
+        timer->m_wheelNext->m_wheelPrev = timer->m_wheelPrev;
+    }
+    timer->m_wheelPrev = nullptr;
+    timer->m_wheelNext = nullptr;
+    timer->m_wheelSlot = Timer::WHEEL_NPOS;
+    --m_wheelCount;
+    return std::move(timer->m_wheelSelf);
+}
+
+Timer* TimerManager::wheelTake(size_t slot) {
+    Timer* head = m_wheel[slot];
+    if(!head) {
+        return nullptr;
+    }
+    m_wheel[slot] = nullptr;
+    m_wheelBitmap[slot / WHEEL_SLOTS] &= ~(1ull << (slot % WHEEL_SLOTS));
+    for(Timer* i = head; i; i = i->m_wheelNext) {
+        i->m_wheelSlot = Timer::WHEEL_NPOS;
+        --m_wheelCount;
+    }
+    return head;
+}
+
+void TimerManager::wheelAdvance(uint64_t now_us, std::vector<std::function<void()> >& cbs) {
+    uint64_t now_tick = now_us / m_wheelTick;
+    while(m_wheelCurrent < now_tick) {
+        if(!m_wheelCount) {
+            m_wheelCurrent = now_tick;
+            break;
+        }
+        if(!m_wheelBitmap[0]) {
+            // 最低层是空的, 直接跳到下一次级联
+            uint64_t boundary = m_wheelCurrent | (WHEEL_SLOTS - 1);
+            if(boundary >= now_tick) {
+                m_wheelCurrent = now_tick;
+                break;
+            }
+            m_wheelCurrent = boundary;
+        }
+        ++m_wheelCurrent;
+
+        // 低层转完一圈, 把上一层当前槽位的定时器重新分散到低层
+        for(size_t level = 1; level < WHEEL_LEVELS; ++level) {
+            if((m_wheelCurrent >> (WHEEL_BITS * (level - 1))) & (WHEEL_SLOTS - 1)) {
+                break;
+            }
+            size_t idx = (m_wheelCurrent >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+            Timer* timer = wheelTake(level * WHEEL_SLOTS + idx);
+            while(timer) {
+                Timer* next = timer->m_wheelNext;
+                Timer::ptr self = std::move(timer->m_wheelSelf);
+                wheelAdd(self, true);
+                timer = next;
+            }
+        }
+
+        Timer* timer = wheelTake(m_wheelCurrent & (WHEEL_SLOTS - 1));
+        while(timer) {
+            Timer* next = timer->m_wheelNext;
+            Timer::ptr self = std::move(timer->m_wheelSelf);
+            if((timer->m_next + m_wheelTick - 1) / m_wheelTick > m_wheelCurrent) {
+                // 超出范围被截断的定时器还没有到期
+                wheelAdd(self);
+            } else {
+                cbs.push_back(timer->m_cb);
+                if(timer->m_recurring) {
+                    timer->m_next = now_us + timer->m_us;
+                    wheelAdd(self);
+                } else {
+                    deactivate(timer);
+                }
+            }
+            timer = next;
+        }
     }
-    m_previouseTime = now_ms;
-    return rollover;
 }
 
+uint64_t TimerManager::wheelNext() const {
+    if(!m_wheelCount) {
+        return ~0ull;
+    }
+    uint64_t tick = 0;
+    uint64_t bitmap = m_wheelBitmap[0];
+    if(bitmap) {
+        // 最低层的定时器都在(m_wheelCurrent, m_wheelCurrent + WHEEL_SLOTS)内
+        size_t shift = (m_wheelCurrent + 1) & (WHEEL_SLOTS - 1);
+        uint64_t rotated = shift ? (bitmap >> shift) | (bitmap << (WHEEL_SLOTS - shift)) : bitmap;
+        tick = m_wheelCurrent + 1 + __builtin_ctzll(rotated);
+    } else {
+        // 最低层是空的, 到下一次级联时再检查
+        tick = (m_wheelCurrent | (WHEEL_SLOTS - 1)) + 1;
+    }
+    return tick * m_wheelTick;
+}
 
-}
\ No newline at end of file
+}
@@ -1,6 +1,10 @@
 /**
  * @file timer.h
  * @brief 定时器封装
+ * @details 定时器保存在4叉最小堆中, 定时器记录自己在堆中的下标;
+ *          取消只清除回调作为墓碑留在堆中, 到达堆顶或墓碑过多时才真正删除
+ *          粗粒度的定时器(例如连接的读超时)放在分层时间轮中, 添加、取消和刷新都是O(1)
+ *          时间使用单调时钟(CLOCK_MONOTONIC), 内部精度是微秒
  */
 #ifndef __SYLAR_TIMER_H__
 #define __SYLAR_TIMER_H__
@@ -8,7 +12,6 @@
 #include <memory>
 #include <functional>
 #include <vector>
-#include <set>
 #include "mutex.h"
 
 
@@ -30,36 +33,45 @@ public:
      */
     bool reset(uint64_t ms, bool from_now);
 
+    /**
+     * @brief 重新启动一个已经停止的定时器
+     * @details 用于TimerManager::createTimer创建的可复用定时器, 触发或取消后保留回调,
+     *          再次等待时不需要重新创建定时器和回调; 还留在堆中的墓碑原地恢复
+     * @param[in] ms 从当前时间开始的超时时间(毫秒)
+     * @return 定时器还没有停止时返回false
+     */
+    bool start(uint64_t ms);
+
 private:
     /**
      * @brief 构造函数
-     * @param[in] ms 定时器执行间隔时间
+     * @param[in] us 定时器执行间隔时间(微秒)
      * @param[in] cb 回调函数
      * @param[in] recurring 是否循环
      * @param[in] manager 定时器管理器
      */
-    Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager* manager);        // Timer只能通过TimeManager创建
-    Timer(uint64_t next);
+    Timer(uint64_t us, std::function<void()> cb, bool recurring, TimerManager* manager);        // Timer只能通过TimeManager创建
 
+    /// 不在堆中时的下标
+    static const size_t NPOS = (size_t)-1;
+    /// 不在时间轮中时的槽位
+    static const uint32_t WHEEL_NPOS = (uint32_t)-1;
 private:
     bool m_recurring = false;
-    uint64_t m_ms = 0;      // 时间周期
-    uint64_t m_next = 0;    // 该定时器任务的下一次的执行时间（绝对时间）
+    bool m_active = true;   // 是否在等待触发, 触发(非循环)或取消后为false
+    bool m_reusable = false;    // 是否可复用, 停止后保留回调
+    int m_precision = 0;        // 可复用定时器的精度(TimerManager::Precision), 每次启动时重新选择堆或时间轮
+    uint64_t m_us = 0;      // 时间周期(微秒)
+    uint64_t m_next = 0;    // 该定时器任务的下一次的执行时间（单调时钟的绝对时间, 微秒）
     std::function<void()> m_cb;
     TimerManager* m_manager = nullptr;
+    size_t m_index = NPOS;  // 在定时器堆中的下标
 
-private:
-    /**
-     * @brief 定时器比较仿函数
-     */
-    struct Comparator {
-        /**
-         * @brief 比较定时器的智能指针的大小(按执行时间排序)
-         * @param[in] lhs 定时器智能指针
-         * @param[in] rhs 定时器智能指针
-         */
-        bool operator()(const Timer::ptr& lhs, const Timer::ptr& rhs) const;
-    };
+    bool m_coarse = false;              // 是否在时间轮中
+    uint32_t m_wheelSlot = WHEEL_NPOS;  // 在时间轮中的槽位
+    Timer* m_wheelPrev = nullptr;       // 同一个槽位中的前一个定时器
+    Timer* m_wheelNext = nullptr;       // 同一个槽位中的后一个定时器
+    ptr m_wheelSelf;                    // 在时间轮中时持有自己, 移出时释放
 };
 
 class TimerManager {
@@ -68,18 +80,45 @@ public:
     typedef std::shared_ptr<TimerManager> ptr;
     typedef RWMutex RWMutexType;        // 使用读写锁
 
+    /// 定时器精度, 决定定时器放在堆中还是时间轮中
+    enum Precision {
+        /// 超时时间不小于timer.wheel_threshold时使用时间轮, 否则使用堆
+        AUTO = 0,
+        /// 精确到毫秒, 使用堆
+        PRECISE = 1,
+        /// 粗粒度, 使用时间轮, 最多推迟timer.wheel_tick毫秒触发
+        COARSE = 2,
+    };
+
     TimerManager();
     virtual ~TimerManager();
 
-    Timer::ptr addTimer(uint64_t ms, std::function<void()> cb, bool recurring = false);
+    Timer::ptr addTimer(uint64_t ms, std::function<void()> cb, bool recurring = false
+                        ,Precision precision = AUTO);
+
+    /// 添加微秒级的定时器
+    Timer::ptr addTimerUs(uint64_t us, std::function<void()> cb, bool recurring = false
+                        ,Precision precision = AUTO);
+
+    /**
+     * @brief 创建一个停止状态的可复用定时器, 调用Timer::start启动
+     * @details 触发或取消后不释放回调, 反复使用同一个定时器等待时没有内存分配
+     */
+    Timer::ptr createTimer(std::function<void()> cb, Precision precision = AUTO);
 
     /// 条件触发器
     Timer::ptr addConditionTimer(uint64_t ms, std::function<void()> cb
                                 ,std::weak_ptr<void> weak_cond      // !!!注意这里使用智能指针
-                                ,bool recurring = false);
+                                ,bool recurring = false
+                                ,Precision precision = AUTO);
     
-     ///到最近一个定时器执行的时间间隔(毫秒)
+     ///到最近一个定时器执行的时间间隔(毫秒, 向上取整), 没有定时器返回~0ull
     uint64_t getNextTimer();
+    /// 到最近一个定时器执行的时间间隔(微秒), 没有定时器返回~0ull
+    uint64_t getNextTimerUs();
+
+    /// 定时器使用的当前时间(单调时钟, 微秒), timer.coarse_clock为true时使用CLOCK_MONOTONIC_COARSE
+    uint64_t getNowUs() const;
 
     /// 获取需要执行的定时器的回调函数列表
     void listExpiredCb(std::vector<std::function<void()> >& cbs);
@@ -96,17 +135,71 @@ protected:
     void addTimer(Timer::ptr val, RWMutexType::WriteLock& lock);
 
 private:
-    /// 检测服务器时间是否被调后了
-    bool detectClockRollover(uint64_t now_ms);
+    /// 按精度和超时时间决定是否使用时间轮
+    bool useWheel(Precision precision, uint64_t us) const;
+    /// 停止定时器, 不可复用的定时器同时释放回调
+    static void deactivate(Timer* timer);
+
+    /// 加入堆, 返回是否成为堆顶
+    bool heapPush(const Timer::ptr& timer);
+    /// 删除堆顶
+    void heapPop();
+    /// 执行时间改变后调整下标为idx的定时器的位置
+    void heapFix(size_t idx);
+    void siftUp(size_t idx);
+    void siftDown(size_t idx);
+    /**
+     * @brief 清理已取消的定时器
+     * @details 保证堆顶不是墓碑; 墓碑超过一半时整体重建堆
+     */
+    void purgeCancelled();
+
+    /**
+     * @brief 加入时间轮
+     * @param[in] cascading 是否是级联时重新放入, 此时可以放入当前正要处理的槽位
+     */
+    void wheelAdd(const Timer::ptr& timer, bool cascading = false);
+    /// 从时间轮中移出, 返回时间轮持有的引用
+    Timer::ptr wheelRemove(Timer* timer);
+    /// 取出一个槽位中的全部定时器, 返回链表头
+    Timer* wheelTake(size_t slot);
+    /// 时间轮推进到now_us, 到期的回调放入cbs
+    void wheelAdvance(uint64_t now_us, std::vector<std::function<void()> >& cbs);
+    /// 时间轮下一次需要处理的时间(绝对时间), 没有定时器返回~0ull
+    uint64_t wheelNext() const;
 private:
     /// Mutex
     RWMutexType m_mutex;
-    /// 定时器有序集合
-    std::set<Timer::ptr, Timer::Comparator> m_timers;
+    /// 堆结点, 执行时间和定时器放在一起, 比较时不需要访问定时器
+    struct HeapEntry {
+        uint64_t next;
+        Timer::ptr timer;
+    };
+    /// 定时器4叉最小堆, 按执行时间排序
+    std::vector<HeapEntry> m_timers;
+    /// 堆中已取消(墓碑)的定时器数
+    size_t m_cancelled = 0;
+
+    /// 时间轮每层的槽位数是2^WHEEL_BITS
+    static const size_t WHEEL_BITS = 6;
+    static const size_t WHEEL_SLOTS = 1 << WHEEL_BITS;
+    static const size_t WHEEL_LEVELS = 4;
+    /// 时间轮的槽位, 每个槽位是一个双向链表
+    Timer* m_wheel[WHEEL_LEVELS * WHEEL_SLOTS];
+    /// 每层非空槽位的位图
+    uint64_t m_wheelBitmap[WHEEL_LEVELS];
+    /// 时间轮中的定时器数
+    size_t m_wheelCount = 0;
+    /// 时间轮已经处理到的刻度(绝对时间 / m_wheelTick)
+    uint64_t m_wheelCurrent = 0;
+    /// 时间轮一个刻度的微秒数
+    uint64_t m_wheelTick = 10000;
+    /// AUTO精度的定时器超时时间(微秒)不小于这个值时使用时间轮, 0表示不使用
+    uint64_t m_wheelThreshold = 0;
     /// 是否触发onTimerInsertedAtFront
     bool m_tickled = false;
-    /// 上次执行时间
-    uint64_t m_previouseTime = 0;
+    /// 是否使用CLOCK_MONOTONIC_COARSE
+    bool m_coarseClock = false;
 };
 
 }
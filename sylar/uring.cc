@@ -0,0 +1,253 @@
+#include "uring.h"
+#include "log.h"
+#include "macro.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <vector>
+#include <algorithm>
+
+namespace sylar {
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+static int io_uring_setup(uint32_t entries, io_uring_params* p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, uint32_t opcode, void* arg, uint32_t nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/// 检查用到的操作内核是否都支持
+static bool CheckOps(int fd) {
+    const size_t count = 256;
+    std::vector<char> buf(sizeof(io_uring_probe) + count * sizeof(io_uring_probe_op));
+    io_uring_probe* probe = (io_uring_probe*)&buf[0];
+    if(io_uring_register(fd, IORING_REGISTER_PROBE, probe, count)) {
+        return false;
+    }
+    static const uint8_t s_ops[] = {
+        IORING_OP_RECV, IORING_OP_SEND, IORING_OP_ACCEPT,
+        IORING_OP_POLL_ADD, IORING_OP_LINK_TIMEOUT, IORING_OP_ASYNC_CANCEL
+    };
+    for(auto op : s_ops) {
+        if(op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+IoUring::IoUring() {
+}
+
+IoUring* IoUring::Create(uint32_t entries) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = io_uring_setup(entries, &p);
+    if(fd < 0) {
+        SYLAR_LOG_WARN(g_logger) << "io_uring_setup(" << entries << ") errno="
+            << errno << " " << strerror(errno);
+        return nullptr;
+    }
+
+    // 请求参数在提交后就不再被引用; 完成队列满时内核不丢弃事件
+    uint32_t need = IORING_FEAT_NODROP | IORING_FEAT_SUBMIT_STABLE;
+    if((p.features & need) != need || !CheckOps(fd)) {
+        SYLAR_LOG_WARN(g_logger) << "io_uring features=" << p.features
+            << " not supported";
+        close(fd);
+        return nullptr;
+    }
+
+    IoUring* ring = new IoUring;
+    ring->m_fd = fd;
+    ring->m_sqRingSize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    ring->m_cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if(single) {
+        ring->m_sqRingSize = ring->m_cqRingSize
+            = std::max(ring->m_sqRingSize, ring->m_cqRingSize);
+    }
+
+    void* sq = mmap(nullptr, ring->m_sqRingSize, PROT_READ | PROT_WRITE
+                    ,MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(sq == MAP_FAILED) {
+        SYLAR_LOG_ERROR(g_logger) << "mmap sq ring errno=" << errno
+            << " " << strerror(errno);
+        delete ring;
+        return nullptr;
+    }
+    ring->m_sqRing = sq;
+
+    void* cq = sq;
+    if(!single) {
+        cq = mmap(nullptr, ring->m_cqRingSize, PROT_READ | PROT_WRITE
+                  ,MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if(cq == MAP_FAILED) {
+            SYLAR_LOG_ERROR(g_logger) << "mmap cq ring errno=" << errno
+                << " " << strerror(errno);
+            delete ring;
+            return nullptr;
+        }
+    }
+    ring->m_cqRing = cq;
+
+    ring->m_sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, ring->m_sqesSize, PROT_READ | PROT_WRITE
+                      ,MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) {
+        SYLAR_LOG_ERROR(g_logger) << "mmap sqes errno=" << errno
+            << " " << strerror(errno);
+        delete ring;
+        return nullptr;
+    }
+    ring->m_sqes = (io_uring_sqe*)sqes;
+
+    char* sqp = (char*)sq;
+    ring->m_sqHead = (uint32_t*)(sqp + p.sq_off.head);
+    ring->m_sqTail = (uint32_t*)(sqp + p.sq_off.tail);
+    ring->m_sqFlags = (uint32_t*)(sqp + p.sq_off.flags);
+    ring->m_sqArray = (uint32_t*)(sqp + p.sq_off.array);
+    ring->m_sqMask = *(uint32_t*)(sqp + p.sq_off.ring_mask);
+    ring->m_sqEntries = p.sq_entries;
+
+    char* cqp = (char*)cq;
+    ring->m_cqHead = (uint32_t*)(cqp + p.cq_off.head);
+    ring->m_cqTail = (uint32_t*)(cqp + p.cq_off.tail);
+    ring->m_cqes = (io_uring_cqe*)(cqp + p.cq_off.cqes);
+    ring->m_cqMask = *(uint32_t*)(cqp + p.cq_off.ring_mask);
+
+    // 操作码存在不代表支持cancel_flags, 不支持时close()无法唤醒等在fd上的协程
+    if(!ring->checkCancelFd()) {
+        SYLAR_LOG_WARN(g_logger) << "io_uring cancel by fd not supported";
+        delete ring;
+        return nullptr;
+    }
+    return ring;
+}
+
+bool IoUring::checkCancelFd() {
+    // io_uring自己的fd上没有请求: 支持时返回取消的个数0(或者-ENOENT), 不认识cancel_flags的内核返回-EINVAL
+    int rt = cancelFd(m_fd);
+    if(rt < 0) {
+        return false;
+    }
+    do {
+        rt = io_uring_enter(m_fd, 0, 1, IORING_ENTER_GETEVENTS);
+    } while(rt < 0 && errno == EINTR);
+    io_uring_cqe cqe;
+    if(rt < 0 || reap(&cqe, 1) != 1) {
+        return false;
+    }
+    return cqe.res >= 0 || cqe.res == -ENOENT;
+}
+
+IoUring::~IoUring() {
+    if(m_sqes) {
+        munmap(m_sqes, m_sqesSize);
+    }
+    if(m_cqRing && m_cqRing != m_sqRing) {
+        munmap(m_cqRing, m_cqRingSize);
+    }
+    if(m_sqRing) {
+        munmap(m_sqRing, m_sqRingSize);
+    }
+    if(m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+int IoUring::enter(uint32_t to_submit, uint32_t flags) {
+    int rt = 0;
+    do {
+        rt = io_uring_enter(m_fd, to_submit, 0, flags);
+    } while(rt < 0 && errno == EINTR);
+    return rt < 0 ? -errno : rt;
+}
+
+int IoUring::submit(const io_uring_sqe& sqe, uint64_t timeout_ms) {
+    uint32_t count = timeout_ms == ~0ull ? 1 : 2;
+    __kernel_timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000 * 1000;
+
+    MutexType::Lock lock(m_sqMutex);
+    uint32_t head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    uint32_t tail = *m_sqTail;
+    // 每次提交后都会调用io_uring_enter, 队列里不会有积压
+    SYLAR_ASSERT(tail - head + count <= m_sqEntries);
+
+    uint32_t idx = tail & m_sqMask;
+    m_sqes[idx] = sqe;
+    m_sqArray[idx] = idx;
+    if(count == 2) {
+        m_sqes[idx].flags |= IOSQE_IO_LINK;
+
+        uint32_t tidx = (tail + 1) & m_sqMask;
+        io_uring_sqe& t = m_sqes[tidx];
+        memset(&t, 0, sizeof(t));
+        t.opcode = IORING_OP_LINK_TIMEOUT;
+        t.fd = -1;
+        t.addr = (uint64_t)&ts;
+        t.len = 1;
+        t.user_data = 0;
+        m_sqArray[tidx] = tidx;
+    }
+    __atomic_store_n(m_sqTail, tail + count, __ATOMIC_RELEASE);
+
+    while(true) {
+        int rt = enter(count, 0);
+        head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+        if(head == tail + count) {
+            return 0;
+        }
+        if(rt < 0 && head == tail) {
+            // 内核没有取走请求, 撤回, 避免之后提交一个已经失效的user_data
+            __atomic_store_n(m_sqTail, tail, __ATOMIC_RELEASE);
+            SYLAR_LOG_ERROR(g_logger) << "io_uring_enter errno=" << -rt
+                << " " << strerror(-rt);
+            return rt;
+        }
+        count = tail + count - head;
+        tail = head;
+    }
+}
+
+int IoUring::cancelFd(int fd) {
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.fd = fd;
+    sqe.cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe.user_data = 0;
+    return submit(sqe);
+}
+
+size_t IoUring::reap(io_uring_cqe* cqes, size_t max) {
+    MutexType::Lock lock(m_cqMutex);
+    uint32_t head = *m_cqHead;
+    uint32_t tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+    size_t n = 0;
+    while(head != tail && n < max) {
+        cqes[n++] = m_cqes[head & m_cqMask];
+        ++head;
+    }
+    __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+
+    if(n == 0 && (__atomic_load_n(m_sqFlags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW)) {
+        // 完成队列曾经满过, 内核暂存的事件需要通过io_uring_enter刷回完成队列
+        enter(0, IORING_ENTER_GETEVENTS);
+    }
+    return n;
+}
+
+}
@@ -0,0 +1,100 @@
+/**
+ * @file uring.h
+ * @brief io_uring封装(直接使用系统调用, 不依赖liburing)
+ */
+#ifndef __SYLAR_URING_H__
+#define __SYLAR_URING_H__
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "mutex.h"
+#include "noncopyable.h"
+
+namespace sylar {
+
+/**
+ * @brief io_uring提交/完成队列
+ * @details 提交由m_sqMutex串行化, 完成队列由m_cqMutex保护, 可以被多个线程使用
+ */
+class IoUring : Noncopyable {
+public:
+    typedef Mutex MutexType;
+
+    /**
+     * @brief 创建io_uring
+     * @param[in] entries 提交队列长度
+     * @return 内核不支持或者被禁用时返回nullptr
+     */
+    static IoUring* Create(uint32_t entries);
+
+    ~IoUring();
+
+    /// io_uring的文件句柄, 有完成事件时可读, 可以加入epoll
+    int getFd() const { return m_fd;}
+
+    /**
+     * @brief 提交一个请求
+     * @param[in] sqe 请求内容
+     * @param[in] timeout_ms 超时时间, ~0ull表示不超时; 超时后请求以-ECANCELED完成
+     * @return 成功返回0, 失败返回-errno
+     * @details 超时使用链接在请求后面的IORING_OP_LINK_TIMEOUT, 它的完成事件user_data为0
+     */
+    int submit(const io_uring_sqe& sqe, uint64_t timeout_ms = ~0ull);
+
+    /**
+     * @brief 取消fd上所有未完成的请求, 不等待取消结果
+     */
+    int cancelFd(int fd);
+
+    /**
+     * @brief 取出已经完成的事件
+     * @param[out] cqes 完成事件
+     * @param[in] max cqes的容量
+     * @return 取出的数量
+     */
+    size_t reap(io_uring_cqe* cqes, size_t max);
+private:
+    IoUring();
+
+    /// 调用io_uring_enter, 处理EINTR
+    int enter(uint32_t to_submit, uint32_t flags);
+
+    /**
+     * @brief 检查内核是否支持按fd取消(IORING_ASYNC_CANCEL_FD, 5.19之后)
+     * @details 只在创建时调用, 此时还没有其他线程取完成事件
+     */
+    bool checkCancelFd();
+private:
+    /// io_uring文件句柄
+    int m_fd = -1;
+
+    /// 提交队列ring的映射
+    void* m_sqRing = nullptr;
+    size_t m_sqRingSize = 0;
+    /// 完成队列ring的映射(IORING_FEAT_SINGLE_MMAP时和m_sqRing相同)
+    void* m_cqRing = nullptr;
+    size_t m_cqRingSize = 0;
+    /// sqe数组的映射
+    io_uring_sqe* m_sqes = nullptr;
+    size_t m_sqesSize = 0;
+
+    uint32_t* m_sqHead = nullptr;
+    uint32_t* m_sqTail = nullptr;
+    uint32_t* m_sqFlags = nullptr;
+    uint32_t* m_sqArray = nullptr;
+    uint32_t m_sqMask = 0;
+    uint32_t m_sqEntries = 0;
+
+    uint32_t* m_cqHead = nullptr;
+    uint32_t* m_cqTail = nullptr;
+    io_uring_cqe* m_cqes = nullptr;
+    uint32_t m_cqMask = 0;
+
+    MutexType m_sqMutex;
+    MutexType m_cqMutex;
+};
+
+}
+
+#endif
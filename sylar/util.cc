@@ -66,6 +66,16 @@ uint64_t GetCurrentUS() {
     return tv.tv_sec * 1000 * 1000ul  + tv.tv_usec;
 }
 
+uint64_t GetMonotonicUS(bool coarse) {
+    struct timespec ts;
+    clock_gettime(coarse ? CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 * 1000ul + ts.tv_nsec / 1000;
+}
+
+uint64_t GetMonotonicMS(bool coarse) {
+    return GetMonotonicUS(coarse) / 1000;
+}
+
 std::string Time2Str(time_t ts, const std::string& format) {
     struct tm tm;
     localtime_r(&ts, &tm);
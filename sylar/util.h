@@ -44,6 +44,14 @@ std::string BacktraceToString(int size = 64, int skip = 2, const std::string& pr
 uint64_t GetCurrentMS();
 uint64_t GetCurrentUS();
 
+/**
+ * @brief 单调时钟的微秒数, 不受系统时间调整的影响, 用于定时器和超时
+ * @param[in] coarse 是否使用CLOCK_MONOTONIC_COARSE: 读取更快, 但精度只有一个时钟中断(通常1~4ms)
+ */
+uint64_t GetMonotonicUS(bool coarse = false);
+/// 单调时钟的毫秒数
+uint64_t GetMonotonicMS(bool coarse = false);
+
 
 std::string Time2Str(time_t ts = time(0), const std::string& format = "%Y-%m-%d %H:%M:%S");
 time_t Str2Time(const char* str, const char* format = "%Y-%m-%d %H:%M:%S");
@@ -0,0 +1,290 @@
+/**
+ * @file bench_bytearray.cc
+ * @brief ByteArray压测
+ * @details 用法: bench_bytearray [消息数] [消息字节数] [varint个数]
+ *          消息: 每条消息创建一个ByteArray, 写入后读出再销毁(RPC收发的模式)
+ *            legacy: 原来的实现, 每个结点new一个Node和一个内存块, 扩容时从头遍历到尾结点
+ *            no_cache: bytearray.node_cache_bytes=0, 每次扩容一次分配
+ *            cache: 结点释放后进入线程本地的空闲链表, 稳定后没有分配
+ *            reserve: 写之前预留整条消息的容量, 不足的结点一次分配成一个slab
+ *          varint: 编码长度1~10字节混合的数据
+ *            legacy: 原来的实现, 写入临时缓冲区再write, 读取时每个字节调用一次read
+ *            single: writeUint64/readUint64
+ *            bulk: writeVarints/readVarints
+ */
+#include "../sylar/sylar.h"
+#include "../sylar/bytearray.h"
+
+#include <string.h>
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static int s_messages = 100000;
+static size_t s_message_size = 16384;
+static int s_varints = 1000000;
+
+/// 统计operator new的调用次数
+static std::atomic<uint64_t> s_alloc_count = {0};
+
+void* operator new(size_t size) {
+    ++s_alloc_count;
+    void* p = malloc(size ? size : 1);
+    if(!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+static uint64_t NowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+/// 原来的实现, 只保留写和读; 原来在libsylar中, 读写不内联
+class LegacyByteArray {
+public:
+    struct Node {
+        Node(size_t s) : ptr(new char[s]), next(nullptr), size(s) {}
+        ~Node() { delete[] ptr;}
+        char* ptr;
+        Node* next;
+        size_t size;
+    };
+
+    LegacyByteArray(size_t base_size = 4096)
+        : m_baseSize(base_size)
+        , m_capacity(base_size)
+        , m_root(new Node(base_size))
+        , m_cur(m_root) {
+    }
+
+    ~LegacyByteArray() {
+        while(m_root) {
+            Node* tmp = m_root;
+            m_root = m_root->next;
+            delete tmp;
+        }
+    }
+
+    __attribute__((noinline)) void write(const void* buf, size_t size) {
+        addCapacity(size);
+        size_t npos = m_position % m_baseSize;
+        size_t ncap = m_cur->size - npos;
+        size_t bpos = 0;
+        while(size > 0) {
+            size_t len = std::min(ncap, size);
+            memcpy(m_cur->ptr + npos, (const char*)buf + bpos, len);
+            m_position += len;
+            bpos += len;
+            size -= len;
+            if(len == ncap) {
+                m_cur = m_cur->next;
+                ncap = m_baseSize;
+                npos = 0;
+            }
+        }
+        m_size = std::max(m_size, m_position);
+    }
+
+    __attribute__((noinline)) void read(void* buf, size_t size) {
+        if(size > m_size - m_position) {
+            throw std::out_of_range("not enough len");
+        }
+        size_t npos = m_position % m_baseSize;
+        size_t ncap = m_cur->size - npos;
+        size_t bpos = 0;
+        while(size > 0) {
+            size_t len = std::min(ncap, size);
+            memcpy((char*)buf + bpos, m_cur->ptr + npos, len);
+            m_position += len;
+            bpos += len;
+            size -= len;
+            if(len == ncap) {
+                m_cur = m_cur->next;
+                ncap = m_baseSize;
+                npos = 0;
+            }
+        }
+    }
+
+    void setPosition(size_t v) {
+        m_position = v;
+        m_cur = m_root;
+        while(v >= m_cur->size && m_cur->next) {
+            v -= m_cur->size;
+            m_cur = m_cur->next;
+        }
+    }
+
+    void reserve(size_t size) {
+        addCapacity(size);
+    }
+
+    void writeUint64(uint64_t value) {
+        uint8_t tmp[10];
+        uint8_t i = 0;
+        while(value >= 0x80) {
+            tmp[i++] = (value & 0x7F) | 0x80;
+            value >>= 7;
+        }
+        tmp[i++] = value;
+        write(tmp, i);
+    }
+
+    uint64_t readUint64() {
+        uint64_t result = 0;
+        for(int i = 0; i < 64; i += 7) {
+            uint8_t b;
+            read(&b, 1);
+            if(b < 0x80) {
+                result |= ((uint64_t)b) << i;
+                break;
+            } else {
+                result |= (((uint64_t)(b & 0x7f)) << i);
+            }
+        }
+        return result;
+    }
+private:
+    void addCapacity(size_t size) {
+        size_t old_cap = m_capacity - m_position;
+        if(old_cap >= size) {
+            return;
+        }
+        size_t count = (size - old_cap + m_baseSize - 1) / m_baseSize;
+        Node* tmp = m_root;
+        while(tmp->next) {
+            tmp = tmp->next;
+        }
+        Node* first = nullptr;
+        for(size_t i = 0; i < count; ++i) {
+            tmp->next = new Node(m_baseSize);
+            if(!first) {
+                first = tmp->next;
+            }
+            tmp = tmp->next;
+            m_capacity += m_baseSize;
+        }
+        if(old_cap == 0) {
+            m_cur = first;
+        }
+    }
+private:
+    size_t m_baseSize;
+    size_t m_position = 0;
+    size_t m_capacity;
+    size_t m_size = 0;
+    Node* m_root;
+    Node* m_cur;
+};
+
+/// 一条消息: 4字节长度 + 按256字节分段写入的消息体, 再全部读出
+template<class Array>
+static void bench(const char* impl, bool reserve) {
+    std::string payload(s_message_size, 'x');
+    std::string out(s_message_size, 0);
+    uint64_t allocs = s_alloc_count;
+    uint64_t begin = NowNs();
+    for(int i = 0; i < s_messages; ++i) {
+        Array ba;
+        if(reserve) {
+            ba.reserve(sizeof(uint32_t) + s_message_size);
+        }
+        uint32_t len = s_message_size;
+        ba.write(&len, sizeof(len));
+        for(size_t pos = 0; pos < s_message_size; pos += 256) {
+            ba.write(&payload[pos], std::min((size_t)256, s_message_size - pos));
+        }
+        ba.setPosition(0);
+        ba.read(&len, sizeof(len));
+        ba.read(&out[0], len);
+    }
+    uint64_t used = NowNs() - begin;
+    allocs = s_alloc_count - allocs;
+    SYLAR_ASSERT(out == payload);
+    SYLAR_LOG_INFO(g_logger) << impl << (reserve ? " reserve" : "") << " messages=" << s_messages
+        << " size=" << s_message_size << " allocs/msg=" << (double)allocs / s_messages
+        << " " << (double)used / s_messages << " ns/msg";
+}
+
+/// 位数均匀分布, 编码长度1~10字节都有
+static std::vector<uint64_t> VarintValues() {
+    std::vector<uint64_t> values(s_varints);
+    uint64_t seed = 88172645463325252ull;
+    for(auto& i : values) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        i = seed >> (seed % 64);
+    }
+    return values;
+}
+
+static void ReportVarint(const char* impl, const char* op, uint64_t used) {
+    SYLAR_LOG_INFO(g_logger) << "varint " << impl << " " << op << " n=" << s_varints
+        << " " << (double)used / s_varints << " ns/value";
+}
+
+template<class Array>
+static void bench_varint_single(const char* impl) {
+    std::vector<uint64_t> values = VarintValues();
+    Array ba;
+    uint64_t begin = NowNs();
+    for(auto& i : values) {
+        ba.writeUint64(i);
+    }
+    ReportVarint(impl, "write", NowNs() - begin);
+    ba.setPosition(0);
+    begin = NowNs();
+    for(auto& i : values) {
+        SYLAR_ASSERT(ba.readUint64() == i);
+    }
+    ReportVarint(impl, "read", NowNs() - begin);
+}
+
+static void bench_varint_bulk() {
+    std::vector<uint64_t> values = VarintValues();
+    std::vector<uint64_t> out(values.size());
+    sylar::ByteArray ba;
+    uint64_t begin = NowNs();
+    ba.writeVarints(&values[0], values.size());
+    ReportVarint("bulk", "write", NowNs() - begin);
+    ba.setPosition(0);
+    begin = NowNs();
+    ba.readVarints(&out[0], out.size());
+    ReportVarint("bulk", "read", NowNs() - begin);
+    SYLAR_ASSERT(out == values);
+}
+
+int main(int argc, char** argv) {
+    if(argc > 1) {
+        s_messages = atoi(argv[1]);
+    }
+    if(argc > 2) {
+        s_message_size = atoi(argv[2]);
+    }
+    if(argc > 3) {
+        s_varints = atoi(argv[3]);
+    }
+    auto cache = sylar::Config::Lookup<uint64_t>("bytearray.node_cache_bytes");
+    uint64_t cache_bytes = cache->getValue();
+
+    bench<LegacyByteArray>("legacy", false);
+    bench<LegacyByteArray>("legacy", true);
+    cache->setValue(0);
+    bench<sylar::ByteArray>("no_cache", false);
+    bench<sylar::ByteArray>("no_cache", true);
+    cache->setValue(cache_bytes);
+    bench<sylar::ByteArray>("cache", false);
+    bench<sylar::ByteArray>("cache", true);
+
+    bench_varint_single<LegacyByteArray>("legacy");
+    bench_varint_single<sylar::ByteArray>("single");
+    bench_varint_bulk();
+    return 0;
+}
@@ -0,0 +1,175 @@
+/**
+ * @file bench_echo.cc
+ * @brief echo压测: 比较epoll、持久注册的epoll和io_uring三种IOManager, 以及共享栈协程
+ * @details 用法: bench_echo [连接数] [每个连接的请求数] [线程数] [消息长度]
+ *          服务端和客户端在同一个IOManager中, 每个连接一问一答
+ */
+#include "../sylar/sylar.h"
+#include "../sylar/iomanager.h"
+#include "../sylar/hook.h"
+#include "../sylar/fd_manager.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <sys/time.h>
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static int s_conns = 64;
+static int s_requests = 10000;
+static int s_threads = 2;
+static int s_size = 64;
+/// 共享栈模式下切出的协程保存栈内容占用的最大字节数
+static std::atomic<uint64_t> s_max_saved = {0};
+
+static void SampleSaved() {
+    uint64_t saved = sylar::Fiber::GetStackPoolStats().sharedSaved;
+    uint64_t old = s_max_saved;
+    while(saved > old && !s_max_saved.compare_exchange_weak(old, saved)) {
+    }
+}
+
+static uint64_t NowUs() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000ul + tv.tv_usec;
+}
+
+static bool ReadFull(int fd, char* buf, size_t len) {
+    size_t offset = 0;
+    while(offset < len) {
+        ssize_t n = read(fd, buf + offset, len - offset);
+        if(n <= 0) {
+            return false;
+        }
+        offset += n;
+    }
+    return true;
+}
+
+static void OnClient(int fd) {
+    std::vector<char> buf(s_size);
+    while(true) {
+        ssize_t n = read(fd, &buf[0], buf.size());
+        if(n <= 0 || write(fd, &buf[0], n) != n) {
+            break;
+        }
+    }
+    close(fd);
+}
+
+static void OnAccept(int listen_fd) {
+    for(int i = 0; i < s_conns; ++i) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if(fd < 0) {
+            SYLAR_LOG_ERROR(g_logger) << "accept errno=" << errno;
+            break;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        sylar::IOManager::GetThis()->schedule(std::bind(&OnClient, fd));
+    }
+    close(listen_fd);
+}
+
+static void OnRequest(const sockaddr_in& addr, std::atomic<int>* done) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(connect(fd, (const sockaddr*)&addr, sizeof(addr))) {
+        SYLAR_LOG_ERROR(g_logger) << "connect errno=" << errno;
+        close(fd);
+        return;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    std::vector<char> msg(s_size, 'x');
+    std::vector<char> buf(s_size);
+    for(int i = 0; i < s_requests; ++i) {
+        if(write(fd, &msg[0], msg.size()) != (ssize_t)msg.size()
+                || !ReadFull(fd, &buf[0], buf.size())) {
+            SYLAR_LOG_ERROR(g_logger) << "echo errno=" << errno;
+            break;
+        }
+        ++*done;
+        if(i % 1000 == 0) {
+            SampleSaved();
+        }
+    }
+    close(fd);
+}
+
+static void run(bool uring, bool persistent = false, bool shared = false) {
+    sylar::Config::Lookup<bool>("iomanager.io_uring")->setValue(uring);
+    sylar::Config::Lookup<bool>("iomanager.persistent_epoll")->setValue(persistent);
+    sylar::Config::Lookup<bool>("scheduler.shared_stack")->setValue(shared);
+    s_max_saved = 0;
+    std::atomic<int> done = {0};
+    uint64_t begin = 0;
+    bool used_uring = false;
+    bool used_shared = false;
+    uint64_t ctl_count = 0;
+    {
+        sylar::IOManager iom(s_threads, false, uring ? "uring" : "epoll");
+        used_uring = iom.isUring();
+        used_shared = iom.isSharedStack();
+
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int listen_fd = socket_f(AF_INET, SOCK_STREAM, 0);
+        socklen_t len = sizeof(addr);
+        if(bind(listen_fd, (sockaddr*)&addr, len) || listen(listen_fd, 1024)
+                || getsockname(listen_fd, (sockaddr*)&addr, &len)) {
+            SYLAR_LOG_ERROR(g_logger) << "listen errno=" << errno;
+            return;
+        }
+        // 登记后accept才会走hook
+        sylar::FdMgr::GetInstance()->get(listen_fd, true);
+
+        begin = NowUs();
+        iom.schedule(std::bind(&OnAccept, listen_fd));
+        for(int i = 0; i < s_conns; ++i) {
+            iom.schedule(std::bind(&OnRequest, addr, &done));
+        }
+        iom.stop();
+        ctl_count = iom.getEpollCtlCount();
+    }
+    uint64_t used = NowUs() - begin;
+    SYLAR_LOG_INFO(g_logger) << (used_uring ? "io_uring" : "epoll")
+        << (uring && !used_uring ? "(fallback)" : "")
+        << (persistent ? "(persistent)" : "")
+        << (used_shared ? "(shared stack)" : "")
+        << " conns=" << s_conns << " requests=" << done
+        << " used=" << used / 1000 << "ms qps=" << (uint64_t)(done * 1000000.0 / used)
+        << " epoll_ctl=" << ctl_count;
+    if(used_shared) {
+        // 切出的协程实际占用的栈内存, 私有栈模式下每个协程是fiber.stack_size
+        SYLAR_LOG_INFO(g_logger) << "shared stack saved bytes max=" << s_max_saved
+            << " per conn=" << s_max_saved / (s_conns * 2);
+    }
+}
+
+int main(int argc, char** argv) {
+    if(argc > 1) {
+        s_conns = atoi(argv[1]);
+    }
+    if(argc > 2) {
+        s_requests = atoi(argv[2]);
+    }
+    if(argc > 3) {
+        s_threads = atoi(argv[3]);
+    }
+    if(argc > 4) {
+        s_size = atoi(argv[4]);
+    }
+    // 只输出压测结果
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    run(false);
+    run(false, true);
+    run(true);
+    run(false, true, true);
+    return 0;
+}
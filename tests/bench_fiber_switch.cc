@@ -0,0 +1,112 @@
+/**
+ * @file bench_fiber_switch.cc
+ * @brief 协程切换耗时: ucontext和汇编实现对比
+ * @details 用法: bench_fiber_switch [往返次数]
+ *          分别测试裸的swapcontext、sylar_jump_fcontext, 以及Fiber::call/back(使用编译时选择的实现)
+ */
+#include "../sylar/sylar.h"
+#include "../sylar/fcontext.h"
+
+#include <ucontext.h>
+#include <sys/time.h>
+#include <vector>
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static const size_t STACK_SIZE = 128 * 1024;
+static int s_rounds = 1000000;
+
+static uint64_t NowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+static void Report(const char* name, uint64_t used) {
+    // 一次往返是两次切换
+    SYLAR_LOG_INFO(g_logger) << name << " rounds=" << s_rounds
+        << " used=" << used / 1000000 << "ms "
+        << (double)used / s_rounds / 2 << " ns/switch";
+}
+
+static ucontext_t s_uc_main;
+static ucontext_t s_uc_fiber;
+
+static void UcontextFunc() {
+    while(true) {
+        swapcontext(&s_uc_fiber, &s_uc_main);
+    }
+}
+
+static void bench_ucontext() {
+    std::vector<char> stack(STACK_SIZE);
+    getcontext(&s_uc_fiber);
+    s_uc_fiber.uc_link = nullptr;
+    s_uc_fiber.uc_stack.ss_sp = &stack[0];
+    s_uc_fiber.uc_stack.ss_size = stack.size();
+    makecontext(&s_uc_fiber, &UcontextFunc, 0);
+
+    uint64_t begin = NowNs();
+    for(int i = 0; i < s_rounds; ++i) {
+        swapcontext(&s_uc_main, &s_uc_fiber);
+    }
+    Report("ucontext", NowNs() - begin);
+}
+
+#ifdef SYLAR_HAVE_FCONTEXT
+static sylar::fcontext_t s_fc_main = nullptr;
+static sylar::fcontext_t s_fc_fiber = nullptr;
+
+static void FcontextFunc() {
+    while(true) {
+        sylar::sylar_jump_fcontext(&s_fc_fiber, s_fc_main);
+    }
+}
+
+static void bench_fcontext() {
+    std::vector<char> stack(STACK_SIZE);
+    s_fc_fiber = sylar::make_fcontext(&stack[0], stack.size(), &FcontextFunc);
+
+    uint64_t begin = NowNs();
+    for(int i = 0; i < s_rounds; ++i) {
+        sylar::sylar_jump_fcontext(&s_fc_main, s_fc_fiber);
+    }
+    Report("fcontext", NowNs() - begin);
+}
+#endif
+
+static void bench_fiber() {
+    sylar::Fiber::GetThis();    // 创建线程的主协程
+    sylar::Fiber* raw = nullptr;
+    sylar::Fiber::ptr fiber(new sylar::Fiber([&raw](){
+        for(int i = 0; i < s_rounds; ++i) {
+            raw->back();
+        }
+    }, STACK_SIZE, true));
+    raw = fiber.get();
+
+    uint64_t begin = NowNs();
+    for(int i = 0; i < s_rounds; ++i) {
+        fiber->call();
+    }
+    uint64_t used = NowNs() - begin;
+    fiber->call();  // 让协程执行结束
+#ifdef SYLAR_FIBER_USE_FCONTEXT
+    Report("Fiber(fcontext)", used);
+#else
+    Report("Fiber(ucontext)", used);
+#endif
+}
+
+int main(int argc, char** argv) {
+    if(argc > 1) {
+        s_rounds = atoi(argv[1]);
+    }
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    bench_ucontext();
+#ifdef SYLAR_HAVE_FCONTEXT
+    bench_fcontext();
+#endif
+    bench_fiber();
+    return 0;
+}
@@ -0,0 +1,163 @@
+/**
+ * @file bench_timer.cc
+ * @brief 定时器压测: 4叉堆、时间轮和原来基于std::set的实现对比
+ * @details 用法: bench_timer [操作次数] [同时存在的定时器数]
+ *          add_cancel: 模拟带超时的hook读写, 每次添加一个定时器并取消最早的一个, 几乎都不会触发
+ *          add_expire: 添加后全部到期, 测试插入和取出堆顶
+ */
+#include "../sylar/sylar.h"
+#include "../sylar/timer.h"
+
+#include <set>
+#include <deque>
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static int s_ops = 1000000;
+static int s_outstanding = 10000;
+
+static uint64_t NowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+/// 原来的实现: 每个定时器一个红黑树结点, 取消时加写锁从树中删除
+class SetTimerManager {
+public:
+    struct Timer : public std::enable_shared_from_this<Timer> {
+        typedef std::shared_ptr<Timer> ptr;
+        uint64_t next = 0;
+        std::function<void()> cb;
+        SetTimerManager* manager = nullptr;
+
+        bool cancel() {
+            sylar::RWMutex::WriteLock lock(manager->m_mutex);
+            if(cb) {
+                cb = nullptr;
+                auto it = manager->m_timers.find(shared_from_this());
+                manager->m_timers.erase(it);
+                return true;
+            }
+            return false;
+        }
+    };
+
+    struct Comparator {
+        bool operator()(const Timer::ptr& lhs, const Timer::ptr& rhs) const {
+            if(lhs->next != rhs->next) {
+                return lhs->next < rhs->next;
+            }
+            return lhs.get() < rhs.get();
+        }
+    };
+
+    Timer::ptr addTimer(uint64_t ms, std::function<void()> cb) {
+        Timer::ptr timer(new Timer);
+        timer->next = sylar::GetCurrentMS() + ms;
+        timer->cb = cb;
+        timer->manager = this;
+        sylar::RWMutex::WriteLock lock(m_mutex);
+        m_timers.insert(timer);
+        return timer;
+    }
+
+    void listExpiredCb(std::vector<std::function<void()> >& cbs) {
+        uint64_t now_ms = sylar::GetCurrentMS();
+        sylar::RWMutex::WriteLock lock(m_mutex);
+        Timer::ptr now_timer(new Timer);
+        now_timer->next = now_ms;
+        auto it = m_timers.lower_bound(now_timer);
+        while(it != m_timers.end() && (*it)->next == now_ms) {
+            ++it;
+        }
+        for(auto i = m_timers.begin(); i != it; ++i) {
+            cbs.push_back((*i)->cb);
+            (*i)->cb = nullptr;
+        }
+        m_timers.erase(m_timers.begin(), it);
+    }
+private:
+    sylar::RWMutex m_mutex;
+    std::set<Timer::ptr, Comparator> m_timers;
+};
+
+/// 4叉堆实现, 不需要唤醒
+class HeapTimerManager : public sylar::TimerManager {
+protected:
+    void onTimerInsertedAtFront() override {}
+};
+
+/// 时间轮实现, 所有定时器都是粗粒度的
+class WheelTimerManager : public HeapTimerManager {
+public:
+    sylar::Timer::ptr addTimer(uint64_t ms, std::function<void()> cb) {
+        return TimerManager::addTimer(ms, cb, false, COARSE);
+    }
+};
+
+static void Report(const char* name, const char* impl, uint64_t used, int ops) {
+    SYLAR_LOG_INFO(g_logger) << name << " " << impl << " ops=" << ops
+        << " used=" << used / 1000000 << "ms " << (double)used / ops << " ns/op";
+}
+
+template<class Manager>
+static void bench_add_cancel(const char* impl) {
+    Manager manager;
+    std::deque<decltype(manager.addTimer(0, nullptr))> timers;
+    std::vector<std::function<void()> > cbs;
+    int fired = 0;
+    uint64_t begin = NowNs();
+    for(int i = 0; i < s_ops; ++i) {
+        // 超时时间都很长, 连接通常在超时前就有数据了
+        timers.push_back(manager.addTimer(5000 + i % 1000, [&fired](){ ++fired; }));
+        if((int)timers.size() > s_outstanding) {
+            timers.front()->cancel();
+            timers.pop_front();
+        }
+        if(i % 1000 == 0) {
+            manager.listExpiredCb(cbs);
+            cbs.clear();
+        }
+    }
+    for(auto& i : timers) {
+        i->cancel();
+    }
+    Report("add_cancel", impl, NowNs() - begin, s_ops);
+}
+
+template<class Manager>
+static void bench_add_expire(const char* impl) {
+    Manager manager;
+    std::vector<std::function<void()> > cbs;
+    cbs.reserve(s_ops);
+    int fired = 0;
+    uint64_t begin = NowNs();
+    for(int i = 0; i < s_ops; ++i) {
+        manager.addTimer(i % 10, [&fired](){ ++fired; });
+    }
+    uint64_t add_used = NowNs() - begin;
+    usleep(20 * 1000);
+    begin = NowNs();
+    manager.listExpiredCb(cbs);
+    uint64_t expire_used = NowNs() - begin;
+    SYLAR_ASSERT((int)cbs.size() == s_ops);
+    Report("add", impl, add_used, s_ops);
+    Report("expire", impl, expire_used, s_ops);
+}
+
+int main(int argc, char** argv) {
+    if(argc > 1) {
+        s_ops = atoi(argv[1]);
+    }
+    if(argc > 2) {
+        s_outstanding = atoi(argv[2]);
+    }
+    bench_add_cancel<SetTimerManager>("set");
+    bench_add_cancel<HeapTimerManager>("heap");
+    bench_add_cancel<WheelTimerManager>("wheel");
+    bench_add_expire<SetTimerManager>("set");
+    bench_add_expire<HeapTimerManager>("heap");
+    bench_add_expire<WheelTimerManager>("wheel");
+    return 0;
+}
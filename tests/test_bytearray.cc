@@ -1,6 +1,9 @@
 #include "../sylar/bytearray.h"
 #include "../sylar/sylar.h"
 
+#include <algorithm>
+#include <malloc.h>
+
 static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
 
 void test() {
@@ -93,8 +96,301 @@ void test_file() {
     
 }
 
+/// 结点回到空闲链表后再次使用, reserve和跨线程释放
+void test_node_cache() {
+    std::string data;
+    for(int i = 0; i < 1000; ++i) {
+        data.push_back((char)rand());
+    }
+    sylar::ByteArray::ptr ba(new sylar::ByteArray(16));
+    for(int round = 0; round < 3; ++round) {
+        if(round == 1) {
+            ba->reserve(data.size());
+        }
+        ba->write(data.c_str(), data.size());
+        ba->writeStringVint(data);
+        ba->setPosition(0);
+        std::string tmp(data.size(), 0);
+        ba->read(&tmp[0], tmp.size());
+        SYLAR_ASSERT(tmp == data);
+        SYLAR_ASSERT(ba->readStringVint() == data);
+        SYLAR_ASSERT(ba->getReadSize() == 0);
+        ba->clear();
+        std::reverse(data.begin(), data.end());
+    }
+
+    // 一个线程写, 另一个线程读完释放, 线程退出时归还缓存的结点
+    std::vector<sylar::ByteArray::ptr> arrays;
+    sylar::Thread::ptr writer(new sylar::Thread([&arrays, &data](){
+        for(int i = 0; i < 10; ++i) {
+            sylar::ByteArray::ptr ba(new sylar::ByteArray(64));
+            ba->writeStringF32(data);
+            ba->setPosition(0);
+            arrays.push_back(ba);
+            sylar::ByteArray tmp(64);
+            tmp.write(data.c_str(), data.size());
+        }
+    }, "writer"));
+    writer->join();
+    sylar::Thread::ptr reader(new sylar::Thread([&arrays, &data](){
+        for(auto& i : arrays) {
+            SYLAR_ASSERT(i->readStringF32() == data);
+        }
+        arrays.clear();
+    }, "reader"));
+    reader->join();
+
+    // reserve的一大块slab中的结点不进入缓存, 全部释放后slab立即回收
+    struct mallinfo2 before = mallinfo2();
+    {
+        sylar::ByteArray big(4096);
+        big.reserve(16 * 1024 * 1024);
+    }
+    struct mallinfo2 after = mallinfo2();
+    SYLAR_ASSERT(after.uordblks + after.hblkhd < before.uordblks + before.hblkhd + 1024 * 1024);
+    SYLAR_LOG_INFO(g_logger) << "node cache ok";
+}
+
+/// 切片不复制数据, 拼接到另一个ByteArray中转发, 来源释放后仍然有效
+void test_slice() {
+    std::string header = "HEADER";
+    std::string body;
+    for(int i = 0; i < 300; ++i) {
+        body.push_back('a' + rand() % 26);
+    }
+    sylar::ByteArray::ptr in(new sylar::ByteArray(64));
+    in->writeStringF16(header);
+    in->write(body.c_str(), body.size());
+    in->setPosition(0);
+    SYLAR_ASSERT(in->readStringF16() == header);
+    sylar::ByteArray::Slice slice = in->readSlice(body.size());
+    SYLAR_ASSERT(in->getReadSize() == 0);
+    SYLAR_ASSERT(slice.size() == body.size() && slice.toString() == body);
+
+    // 切片引用的就是in的内存
+    std::vector<iovec> src;
+    std::vector<iovec> dst;
+    in->setPosition(header.size() + 2);
+    in->getReadBuffers(src, body.size());
+    slice.getReadBuffers(dst);
+    SYLAR_ASSERT(src.size() == dst.size());
+    for(size_t i = 0; i < src.size(); ++i) {
+        SYLAR_ASSERT(src[i].iov_base == dst[i].iov_base && src[i].iov_len == dst[i].iov_len);
+    }
+
+    sylar::ByteArray::ptr out(new sylar::ByteArray(64));
+    out->writeFuint32(body.size());
+    out->writeSlice(slice);
+    out->writeStringF16("trailer");
+    in.reset();
+    slice.clear();
+
+    out->setPosition(0);
+    SYLAR_ASSERT((uint32_t)out->readFuint32() == body.size());
+    std::string tmp(body.size(), 0);
+    out->read(&tmp[0], tmp.size());
+    SYLAR_ASSERT(tmp == body);
+    SYLAR_ASSERT(out->readStringF16() == "trailer");
+    SYLAR_ASSERT(out->readSlice(100, 4 + 10).toString() == body.substr(10, 100));
+
+    // 通过sendmsg转发
+    int fds[2];
+    SYLAR_ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    out->setPosition(0);
+    std::vector<iovec> iovs;
+    out->getReadBuffers(iovs);
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iovs[0];
+    msg.msg_iovlen = iovs.size();
+    SYLAR_ASSERT(sendmsg(fds[0], &msg, 0) == (ssize_t)out->getSize());
+    sylar::ByteArray::ptr upstream(new sylar::ByteArray(128));
+    iovs.clear();
+    upstream->getWriteBuffers(iovs, out->getSize());
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iovs[0];
+    msg.msg_iovlen = iovs.size();
+    SYLAR_ASSERT(recvmsg(fds[1], &msg, MSG_WAITALL) == (ssize_t)out->getSize());
+    upstream->setPosition(out->getSize());     // 更新数据长度
+    upstream->setPosition(0);
+    SYLAR_ASSERT(upstream->toString() == out->toString());
+    close(fds[0]);
+    close(fds[1]);
+
+    // 在中间拼接, 之后的数据被丢弃
+    sylar::ByteArray::Slice part = out->readSlice(10, 4);
+    out->setPosition(4 + 100);
+    out->writeSlice(part);
+    SYLAR_ASSERT(out->getSize() == 4 + 100 + 10);
+    out->setPosition(4 + 100);
+    SYLAR_ASSERT(out->readSlice(10).toString() == body.substr(0, 10));
+
+    // 清空后起始结点是切片结点, 换一个新的再写
+    sylar::ByteArray::ptr only(new sylar::ByteArray(64));
+    only->writeSlice(part);
+    only->clear();
+    only->writeStringF16(header);
+    only->setPosition(0);
+    SYLAR_ASSERT(only->readStringF16() == header);
+    SYLAR_ASSERT(part.toString() == body.substr(0, 10));
+    SYLAR_LOG_INFO(g_logger) << "slice ok";
+}
+
+/// 原来逐字节的编码, 用来核对结果
+static std::string RefVarint(uint64_t v) {
+    std::string str;
+    while(v >= 0x80) {
+        str.push_back((char)((v & 0x7f) | 0x80));
+        v >>= 7;
+    }
+    str.push_back((char)v);
+    return str;
+}
+
+/// 快速编解码和原来的结果逐字节一致, 跨结点、批量和数据不足的情况
+void test_varint() {
+    std::vector<uint64_t> values;
+    for(int bits = 0; bits <= 64; ++bits) {
+        uint64_t max = bits == 64 ? ~0ull : (1ull << bits) - 1;
+        values.push_back(max);
+        values.push_back(max & (((uint64_t)rand() << 32) | rand()));
+    }
+    std::string ref;
+    for(auto& i : values) {
+        ref += RefVarint(i);
+    }
+
+    size_t base_sizes[] = {1, 7, 16, 4096};
+    for(auto base_size : base_sizes) {
+        sylar::ByteArray::ptr ba(new sylar::ByteArray(base_size));
+        for(auto& i : values) {
+            ba->writeUint64(i);
+        }
+        ba->writeVarints(&values[0], values.size());
+        ba->setPosition(0);
+        SYLAR_ASSERT(ba->toString() == ref + ref);
+
+        std::vector<uint64_t> out(values.size());
+        for(size_t i = 0; i < values.size(); ++i) {
+            SYLAR_ASSERT(ba->readUint64() == values[i]);
+        }
+        ba->readVarints(&out[0], out.size());
+        SYLAR_ASSERT(out == values);
+        SYLAR_ASSERT(ba->getReadSize() == 0);
+
+        // zigzag和32位
+        ba->clear();
+        int64_t signed_values[] = {0, -1, 1, -64, 64, INT32_MIN, INT32_MAX, INT64_MIN, INT64_MAX};
+        for(auto i : signed_values) {
+            ba->writeInt64(i);
+            ba->writeInt32((int32_t)i);
+            ba->writeUint32((uint32_t)i);
+        }
+        ba->setPosition(0);
+        for(auto i : signed_values) {
+            SYLAR_ASSERT(ba->readInt64() == i);
+            SYLAR_ASSERT(ba->readInt32() == (int32_t)i);
+            SYLAR_ASSERT(ba->readUint32() == (uint32_t)i);
+        }
+
+        // 数据不足
+        ba->clear();
+        ba->writeVarints(&values[0], 10);
+        ba->writeFuint8(0x80);
+        ba->setPosition(0);
+        bool thrown = false;
+        try {
+            ba->readVarints(&out[0], 11);
+        } catch(std::out_of_range&) {
+            thrown = true;
+        }
+        SYLAR_ASSERT(thrown);
+        SYLAR_ASSERT(std::equal(values.begin(), values.begin() + 10, out.begin()));
+
+        // 原地改写不会覆盖后面的数据
+        ba->clear();
+        ba->writeStringWithoutLength("0123456789abcdef");
+        ba->setPosition(0);
+        ba->writeUint64(1);
+        ba->setPosition(0);
+        SYLAR_ASSERT(ba->toString() == std::string("\x01") + "123456789abcdef");
+    }
+    SYLAR_LOG_INFO(g_logger) << "varint ok";
+}
+
+/// mmap文件不复制数据, 原地改写不影响文件; 写文件时结点数超过IOV_MAX
+void test_mmap() {
+    const char* path = "/tmp/sylar_test_bytearray_mmap.dat";
+    std::string data;
+    for(int i = 0; i < 3000; ++i) {
+        data.push_back(rand());
+    }
+    sylar::ByteArray::ptr src(new sylar::ByteArray(1));
+    src->write(data.c_str(), data.size());
+    src->setPosition(0);
+    SYLAR_ASSERT(src->writeToFile(path));
+    sylar::ByteArray::ptr copy(new sylar::ByteArray(4096));
+    SYLAR_ASSERT(copy->readFromFile(path));
+    copy->setPosition(0);
+    SYLAR_ASSERT(copy->toString() == data);
+
+    sylar::ByteArray::ptr ba(new sylar::ByteArray(64));
+    ba->writeFuint32(data.size());
+    SYLAR_ASSERT(ba->readFromFile(path, true));
+    SYLAR_ASSERT(ba->getPosition() == 4 + data.size() && ba->getSize() == 4 + data.size());
+    // 整个文件是一个结点
+    std::vector<iovec> iovs;
+    ba->setPosition(0);
+    ba->getReadBuffers(iovs);
+    SYLAR_ASSERT(iovs.size() == 2 && iovs[1].iov_len == data.size());
+    SYLAR_ASSERT((uint32_t)ba->readFuint32() == data.size());
+    std::string tmp(data.size(), 0);
+    ba->read(&tmp[0], tmp.size());
+    SYLAR_ASSERT(tmp == data);
+
+    // 之后的写入追加在映射后面
+    ba->writeStringF16("tail");
+    ba->setPosition(4 + data.size());
+    SYLAR_ASSERT(ba->readStringF16() == "tail");
+
+    // 原地改写只改内存中的副本
+    sylar::ByteArray::Slice slice = ba->readSlice(100, 4 + 10);
+    ba->setPosition(4 + 10);
+    ba->writeStringWithoutLength("XXXX");
+    SYLAR_ASSERT(slice.toString() == "XXXX" + data.substr(14, 96));
+    copy->clear();
+    SYLAR_ASSERT(copy->readFromFile(path));
+    copy->setPosition(0);
+    SYLAR_ASSERT(copy->toString() == data);
+
+    // 切片在ByteArray释放后仍然引用映射
+    ba.reset();
+    SYLAR_ASSERT(slice.toString() == "XXXX" + data.substr(14, 96));
+    slice.clear();
+
+    // 空文件和不存在的文件
+    SYLAR_ASSERT(truncate(path, 0) == 0);
+    sylar::ByteArray::ptr empty(new sylar::ByteArray(64));
+    SYLAR_ASSERT(empty->readFromFile(path, true));
+    SYLAR_ASSERT(empty->getSize() == 0);
+    unlink(path);
+    SYLAR_ASSERT(!empty->readFromFile(path, true));
+
+    // /proc中的文件大小为0, 复制读出实际内容
+    sylar::ByteArray::ptr proc(new sylar::ByteArray(64));
+    SYLAR_ASSERT(proc->readFromFile("/proc/self/status", true));
+    SYLAR_ASSERT(proc->getSize() > 0);
+    proc->setPosition(0);
+    SYLAR_ASSERT(proc->toString().find("Name:") == 0);
+    SYLAR_LOG_INFO(g_logger) << "mmap ok";
+}
+
 int main() {
     // test();
     test_file();
+    test_node_cache();
+    test_slice();
+    test_varint();
+    test_mmap();
     return 0;
 }
\ No newline at end of file
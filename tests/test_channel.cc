@@ -0,0 +1,163 @@
+#include "../sylar/sylar.h"
+#include "../sylar/iomanager.h"
+#include "../sylar/channel.h"
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+/// parse -> process -> serialize 三级流水线, 每级一个协程, 通道容量很小, 依靠反压同步
+void test_pipeline() {
+    const int items = 20000;
+    static sylar::Channel<int> s_raw(4);
+    static sylar::Channel<int64_t> s_processed(4);
+    static sylar::Channel<std::string> s_out(4);
+    static int64_t s_sum = 0;
+    static int s_count = 0;
+    static bool s_ordered = true;
+    {
+        sylar::IOManager iom(2, false, "pipeline");
+        iom.schedule([items](){
+            for(int i = 0; i < items; ++i) {
+                SYLAR_ASSERT(s_raw.send(i));
+            }
+            s_raw.close();
+        });
+        iom.schedule([](){
+            int v = 0;
+            while(s_raw.recv(v)) {
+                SYLAR_ASSERT(s_processed.send((int64_t)v * 2));
+            }
+            s_processed.close();
+        });
+        iom.schedule([](){
+            int64_t v = 0;
+            while(s_processed.recv(v)) {
+                SYLAR_ASSERT(s_out.send(std::to_string(v)));
+            }
+            s_out.close();
+        });
+        iom.schedule([](){
+            std::string v;
+            while(s_out.recv(v)) {
+                int64_t n = std::stoll(v);
+                if(n != (int64_t)s_count * 2) {
+                    s_ordered = false;
+                }
+                s_sum += n;
+                ++s_count;
+                SYLAR_ASSERT(s_out.size() <= s_out.capacity());
+            }
+        });
+    }
+    SYLAR_LOG_INFO(g_logger) << "pipeline count=" << s_count << " sum=" << s_sum
+        << " ordered=" << s_ordered;
+    SYLAR_ASSERT(s_count == items);
+    SYLAR_ASSERT(s_sum == (int64_t)items * (items - 1));
+    SYLAR_ASSERT(s_ordered);
+}
+
+/// 多生产者多消费者
+void test_mpmc() {
+    const int producers = 4;
+    const int consumers = 3;
+    const int items = 5000;
+    static sylar::Channel<int> s_chan(8);
+    static std::atomic<int64_t> s_sum = {0};
+    static std::atomic<int> s_producing = {producers};
+    {
+        sylar::IOManager iom(3, false, "mpmc");
+        for(int i = 0; i < consumers; ++i) {
+            iom.schedule([](){
+                int v = 0;
+                while(s_chan.recv(v)) {
+                    s_sum += v;
+                }
+            });
+        }
+        for(int i = 0; i < producers; ++i) {
+            iom.schedule([items](){
+                for(int j = 1; j <= items; ++j) {
+                    SYLAR_ASSERT(s_chan.send(j));
+                }
+                if(--s_producing == 0) {
+                    s_chan.close();
+                }
+            });
+        }
+    }
+    SYLAR_LOG_INFO(g_logger) << "mpmc sum=" << s_sum;
+    SYLAR_ASSERT(s_sum == (int64_t)producers * items * (items + 1) / 2);
+    SYLAR_ASSERT(!s_chan.send(1));
+}
+
+/// 超时、tryRecv/trySend和关闭
+void test_timeout() {
+    static sylar::Channel<int> s_chan(1);
+    {
+        sylar::IOManager iom(1, false, "timeout");
+        iom.schedule([](){
+            int v = 0;
+            SYLAR_ASSERT(!s_chan.tryRecv(v));
+            uint64_t begin = sylar::GetMonotonicMS();
+            SYLAR_ASSERT(!s_chan.recv(v, 20));
+            SYLAR_ASSERT(sylar::GetMonotonicMS() - begin >= 20);
+
+            SYLAR_ASSERT(s_chan.trySend(1));
+            SYLAR_ASSERT(!s_chan.trySend(2));
+            begin = sylar::GetMonotonicMS();
+            SYLAR_ASSERT(!s_chan.send(2, 20));
+            SYLAR_ASSERT(sylar::GetMonotonicMS() - begin >= 20);
+
+            // 等待期间被另一个协程唤醒
+            sylar::IOManager::GetThis()->addTimer(10, [](){
+                int v = 0;
+                SYLAR_ASSERT(s_chan.tryRecv(v) && v == 1);
+            });
+            SYLAR_ASSERT(s_chan.send(3, 1000));
+            SYLAR_ASSERT(s_chan.recv(v, 0) && v == 3);
+
+            // 关闭唤醒等待的接收方
+            sylar::IOManager::GetThis()->addTimer(10, [](){
+                s_chan.close();
+            });
+            SYLAR_ASSERT(!s_chan.recv(v, 1000));
+            SYLAR_ASSERT(s_chan.isClosed());
+        });
+    }
+    SYLAR_LOG_INFO(g_logger) << "timeout ok";
+}
+
+/// 发送和超时同时发生, 等待者返回后立即释放通道; 超时回调不能再访问通道
+void test_timeout_destroy() {
+    static std::atomic<int> s_received = {0};
+    static std::atomic<int> s_timeout = {0};
+    {
+        sylar::IOManager iom(2, false, "timeout_destroy");
+        iom.schedule([](){
+            for(int i = 0; i < 500; ++i) {
+                std::shared_ptr<sylar::Channel<int> > chan(new sylar::Channel<int>(1));
+                // 发送在超时之前、同时或者之后
+                sylar::IOManager::GetThis()->addTimerUs(500 + i % 3 * 500, [chan](){
+                    chan->trySend(1);
+                });
+                int v = 0;
+                if(chan->recv(v, 1)) {
+                    ++s_received;
+                } else {
+                    ++s_timeout;
+                }
+            }
+        });
+    }
+    SYLAR_LOG_INFO(g_logger) << "timeout destroy received=" << s_received
+        << " timeout=" << s_timeout;
+    SYLAR_ASSERT(s_received + s_timeout == 500);
+}
+
+int main(int argc, char** argv) {
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    test_pipeline();
+    test_mpmc();
+    test_timeout();
+    test_timeout_destroy();
+    return 0;
+}
@@ -1,4 +1,7 @@
 #include "../sylar/sylar.h"
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
 
 sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
 
@@ -25,9 +28,62 @@ void test_fiber() {
     SYLAR_LOG_INFO(g_logger) << "main after end2";
 }
 
+void test_stack_pool() {
+    // 结束的协程的栈放回线程的栈池, 之后创建的协程直接复用
+    sylar::Fiber::StackPoolStats before = sylar::Fiber::GetStackPoolStats();
+    {
+        sylar::Scheduler sc(2, false, "pool");
+        sc.start();
+        for(int i = 0; i < 1000; ++i) {
+            sc.schedule([](){
+                sylar::Fiber::ptr fiber(new sylar::Fiber([](){}));
+                sylar::Scheduler::GetThis()->schedule(fiber, sylar::GetThreadId());
+            });
+        }
+        sc.stop();
+    }
+    sylar::Fiber::StackPoolStats after = sylar::Fiber::GetStackPoolStats();
+    SYLAR_LOG_INFO(g_logger) << "stack pool hits=" << after.hits - before.hits
+        << " misses=" << after.misses - before.misses
+        << " bytes=" << after.bytes << " high_water=" << after.highWater;
+    SYLAR_ASSERT(after.hits - before.hits >= 900);
+}
+
+static int recurse(int depth) {
+    volatile char buf[1024];
+    buf[0] = depth;
+    if(depth == 0) {
+        return 0;
+    }
+    return recurse(depth - 1) + buf[0];
+}
+
+void test_stack_guard() {
+    // 栈溢出碰到保护页, 子进程应当被SIGSEGV终止
+    pid_t pid = fork();
+    if(pid == 0) {
+        sylar::Scheduler sc(1, false, "guard");
+        sc.start();
+        sc.schedule(sylar::Fiber::ptr(new sylar::Fiber([](){
+            recurse(1 << 20);
+        }, 64 * 1024)));
+        sc.stop();
+        _exit(0);
+    }
+    int status = 0;
+    SYLAR_ASSERT(waitpid(pid, &status, 0) == pid);
+    SYLAR_LOG_INFO(g_logger) << "stack guard signaled=" << WIFSIGNALED(status)
+        << " sig=" << (WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+    SYLAR_ASSERT(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+}
 
 int main() {
     sylar::Thread::SetName("main"); // 设置线程名称
+    // 在分配第一个栈之前打开, 之后的栈都带保护页
+    sylar::Config::Lookup<bool>("fiber.stack_mmap")->setValue(true);
+    sylar::Config::Lookup<bool>("fiber.stack_madvise")->setValue(true);
+    test_stack_pool();
+    test_stack_guard();
 
     std::vector<sylar::Thread::ptr> thrs;
     for(int i = 0; i < 3; ++i) {
@@ -0,0 +1,208 @@
+#include "../sylar/sylar.h"
+#include "../sylar/iomanager.h"
+#include "../sylar/fiber_mutex.h"
+
+#include <deque>
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+/// 多个线程上的协程竞争同一把锁, 持锁期间让出
+void test_mutex() {
+    static sylar::FiberMutex s_mutex;
+    static int s_count = 0;
+    static std::atomic<int> s_inside = {0};
+    const int fibers = 20;
+    const int rounds = 1000;
+    s_count = 0;
+    {
+        sylar::IOManager iom(3, false, "mutex");
+        for(int i = 0; i < fibers; ++i) {
+            iom.schedule([rounds](){
+                for(int j = 0; j < rounds; ++j) {
+                    sylar::FiberMutex::Lock lock(s_mutex);
+                    SYLAR_ASSERT(++s_inside == 1);
+                    int count = s_count;
+                    if(j % 100 == 0) {
+                        sylar::Fiber::YieldToReady();
+                    }
+                    s_count = count + 1;
+                    --s_inside;
+                }
+            });
+        }
+    }
+    SYLAR_LOG_INFO(g_logger) << "mutex count=" << s_count;
+    SYLAR_ASSERT(s_count == fibers * rounds);
+    SYLAR_ASSERT(s_mutex.tryLock());
+    SYLAR_ASSERT(!s_mutex.tryLock());
+    s_mutex.unlock();
+}
+
+/// 等锁的协程不会阻塞同一线程上的其他协程
+void test_not_blocking() {
+    static sylar::FiberMutex s_mutex;
+    static std::atomic<int> s_ticks = {0};
+    static std::atomic<int> s_ticks_when_locked = {-1};
+    {
+        sylar::IOManager iom(1, false, "not_blocking");
+        iom.schedule([](){
+            sylar::FiberMutex::Lock lock(s_mutex);
+            usleep(50 * 1000);      // 持锁睡眠, 线程可以执行其他协程
+        });
+        iom.schedule([](){
+            sylar::FiberMutex::Lock lock(s_mutex);
+            s_ticks_when_locked = s_ticks.load();
+        });
+        iom.schedule([](){
+            for(int i = 0; i < 10; ++i) {
+                ++s_ticks;
+                usleep(1000);
+            }
+        });
+    }
+    SYLAR_LOG_INFO(g_logger) << "not blocking ticks when locked=" << s_ticks_when_locked;
+    SYLAR_ASSERT(s_ticks_when_locked == 10);
+}
+
+/// 生产者消费者
+void test_condition() {
+    static sylar::FiberMutex s_mutex;
+    static sylar::FiberCondition s_cond;
+    static std::deque<int> s_queue;
+    static bool s_done = false;
+    static std::atomic<int64_t> s_sum = {0};
+    const int consumers = 4;
+    const int items = 10000;
+    s_done = false;
+    s_sum = 0;
+    {
+        sylar::IOManager iom(2, false, "condition");
+        for(int i = 0; i < consumers; ++i) {
+            iom.schedule([](){
+                sylar::FiberMutex::Lock lock(s_mutex);
+                while(true) {
+                    while(s_queue.empty() && !s_done) {
+                        s_cond.wait(lock);
+                    }
+                    if(s_queue.empty()) {
+                        break;
+                    }
+                    s_sum += s_queue.front();
+                    s_queue.pop_front();
+                }
+            });
+        }
+        iom.schedule([items](){
+            for(int i = 1; i <= items; ++i) {
+                sylar::FiberMutex::Lock lock(s_mutex);
+                s_queue.push_back(i);
+                s_cond.notify();
+                if(i % 64 == 0) {
+                    lock.unlock();
+                    sylar::Fiber::YieldToReady();
+                }
+            }
+            sylar::FiberMutex::Lock lock(s_mutex);
+            s_done = true;
+            s_cond.notifyAll();
+        });
+    }
+    SYLAR_LOG_INFO(g_logger) << "condition sum=" << s_sum;
+    SYLAR_ASSERT(s_sum == (int64_t)items * (items + 1) / 2);
+}
+
+/// 信号量限制同时执行的协程数
+void test_semaphore() {
+    static sylar::FiberSemaphore s_sem(2);
+    static std::atomic<int> s_running = {0};
+    static std::atomic<int> s_max = {0};
+    static std::atomic<int> s_done = {0};
+    {
+        sylar::IOManager iom(2, false, "semaphore");
+        for(int i = 0; i < 10; ++i) {
+            iom.schedule([](){
+                s_sem.wait();
+                int running = ++s_running;
+                int old = s_max;
+                while(running > old && !s_max.compare_exchange_weak(old, running)) {
+                }
+                usleep(2000);
+                --s_running;
+                ++s_done;
+                s_sem.notify();
+            });
+        }
+    }
+    SYLAR_LOG_INFO(g_logger) << "semaphore max running=" << s_max << " done=" << s_done;
+    SYLAR_ASSERT(s_max == 2);
+    SYLAR_ASSERT(s_done == 10);
+    SYLAR_ASSERT(s_sem.tryWait() && s_sem.tryWait() && !s_sem.tryWait());
+    s_sem.notify();
+    s_sem.notify();
+}
+
+/// use_caller的调度器在stop()之前, main线程不在任务协程中, 等待时阻塞线程
+void test_use_caller() {
+    static sylar::FiberSemaphore s_sem;
+    static sylar::FiberMutex s_mutex;
+    static sylar::FiberCondition s_cond;
+    static std::atomic<bool> s_locked = {false};
+    static bool s_ready = false;
+    sylar::IOManager iom(2, true, "caller");
+
+    iom.schedule([](){
+        usleep(10 * 1000);
+        s_sem.notify();
+    });
+    s_sem.wait();
+
+    iom.schedule([](){
+        s_mutex.lock();
+        s_locked = true;
+        usleep(10 * 1000);
+        s_mutex.unlock();
+    });
+    while(!s_locked) {
+        usleep(1000);
+    }
+    s_mutex.lock();
+
+    iom.schedule([](){
+        sylar::FiberMutex::Lock lock(s_mutex);
+        s_ready = true;
+        s_cond.notify();
+    });
+    while(!s_ready) {
+        s_cond.wait(s_mutex);
+    }
+    s_mutex.unlock();
+
+    sylar::WaitGroup wg;
+    static std::atomic<int> s_done = {0};
+    for(int i = 0; i < 3; ++i) {
+        wg.add();
+        iom.schedule([&wg](){
+            usleep(5 * 1000);
+            ++s_done;
+            wg.done();
+        });
+    }
+    wg.wait();
+    SYLAR_ASSERT(s_done == 3);
+    iom.stop();
+    SYLAR_LOG_INFO(g_logger) << "use caller ok";
+}
+
+int main(int argc, char** argv) {
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    test_mutex();
+    test_not_blocking();
+    test_condition();
+    test_semaphore();
+    test_use_caller();
+    // 共享栈模式下被唤醒的协程要回到它绑定的线程上执行
+    sylar::Config::Lookup<bool>("scheduler.shared_stack")->setValue(true);
+    test_mutex();
+    test_condition();
+    return 0;
+}
@@ -0,0 +1,221 @@
+#include "../sylar/sylar.h"
+#include "../sylar/iomanager.h"
+#include "../sylar/future.h"
+#include "../sylar/fiber_mutex.h"
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+/// 模拟一次上游请求
+static int Upstream(int i, int ms) {
+    usleep(ms * 1000);
+    return i * i;
+}
+
+/// 同时派发, 总耗时接近最慢的一个
+void test_when_all() {
+    const int n = 10;
+    static uint64_t s_used = 0;
+    static int64_t s_sum = 0;
+    {
+        sylar::IOManager iom(2, false, "when_all");
+        iom.schedule([n](){
+            sylar::IOManager* iom = sylar::IOManager::GetThis();
+            uint64_t begin = sylar::GetMonotonicMS();
+            std::vector<sylar::Future<int> > futures;
+            for(int i = 0; i < n; ++i) {
+                futures.push_back(sylar::Async(iom, [i](){ return Upstream(i, 20 + i * 2);}));
+            }
+            std::vector<int> values = sylar::WhenAll(futures).get();
+            s_used = sylar::GetMonotonicMS() - begin;
+            SYLAR_ASSERT((int)values.size() == n);
+            for(int i = 0; i < n; ++i) {
+                SYLAR_ASSERT(values[i] == i * i);
+                SYLAR_ASSERT(futures[i].isReady());
+                s_sum += values[i];
+            }
+            SYLAR_ASSERT(sylar::WhenAll(std::vector<sylar::Future<int> >()).get().empty());
+        });
+    }
+    SYLAR_LOG_INFO(g_logger) << "when_all sum=" << s_sum << " used=" << s_used << "ms";
+    SYLAR_ASSERT(s_sum == 285);
+    // 串行需要200ms + 90ms
+    SYLAR_ASSERT(s_used < 150);
+}
+
+void test_when_any() {
+    static size_t s_index = 100;
+    {
+        sylar::IOManager iom(1, false, "when_any");
+        iom.schedule([](){
+            sylar::IOManager* iom = sylar::IOManager::GetThis();
+            std::vector<sylar::Future<int> > futures;
+            futures.push_back(sylar::Async(iom, [](){ return Upstream(1, 60);}));
+            futures.push_back(sylar::Async(iom, [](){ return Upstream(2, 10);}));
+            futures.push_back(sylar::Async(iom, [](){ return Upstream(3, 40);}));
+            s_index = sylar::WhenAny(futures).get();
+            SYLAR_ASSERT(futures[1].get() == 4);
+        });
+    }
+    SYLAR_LOG_INFO(g_logger) << "when_any index=" << s_index;
+    SYLAR_ASSERT(s_index == 1);
+}
+
+void test_promise() {
+    {
+        sylar::IOManager iom(2, false, "promise");
+        iom.schedule([](){
+            sylar::Promise<std::string> promise;
+            sylar::Future<std::string> future = promise.getFuture();
+            SYLAR_ASSERT(future.valid() && !future.isReady());
+            // 超时
+            uint64_t begin = sylar::GetMonotonicMS();
+            SYLAR_ASSERT(!future.wait(20));
+            SYLAR_ASSERT(sylar::GetMonotonicMS() - begin >= 20);
+            SYLAR_ASSERT(!future.wait(0));
+
+            sylar::IOManager::GetThis()->addTimer(10, [promise]() mutable {
+                SYLAR_ASSERT(promise.setValue("hello"));
+                SYLAR_ASSERT(!promise.setValue("again"));
+            });
+            SYLAR_ASSERT(future.wait(1000));
+            SYLAR_ASSERT(future.get() == "hello");
+        });
+    }
+    // 不在调度器中时阻塞线程等待
+    sylar::IOManager iom(1, false, "outside");
+    sylar::Future<int> future = sylar::Async(&iom, [](){ return Upstream(7, 10);});
+    SYLAR_ASSERT(future.get() == 49);
+    // use_caller的调度器在stop()之前, main线程也是阻塞等待
+    {
+        sylar::IOManager caller(2, true, "caller");
+        sylar::Future<int> future = sylar::Async(&caller, [](){ return Upstream(8, 10);});
+        SYLAR_ASSERT(future.get() == 64);
+    }
+    SYLAR_LOG_INFO(g_logger) << "promise ok";
+}
+
+/// 超时的等待删除自己的回调, 反复等待一个迟迟没有结果的Future不会积累回调
+void test_wait_timeout() {
+    static sylar::Promise<int> s_promise;
+    static std::weak_ptr<sylar::Fiber> s_fiber;
+    static int s_timeouts = 0;
+    {
+        sylar::IOManager iom(1, false, "wait_timeout");
+        iom.schedule([](){
+            s_fiber = sylar::Fiber::GetThis();
+            sylar::Future<int> future = s_promise.getFuture();
+            for(int i = 0; i < 100; ++i) {
+                if(!future.wait(1)) {
+                    ++s_timeouts;
+                }
+            }
+        });
+    }
+    // 回调没有删除时, 结果的状态还持有等待过的协程
+    SYLAR_ASSERT(s_fiber.expired());
+    SYLAR_ASSERT(s_timeouts == 100);
+
+    sylar::Future<int> future = s_promise.getFuture();
+    int called = 0;
+    uint64_t id = future.onReady([&called](){ ++called;});
+    SYLAR_ASSERT(id && future.removeCallback(id));
+    SYLAR_ASSERT(!future.removeCallback(id));
+    s_promise.setValue(1);
+    SYLAR_ASSERT(called == 0);
+    SYLAR_ASSERT(future.onReady([&called](){ ++called;}) == 0 && called == 1);
+    SYLAR_LOG_INFO(g_logger) << "wait timeout ok";
+}
+
+/// 异常和没有设置结果的Promise都会唤醒等待者, 在get()中抛出
+void test_exception() {
+    static int s_caught = 0;
+    static std::atomic<int> s_void = {0};
+    {
+        sylar::IOManager iom(2, false, "exception");
+        iom.schedule([](){
+            sylar::IOManager* iom = sylar::IOManager::GetThis();
+            sylar::Future<int> bad = sylar::Async(iom, []() -> int {
+                throw std::runtime_error("upstream failed");
+            });
+            try {
+                bad.get();
+            } catch (std::runtime_error& e) {
+                SYLAR_ASSERT(std::string(e.what()) == "upstream failed");
+                ++s_caught;
+            }
+
+            // 一个失败的请求不会让WhenAll一直等待
+            std::vector<sylar::Future<int> > futures;
+            futures.push_back(sylar::Async(iom, [](){ return Upstream(1, 10);}));
+            futures.push_back(sylar::Async(iom, []() -> int {
+                usleep(5 * 1000);
+                throw std::runtime_error("second failed");
+            }));
+            futures.push_back(sylar::Async(iom, [](){ return Upstream(3, 20);}));
+            try {
+                sylar::WhenAll(futures).get();
+            } catch (std::runtime_error& e) {
+                SYLAR_ASSERT(std::string(e.what()) == "second failed");
+                ++s_caught;
+            }
+            SYLAR_ASSERT(futures[0].get() == 1 && futures[2].get() == 9);
+
+            // 所有Promise析构了还没有结果
+            sylar::Future<std::string> broken;
+            {
+                sylar::Promise<std::string> promise;
+                broken = promise.getFuture();
+                sylar::Promise<std::string> copy(promise);
+                sylar::Promise<std::string> moved(std::move(copy));
+            }
+            try {
+                broken.get();
+            } catch (std::future_error& e) {
+                SYLAR_ASSERT(e.code() == std::future_errc::broken_promise);
+                ++s_caught;
+            }
+
+            // 没有返回值的func
+            SYLAR_ASSERT(sylar::Async(iom, [](){ ++s_void;}).get());
+        });
+    }
+    SYLAR_LOG_INFO(g_logger) << "exception caught=" << s_caught;
+    SYLAR_ASSERT(s_caught == 3);
+    SYLAR_ASSERT(s_void == 1);
+}
+
+void test_wait_group() {
+    static std::atomic<int> s_done = {0};
+    static bool s_all_done = false;
+    {
+        sylar::IOManager iom(2, false, "wait_group");
+        iom.schedule([](){
+            sylar::IOManager* iom = sylar::IOManager::GetThis();
+            std::shared_ptr<sylar::WaitGroup> wg(new sylar::WaitGroup);
+            for(int i = 0; i < 20; ++i) {
+                wg->add();
+                iom->schedule([wg, i](){
+                    usleep((i % 5) * 1000);
+                    ++s_done;
+                    wg->done();
+                });
+            }
+            wg->wait();
+            s_all_done = s_done == 20;
+            wg->wait();     // 已经归零, 直接返回
+        });
+    }
+    SYLAR_LOG_INFO(g_logger) << "wait_group done=" << s_done;
+    SYLAR_ASSERT(s_all_done);
+}
+
+int main(int argc, char** argv) {
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    test_when_all();
+    test_when_any();
+    test_promise();
+    test_wait_timeout();
+    test_exception();
+    test_wait_group();
+    return 0;
+}
@@ -1,14 +1,39 @@
 #include "../sylar/hook.h"
 #include "../sylar/log.h"
 #include "../sylar/iomanager.h"
+#include "../sylar/fd_manager.h"
+#include "../sylar/macro.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
 
 sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
 
+/// 统计operator new的调用次数
+static std::atomic<uint64_t> s_alloc_count = {0};
+
+void* operator new(size_t size) {
+    ++s_alloc_count;
+    void* p = malloc(size ? size : 1);
+    if(!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
 void test_sleep() {
     sylar::IOManager iom(1);
     iom.schedule([](){
@@ -64,7 +89,75 @@ void test_sock() {
 
 }
 
+/// 带超时的阻塞读在稳定状态下不应该有内存分配
+void test_timeout_alloc() {
+    const int warmup = 100;
+    const int rounds = 10000;
+    uint64_t allocs = 0;
+    {
+        sylar::IOManager iom(1, true, "alloc");
+        int fds[2];
+        SYLAR_ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        // socketpair没有hook, 手动登记
+        sylar::FdMgr::GetInstance()->get(fds[0], true);
+        sylar::FdMgr::GetInstance()->get(fds[1], true);
+
+        iom.schedule([fds](){
+            timeval tv = {5, 0};
+            setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            char c = 0;
+            while(read(fds[0], &c, 1) == 1 && write(fds[0], &c, 1) == 1) {
+            }
+        });
+        iom.schedule([fds, &allocs, warmup, rounds](){
+            timeval tv = {5, 0};
+            setsockopt(fds[1], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            char c = 'x';
+            uint64_t begin = 0;
+            for(int i = 0; i < warmup + rounds; ++i) {
+                if(i == warmup) {
+                    begin = s_alloc_count;
+                }
+                SYLAR_ASSERT(write(fds[1], &c, 1) == 1);
+                SYLAR_ASSERT(read(fds[1], &c, 1) == 1);
+            }
+            allocs = s_alloc_count - begin;
+            close(fds[1]);
+            close(fds[0]);
+        });
+    }
+    SYLAR_LOG_INFO(g_logger) << "test_timeout_alloc rounds=" << rounds
+        << " allocs=" << allocs;
+    SYLAR_ASSERT(allocs == 0);
+
+    // 超时仍然生效
+    {
+        sylar::IOManager iom(1, true, "timeout");
+        int fds[2];
+        SYLAR_ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        sylar::FdMgr::GetInstance()->get(fds[0], true);
+        sylar::FdMgr::GetInstance()->get(fds[1], true);
+        iom.schedule([fds](){
+            timeval tv = {0, 50 * 1000};
+            setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            char c = 0;
+            for(int i = 0; i < 3; ++i) {
+                uint64_t begin = sylar::GetCurrentMS();
+                SYLAR_ASSERT(read(fds[0], &c, 1) == -1 && errno == ETIMEDOUT);
+                SYLAR_ASSERT(sylar::GetCurrentMS() - begin >= 50);
+            }
+            // 超时之后数据到达仍然可以读到
+            SYLAR_ASSERT(write(fds[1], "y", 1) == 1);
+            SYLAR_ASSERT(read(fds[0], &c, 1) == 1 && c == 'y');
+            close(fds[1]);
+            close(fds[0]);
+        });
+    }
+    SYLAR_LOG_INFO(g_logger) << "test_timeout_alloc timeout ok";
+}
+
 int main(int argc, char** argv) {
+    test_timeout_alloc();
     //test_sleep();
     sylar::IOManager iom;
     iom.schedule(test_sock);
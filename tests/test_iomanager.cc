@@ -1,10 +1,13 @@
 #include "../sylar/sylar.h"
 #include "../sylar/iomanager.h"
+#include "../sylar/fd_manager.h"
+#include "../sylar/future.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <sched.h>
 #include <fcntl.h>
 #include <iostream>
 #include <sys/epoll.h>
@@ -61,9 +64,317 @@ void test_timer() {
     }, true);
 }
 
+void test_tickle() {
+    // 唤醒合并: 未处理的唤醒不超过空闲线程数, 所有线程都在忙时不再发送唤醒
+    static std::atomic<int> s_count = {0};
+    static std::atomic<int> s_running = {0};
+    static std::atomic<bool> s_release = {false};
+    const int workers = 4;
+    const int burst = 1000;
+    sylar::IOManager iom(workers, false, "tickle");
+    for(int round = 1; round <= 3; ++round) {
+        // 等所有线程进入idle
+        usleep(50 * 1000);
+        uint64_t sent = iom.getTickleSentCount();
+        uint64_t suppressed = iom.getTickleSuppressedCount();
+        s_running = 0;
+        s_release = false;
+        // 逐个占住工作线程, 任务不让出(sched_yield没有hook)
+        for(int i = 0; i < workers; ++i) {
+            iom.schedule([](){
+                ++s_running;
+                while(!s_release) {
+                    sched_yield();
+                }
+                ++s_count;
+            });
+            while(s_running <= i) {
+                usleep(100);
+            }
+        }
+        // 没有空闲线程, 唤醒全部被合并
+        for(int i = 0; i < burst; ++i) {
+            iom.schedule([](){ ++s_count; });
+        }
+        s_release = true;
+        while(s_count < round * (burst + workers)) {
+            usleep(1000);
+        }
+        sent = iom.getTickleSentCount() - sent;
+        suppressed = iom.getTickleSuppressedCount() - suppressed;
+        SYLAR_LOG_INFO(g_logger) << "round=" << round << " tickle sent=" << sent
+            << " suppressed=" << suppressed;
+        SYLAR_ASSERT(sent <= (uint64_t)workers);
+        SYLAR_ASSERT(suppressed > 0);
+    }
+    iom.stop();
+    SYLAR_ASSERT(s_count == 3 * (burst + workers));
+}
+
+void test_shard() {
+    // 分片模式: fd的事件在注册它的线程上触发, 协程恢复后仍在原来的线程
+    static std::atomic<int> s_count = {0};
+    sylar::Config::Lookup<bool>("iomanager.shard_per_thread")->setValue(true);
+    {
+        sylar::IOManager iom(3, false, "shard");
+        SYLAR_ASSERT(iom.isSharded());
+        for(int i = 0; i < 100; ++i) {
+            int fds[2];
+            socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+            fcntl(fds[0], F_SETFL, O_NONBLOCK);
+            iom.schedule([fds](){
+                int tid = sylar::GetThreadId();
+                sylar::IOManager::GetThis()->addEvent(fds[0], sylar::IOManager::READ);
+                sylar::Fiber::YieldToHold();
+                SYLAR_ASSERT(tid == sylar::GetThreadId());
+                char c = 0;
+                SYLAR_ASSERT(read(fds[0], &c, 1) == 1);
+                ++s_count;
+                close(fds[0]);
+            });
+            iom.addTimer(10, [fds](){
+                SYLAR_ASSERT(write(fds[1], "x", 1) == 1);
+                close(fds[1]);
+            });
+        }
+    }
+    sylar::Config::Lookup<bool>("iomanager.shard_per_thread")->setValue(false);
+    SYLAR_LOG_INFO(g_logger) << "shard count=" << s_count;
+    SYLAR_ASSERT(s_count == 100);
+}
+
+void test_persistent() {
+    // 持久注册: 一问一答100次, 每个fd只在第一次等待时注册, 关闭时删除
+    static std::atomic<int> s_count = {0};
+    sylar::Config::Lookup<bool>("iomanager.persistent_epoll")->setValue(true);
+    uint64_t ctl_count = 0;
+    {
+        sylar::IOManager iom(2, false, "persistent");
+        SYLAR_ASSERT(iom.isPersistent());
+        int fds[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        // 登记后read/write才会走hook
+        sylar::FdMgr::GetInstance()->get(fds[0], true);
+        sylar::FdMgr::GetInstance()->get(fds[1], true);
+        iom.schedule([fds](){
+            char c = 0;
+            while(read(fds[0], &c, 1) == 1) {
+                SYLAR_ASSERT(write(fds[0], &c, 1) == 1);
+            }
+            close(fds[0]);
+        });
+        iom.schedule([fds](){
+            for(int i = 0; i < 100; ++i) {
+                char c = 'x';
+                SYLAR_ASSERT(write(fds[1], &c, 1) == 1);
+                SYLAR_ASSERT(read(fds[1], &c, 1) == 1);
+                ++s_count;
+            }
+            close(fds[1]);
+        });
+        iom.stop();
+        ctl_count = iom.getEpollCtlCount();
+    }
+    sylar::Config::Lookup<bool>("iomanager.persistent_epoll")->setValue(false);
+    SYLAR_LOG_INFO(g_logger) << "persistent count=" << s_count
+        << " epoll_ctl=" << ctl_count;
+    SYLAR_ASSERT(s_count == 100);
+    SYLAR_ASSERT(ctl_count <= 4);
+}
+
+void test_persistent_close() {
+    // 持久注册: fd在另一个IOManager中关闭, 复用这个fd号时要重新注册
+    sylar::Config::Lookup<bool>("iomanager.persistent_epoll")->setValue(true);
+    ssize_t rt = 0;
+    {
+        sylar::IOManager iom(1, false, "persistent");
+        sylar::IOManager closer(1, false, "closer");
+        int fds[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        sylar::FdMgr::GetInstance()->get(fds[0], true);
+        sylar::FdMgr::GetInstance()->get(fds[1], true);
+        // 在iom中等待一次, fd注册到iom的epoll
+        sylar::Future<ssize_t> first = sylar::Async(&iom, [fds](){
+            char c = 0;
+            return read(fds[0], &c, 1);
+        });
+        usleep(10 * 1000);
+        SYLAR_ASSERT(write(fds[1], "x", 1) == 1);
+        SYLAR_ASSERT(first.get() == 1);
+        sylar::Async(&closer, [fds](){
+            close(fds[0]);
+            close(fds[1]);
+        }).get();
+
+        int fds2[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds2);
+        SYLAR_ASSERT(fds2[0] == fds[0]);
+        sylar::FdMgr::GetInstance()->get(fds2[0], true)->setTimeout(SO_RCVTIMEO, 1000);
+        sylar::FdMgr::GetInstance()->get(fds2[1], true);
+        sylar::Future<ssize_t> second = sylar::Async(&iom, [fds2](){
+            char c = 0;
+            return read(fds2[0], &c, 1);
+        });
+        usleep(10 * 1000);
+        SYLAR_ASSERT(write(fds2[1], "y", 1) == 1);
+        // 没有重新注册时等到超时返回-1
+        rt = second.get();
+        close(fds2[0]);
+        close(fds2[1]);
+    }
+    sylar::Config::Lookup<bool>("iomanager.persistent_epoll")->setValue(false);
+    SYLAR_LOG_INFO(g_logger) << "persistent close read=" << rt;
+    SYLAR_ASSERT(rt == 1);
+}
+
+void test_fd_table() {
+    // fd分布在不同的段上, 段在第一次addEvent时创建
+    static std::atomic<int> s_count = {0};
+    {
+        sylar::IOManager iom(2, false, "fdtable");
+        for(int fd : {300, 600, 900}) {
+            int fds[2];
+            socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+            SYLAR_ASSERT(dup2(fds[0], fd) == fd);
+            close(fds[0]);
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            iom.schedule([fd, fds](){
+                sylar::IOManager::GetThis()->addEvent(fd, sylar::IOManager::READ, [fd](){
+                    char c = 0;
+                    SYLAR_ASSERT(read(fd, &c, 1) == 1);
+                    ++s_count;
+                    close(fd);
+                });
+                SYLAR_ASSERT(write(fds[1], "x", 1) == 1);
+                close(fds[1]);
+            });
+        }
+        SYLAR_ASSERT(iom.addEvent(-1, sylar::IOManager::READ) == -1);
+        SYLAR_ASSERT(!iom.cancelAll(1 << 30));
+    }
+    SYLAR_LOG_INFO(g_logger) << "fd table count=" << s_count;
+    SYLAR_ASSERT(s_count == 3);
+}
+
+void test_timer_heap() {
+    // 取消的定时器不会触发; 墓碑超过一半时重建堆
+    static std::atomic<int> s_fired = {0};
+    static std::atomic<int> s_recurring = {0};
+    {
+        sylar::IOManager iom(1, false, "timer");
+        std::vector<sylar::Timer::ptr> timers;
+        for(int i = 0; i < 300; ++i) {
+            timers.push_back(iom.addTimer(5 + i % 50, [i](){
+                SYLAR_ASSERT(i % 3 == 0);
+                ++s_fired;
+            }));
+        }
+        for(int i = 0; i < 300; ++i) {
+            if(i % 3) {
+                SYLAR_ASSERT(timers[i]->cancel());
+                SYLAR_ASSERT(!timers[i]->cancel());
+            }
+        }
+        SYLAR_ASSERT(timers[0]->refresh());
+        SYLAR_ASSERT(timers[3]->reset(100, true));
+        static sylar::Timer::ptr s_rtimer;
+        s_rtimer = iom.addTimer(10, [](){
+            if(++s_recurring == 3) {
+                s_rtimer->cancel();
+            }
+        }, true);
+    }
+    SYLAR_LOG_INFO(g_logger) << "timer heap fired=" << s_fired << " recurring=" << s_recurring;
+    SYLAR_ASSERT(s_fired == 100);
+    SYLAR_ASSERT(s_recurring == 3);
+}
+
+void test_timer_wheel() {
+    // 时间轮: 不会提前触发, 最多推迟一个刻度; 超过一圈的定时器经过级联后触发
+    static std::atomic<int> s_fired = {0};
+    static std::atomic<int> s_recurring = {0};
+    sylar::Config::Lookup<uint64_t>("timer.wheel_threshold")->setValue(1000);
+    {
+        sylar::IOManager iom(1, false, "wheel");
+        uint64_t tick = sylar::Config::Lookup<uint32_t>("timer.wheel_tick")->getValue();
+        std::vector<sylar::Timer::ptr> timers;
+        for(int i = 0; i < 200; ++i) {
+            uint64_t ms = 5 + i * 7;
+            uint64_t deadline = sylar::GetMonotonicUS() + ms * 1000;
+            timers.push_back(iom.addTimer(ms, [i, deadline, tick](){
+                uint64_t now = sylar::GetMonotonicUS();
+                SYLAR_ASSERT(i % 2 == 0);
+                SYLAR_ASSERT(now >= deadline);
+                SYLAR_ASSERT(now <= deadline + (tick + 50) * 1000);
+                ++s_fired;
+            }, false, sylar::TimerManager::COARSE));
+        }
+        for(int i = 1; i < 200; i += 2) {
+            SYLAR_ASSERT(timers[i]->cancel());
+            SYLAR_ASSERT(!timers[i]->cancel());
+        }
+        // 超过timer.wheel_threshold的定时器自动进入时间轮
+        sylar::Timer::ptr idle = iom.addTimer(120 * 1000, [](){
+            SYLAR_ASSERT(false);
+        });
+        SYLAR_ASSERT(idle->refresh());
+        SYLAR_ASSERT(idle->reset(60 * 1000, true));
+        SYLAR_ASSERT(idle->cancel());
+        static sylar::Timer::ptr s_rtimer;
+        s_rtimer = iom.addTimer(30, [](){
+            if(++s_recurring == 3) {
+                s_rtimer->cancel();
+            }
+        }, true, sylar::TimerManager::COARSE);
+    }
+    sylar::Config::Lookup<uint64_t>("timer.wheel_threshold")->setValue(0);
+    SYLAR_LOG_INFO(g_logger) << "timer wheel fired=" << s_fired << " recurring=" << s_recurring;
+    SYLAR_ASSERT(s_fired == 100);
+    SYLAR_ASSERT(s_recurring == 3);
+}
+
+void test_timer_us() {
+    // 微秒级定时器不会提前触发; 不足1毫秒的usleep不会变成0毫秒的忙等
+    static std::atomic<int> s_fired = {0};
+    static uint64_t s_slept = 0;
+    const int rounds = 100;
+    const uint64_t sleep_us = 200;
+    {
+        sylar::IOManager iom(1, false, "timer_us");
+        for(int i = 0; i < 10; ++i) {
+            uint64_t us = 100 + i * 50;
+            uint64_t deadline = sylar::GetMonotonicUS() + us;
+            iom.addTimerUs(us, [deadline](){
+                SYLAR_ASSERT(sylar::GetMonotonicUS() >= deadline);
+                ++s_fired;
+            });
+        }
+        iom.schedule([rounds, sleep_us](){
+            uint64_t begin = sylar::GetMonotonicUS();
+            for(int i = 0; i < rounds; ++i) {
+                uint64_t start = sylar::GetMonotonicUS();
+                usleep(sleep_us);
+                SYLAR_ASSERT(sylar::GetMonotonicUS() - start >= sleep_us);
+            }
+            s_slept = sylar::GetMonotonicUS() - begin;
+        });
+    }
+    SYLAR_LOG_INFO(g_logger) << "timer us fired=" << s_fired << " usleep(" << sleep_us
+        << ") avg=" << s_slept / rounds << "us";
+    SYLAR_ASSERT(s_fired == 10);
+}
+
 int main() {
 
     // test1();
+    test_tickle();
+    test_shard();
+    test_persistent();
+    test_persistent_close();
+    test_fd_table();
+    test_timer_heap();
+    test_timer_wheel();
+    test_timer_us();
     test_timer();
     return 0;
 }
\ No newline at end of file
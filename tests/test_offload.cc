@@ -0,0 +1,190 @@
+#include "../sylar/sylar.h"
+#include "../sylar/iomanager.h"
+#include "../sylar/offload.h"
+#include "../sylar/hook.h"
+#include "../sylar/address.h"
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+/// 阻塞操作在线程池中执行, 同一线程上的其他协程照常运行
+void test_offload() {
+    static int s_result = 0;
+    static int s_ticks_when_done = -1;
+    static bool s_same_thread = false;
+    static std::atomic<int> s_ticks = {0};
+    static std::atomic<int> s_void = {0};
+    s_ticks = 0;
+    s_void = 0;
+    {
+        sylar::IOManager iom(1, false, "offload");
+        iom.schedule([](){
+            pid_t tid = sylar::GetThreadId();
+            s_result = sylar::Offload([](){
+                // 线程池中没有hook, 真正阻塞线程
+                SYLAR_ASSERT(!sylar::is_hook_enable());
+                usleep(50 * 1000);
+                return 42;
+            });
+            s_ticks_when_done = s_ticks;
+            s_same_thread = tid == sylar::GetThreadId();
+            sylar::Offload([](){
+                ++s_void;
+            });
+        });
+        iom.schedule([](){
+            for(int i = 0; i < 10; ++i) {
+                ++s_ticks;
+                usleep(1000);
+            }
+        });
+    }
+    SYLAR_LOG_INFO(g_logger) << "offload result=" << s_result
+        << " ticks when done=" << s_ticks_when_done;
+    SYLAR_ASSERT(s_result == 42);
+    SYLAR_ASSERT(s_ticks_when_done == 10);
+    SYLAR_ASSERT(s_same_thread);
+    SYLAR_ASSERT(s_void == 1);
+    // 不在调度器中时直接执行
+    SYLAR_ASSERT(sylar::Offload([](){ return sylar::GetThreadId();}) == sylar::GetThreadId());
+}
+
+/**
+ * @brief 打开offload.file_io后, hook的open和文件读写交给线程池
+ * @details 共享栈模式下读写的buf可能在协程栈上, 只有open交给线程池
+ */
+void test_file_io() {
+    static std::string s_read;
+    static bool s_shared = false;
+    static int s_errno = 0;
+    static uint64_t s_tasks = 0;
+    sylar::Config::Lookup<bool>("offload.file_io")->setValue(true);
+    {
+        sylar::IOManager iom(1, false, "file_io");
+        iom.schedule([](){
+            const char* path = "/tmp/sylar_test_offload";
+            s_shared = sylar::Scheduler::GetThis()->isSharedStack();
+            uint64_t before = sylar::OffloadPool::GetDefault()->getTaskCount();
+            int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+            SYLAR_ASSERT(fd >= 0);
+            const char msg[] = "hello offload";
+            SYLAR_ASSERT(write(fd, msg, sizeof(msg) - 1) == sizeof(msg) - 1);
+            char buf[64];
+            SYLAR_ASSERT(read(fd, buf, sizeof(buf)) == -1);
+            s_errno = errno;
+            close(fd);
+
+            fd = open(path, O_RDONLY);
+            SYLAR_ASSERT(fd >= 0);
+            ssize_t n = read(fd, buf, sizeof(buf));
+            SYLAR_ASSERT(n > 0);
+            s_read.assign(buf, n);
+            close(fd);
+            unlink(path);
+
+            SYLAR_ASSERT(open("/nonexistent/sylar_test_offload", O_RDONLY) == -1);
+            SYLAR_ASSERT(errno == ENOENT);
+            s_tasks = sylar::OffloadPool::GetDefault()->getTaskCount() - before;
+        });
+    }
+    sylar::Config::Lookup<bool>("offload.file_io")->setValue(false);
+    SYLAR_LOG_INFO(g_logger) << "file io read=" << s_read << " errno=" << s_errno
+        << " tasks=" << s_tasks << " shared_stack=" << s_shared;
+    SYLAR_ASSERT(s_read == "hello offload");
+    SYLAR_ASSERT(s_errno == EBADF);
+    // 3次open, 3次read/write
+    SYLAR_ASSERT(s_tasks == (s_shared ? 3u : 6u));
+}
+
+/// 打开offload.getaddrinfo后Address::Lookup交给线程池
+void test_lookup() {
+    static std::string s_addr;
+    static uint64_t s_tasks = 0;
+    sylar::Config::Lookup<bool>("offload.getaddrinfo")->setValue(true);
+    {
+        sylar::IOManager iom(1, false, "lookup");
+        iom.schedule([](){
+            uint64_t before = sylar::OffloadPool::GetDefault()->getTaskCount();
+            sylar::Address::ptr addr = sylar::Address::LookupAny("127.0.0.1:8080");
+            SYLAR_ASSERT(addr);
+            s_addr = addr->toString();
+            SYLAR_ASSERT(!sylar::Address::LookupAny("[::1"));
+            s_tasks = sylar::OffloadPool::GetDefault()->getTaskCount() - before;
+        });
+    }
+    sylar::Config::Lookup<bool>("offload.getaddrinfo")->setValue(false);
+    SYLAR_LOG_INFO(g_logger) << "lookup addr=" << s_addr << " tasks=" << s_tasks;
+    SYLAR_ASSERT(s_addr == "127.0.0.1:8080");
+    SYLAR_ASSERT(s_tasks == 2);
+}
+
+/// use_caller的调度器在stop()之前, main线程不在任务协程中, 直接执行
+void test_use_caller() {
+    sylar::Config::Lookup<bool>("offload.getaddrinfo")->setValue(true);
+    sylar::IOManager iom(1, true, "caller");
+    uint64_t before = sylar::OffloadPool::GetDefault()->getTaskCount();
+    SYLAR_ASSERT(sylar::Offload([](){ return 42;}) == 42);
+    SYLAR_ASSERT(sylar::Address::LookupAny("127.0.0.1:80"));
+    SYLAR_ASSERT(sylar::OffloadPool::GetDefault()->getTaskCount() == before);
+    sylar::Config::Lookup<bool>("offload.getaddrinfo")->setValue(false);
+    // stop之后caller线程的任务协程仍然交给线程池
+    static int s_result = 0;
+    iom.schedule([](){
+        s_result = sylar::Offload([](){ return 7;});
+    });
+    iom.stop();
+    SYLAR_ASSERT(s_result == 7);
+    SYLAR_ASSERT(sylar::OffloadPool::GetDefault()->getTaskCount() == before + 1);
+    SYLAR_LOG_INFO(g_logger) << "use caller ok";
+}
+
+/// func抛出的异常回到调用的协程, 调度器照常停止
+void test_exception() {
+    static int s_caught = 0;
+    s_caught = 0;
+    {
+        sylar::IOManager iom(1, false, "exception");
+        iom.schedule([](){
+            try {
+                sylar::Offload([]() -> int {
+                    throw std::runtime_error("bad yaml");
+                });
+            } catch (std::runtime_error& e) {
+                SYLAR_ASSERT(std::string(e.what()) == "bad yaml");
+                ++s_caught;
+            }
+            try {
+                sylar::Offload([](){
+                    throw std::invalid_argument("void");
+                });
+            } catch (std::invalid_argument& e) {
+                ++s_caught;
+            }
+            SYLAR_ASSERT(sylar::Offload([](){ return 1;}) == 1);
+        });
+    }
+    // 直接执行时也是抛给调用者
+    try {
+        sylar::Offload([]() -> int {
+            throw std::runtime_error("inline");
+        });
+    } catch (std::runtime_error& e) {
+        ++s_caught;
+    }
+    SYLAR_LOG_INFO(g_logger) << "exception caught=" << s_caught;
+    SYLAR_ASSERT(s_caught == 3);
+}
+
+int main(int argc, char** argv) {
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    test_offload();
+    test_file_io();
+    test_lookup();
+    test_use_caller();
+    test_exception();
+    // 共享栈模式下协程要回到它绑定的线程上
+    sylar::Config::Lookup<bool>("scheduler.shared_stack")->setValue(true);
+    test_offload();
+    test_file_io();
+    test_exception();
+    return 0;
+}
@@ -12,14 +12,134 @@ void test_fiber() {
     }
 }
 
-int main(int argc, char** argv) {
-    SYLAR_LOG_INFO(g_logger) << "main";
-    sylar::Scheduler sc(3, false, "test");
+static std::atomic<int> s_done = {0};
+
+void test_work_stealing() {
+    // 工作窃取模式: 任务在工作线程中投递, 由其他线程窃取执行
+    sylar::Config::Lookup<bool>("scheduler.work_stealing")->setValue(true);
+    sylar::Scheduler sc(4, false, "steal");
+    SYLAR_ASSERT(sc.isWorkStealing());
+    sc.start();
+    sc.schedule([&sc](){
+        for(int i = 0; i < 1000; ++i) {
+            sc.schedule([](){
+                ++s_done;
+                if(s_done % 100 == 0) {
+                    sylar::Fiber::YieldToReady();
+                }
+            });
+        }
+    });
+    sc.stop();
+    SYLAR_LOG_INFO(g_logger) << "work stealing done=" << s_done;
+    SYLAR_ASSERT(s_done == 1000);
+    sylar::Config::Lookup<bool>("scheduler.work_stealing")->setValue(false);
+}
+
+void test_pinned() {
+    // 指定线程的任务进入目标线程的收件箱, 只会在该线程上执行
+    static std::atomic<int> s_pinned = {0};
+    sylar::Scheduler sc(3, false, "pinned");
+    sc.start();
+    sc.schedule([&sc](){
+        int tid = sylar::GetThreadId();
+        for(int i = 0; i < 100; ++i) {
+            sc.schedule([tid](){
+                SYLAR_ASSERT(sylar::GetThreadId() == tid);
+                ++s_pinned;
+            }, tid);
+        }
+    });
+    sc.stop();
+    SYLAR_LOG_INFO(g_logger) << "pinned done=" << s_pinned;
+    SYLAR_ASSERT(s_pinned == 100);
+}
+
+void test_batch() {
+    // 批量投递: 一次加锁投递整批任务, 投递后容器中的任务被取走
+    static std::atomic<int> s_batch = {0};
+    sylar::Scheduler sc(3, false, "batch");
     sc.start();
-    sleep(2);
-    SYLAR_LOG_INFO(g_logger) << "schedule";
-    sc.schedule(&test_fiber);   // 任务可以在任意一个线程中的任意协程中运行
+    std::vector<std::function<void()> > cbs;
+    for(int i = 0; i < 500; ++i) {
+        cbs.push_back([](){ ++s_batch; });
+    }
+    sc.scheduleBatch(cbs.begin(), cbs.end());
+    for(auto& i : cbs) {
+        SYLAR_ASSERT(!i);
+    }
+
+    std::vector<sylar::Fiber::ptr> fibers;
+    for(int i = 0; i < 500; ++i) {
+        fibers.push_back(sylar::Fiber::ptr(new sylar::Fiber([](){
+            ++s_batch;
+            sylar::Fiber::YieldToReady();
+            ++s_batch;
+        })));
+    }
+    sc.scheduleBatch(fibers.begin(), fibers.end());
     sc.stop();
+    SYLAR_LOG_INFO(g_logger) << "batch done=" << s_batch;
+    SYLAR_ASSERT(s_batch == 1500);
+}
+
+void test_shared_stack() {
+    // 共享栈: 任务协程切出时复制栈内容, 恢复后栈上的数据和指向栈的指针仍然有效
+    static std::atomic<int> s_shared = {0};
+    static std::atomic<uint64_t> s_saved = {0};
+    sylar::Config::Lookup<bool>("scheduler.shared_stack")->setValue(true);
+    sylar::Config::Lookup<bool>("scheduler.work_stealing")->setValue(true);
+    {
+        sylar::Scheduler sc(3, false, "shared");
+        sc.start();
+        sc.schedule([&sc](){
+            for(int i = 0; i < 200; ++i) {
+                sc.schedule([i](){
+                    int tid = sylar::GetThreadId();
+                    int data[256];
+                    for(int j = 0; j < 256; ++j) {
+                        data[j] = i * 1000 + j;
+                    }
+                    int* p = &data[i % 256];
+                    for(int n = 0; n < 10; ++n) {
+                        sylar::Fiber::YieldToReady();
+                        SYLAR_ASSERT(sylar::GetThreadId() == tid);
+                        SYLAR_ASSERT(*p == i * 1000 + i % 256);
+                        uint64_t saved = sylar::Fiber::GetStackPoolStats().sharedSaved;
+                        if(saved > s_saved) {
+                            s_saved = saved;
+                        }
+                    }
+                    for(int j = 0; j < 256; ++j) {
+                        SYLAR_ASSERT(data[j] == i * 1000 + j);
+                    }
+                    ++s_shared;
+                });
+            }
+        });
+        sc.stop();
+        SYLAR_LOG_INFO(g_logger) << "shared stack=" << sc.isSharedStack()
+            << " done=" << s_shared << " max saved bytes=" << s_saved;
+    }
+    SYLAR_ASSERT(s_shared == 200);
+    sylar::Config::Lookup<bool>("scheduler.work_stealing")->setValue(false);
+    sylar::Config::Lookup<bool>("scheduler.shared_stack")->setValue(false);
+}
+
+int main(int argc, char** argv) {
+    SYLAR_LOG_INFO(g_logger) << "main";
+    test_work_stealing();
+    test_pinned();
+    test_batch();
+    test_shared_stack();
+    {
+        sylar::Scheduler sc(3, false, "test");
+        sc.start();
+        sleep(2);
+        SYLAR_LOG_INFO(g_logger) << "schedule";
+        sc.schedule(&test_fiber);   // 任务可以在任意一个线程中的任意协程中运行
+        sc.stop();
+    }
     SYLAR_LOG_INFO(g_logger) << "over";
     return 0;
-}
\ No newline at end of file
+}
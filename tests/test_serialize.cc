@@ -0,0 +1,190 @@
+#include "../sylar/sylar.h"
+#include "../sylar/serialize.h"
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+enum class Role : uint8_t {
+    GUEST = 1,
+    ADMIN = 2
+};
+
+struct Address {
+    Address() {}
+    Address(const std::string& c, uint32_t z) : city(c), zip(z) {}
+
+    std::string city;
+    uint32_t zip = 0;
+    SYLAR_SERIALIZE_FIELDS(city, zip)
+
+    bool operator==(const Address& rhs) const {
+        return city == rhs.city && zip == rhs.zip;
+    }
+};
+
+struct User {
+    uint64_t id = 0;
+    std::string name;
+    int32_t score = 0;
+    bool active = false;
+    double weight = 0;
+    Role role = Role::GUEST;
+    sylar::Optional<std::string> email;
+    sylar::Optional<Address> address;
+    std::vector<Address> history;
+    std::vector<uint64_t> friends;
+    std::map<std::string, int64_t> counters;
+    std::vector<bool> flags;
+    SYLAR_SERIALIZE_FIELDS(id, name, score, active, weight, role, email
+                           , address, history, friends, counters, flags)
+
+    bool operator==(const User& rhs) const {
+        return id == rhs.id && name == rhs.name && score == rhs.score
+            && active == rhs.active && weight == rhs.weight && role == rhs.role
+            && email == rhs.email && address == rhs.address && history == rhs.history
+            && friends == rhs.friends && counters == rhs.counters && flags == rhs.flags;
+    }
+};
+
+static User MakeUser(int i) {
+    User user;
+    user.id = 1ull << (i % 64);
+    user.name = "user_" + std::to_string(i);
+    user.score = i % 2 ? -i * 1000 : i;
+    user.active = i % 3 == 0;
+    user.weight = i * 0.5;
+    user.role = i % 2 ? Role::ADMIN : Role::GUEST;
+    if(i % 2) {
+        user.email.set(user.name + "@example.com");
+    }
+    if(i % 3) {
+        user.address.set(Address("city_" + std::to_string(i), (uint32_t)i * 7));
+    }
+    for(int j = 0; j < i % 5; ++j) {
+        user.history.push_back(Address("old_" + std::to_string(j), (uint32_t)j));
+        user.friends.push_back((uint64_t)j << (j * 9));
+        user.counters["c" + std::to_string(j)] = -j;
+        user.flags.push_back(j % 2);
+    }
+    return user;
+}
+
+/// 编码长度准确, 解码后和原值一致, 跨结点和连续多条消息
+void test_round_trip() {
+    for(size_t base : {1, 7, 64, 4096}) {
+        sylar::ByteArray::ptr ba(new sylar::ByteArray(base));
+        std::vector<User> users;
+        size_t total = 0;
+        for(int i = 0; i < 50; ++i) {
+            users.push_back(MakeUser(i));
+            size_t before = ba->getSize();
+            sylar::Serialize(*ba, users.back());
+            SYLAR_ASSERT(ba->getSize() - before == sylar::SerializeSize(users.back()));
+            total += sylar::SerializeSize(users.back());
+        }
+        SYLAR_ASSERT(ba->getSize() == total);
+        ba->setPosition(0);
+        for(auto& i : users) {
+            User user;
+            sylar::Deserialize(*ba, user);
+            SYLAR_ASSERT(user == i);
+        }
+        SYLAR_ASSERT(ba->getReadSize() == 0);
+    }
+    SYLAR_LOG_INFO(g_logger) << "round trip ok";
+}
+
+/// 编码格式和手写的逐字段序列化一致
+void test_format() {
+    Address addr("hangzhou", 310000);
+    sylar::Optional<Address> none;
+    sylar::ByteArray ba;
+    sylar::Serialize(ba, addr);
+    sylar::Serialize(ba, none);
+    sylar::Serialize(ba, std::vector<int32_t>{-1, 1});
+
+    sylar::ByteArray expect;
+    expect.writeStringVint("hangzhou");
+    expect.writeUint32(310000);
+    expect.writeFuint8(0);
+    expect.writeUint64(2);
+    expect.writeInt32(-1);
+    expect.writeInt32(1);
+    ba.setPosition(0);
+    expect.setPosition(0);
+    SYLAR_ASSERT(ba.toString() == expect.toString());
+    SYLAR_LOG_INFO(g_logger) << "format ok";
+}
+
+/// 数据不足时抛出异常
+void test_truncated() {
+    sylar::ByteArray full;
+    User user = MakeUser(7);
+    sylar::Serialize(full, user);
+    full.setPosition(0);
+    std::string data = full.toString();
+    for(size_t len = 0; len < data.size(); ++len) {
+        sylar::ByteArray ba;
+        ba.write(data.c_str(), len);
+        ba.setPosition(0);
+        bool thrown = false;
+        try {
+            User tmp;
+            sylar::Deserialize(ba, tmp);
+        } catch (std::out_of_range& e) {
+            thrown = true;
+        }
+        SYLAR_ASSERT(thrown);
+    }
+
+    // 损坏的元素个数
+    sylar::ByteArray ba;
+    ba.writeUint64(1ull << 40);
+    ba.setPosition(0);
+    std::vector<uint64_t> values;
+    bool thrown = false;
+    try {
+        sylar::Deserialize(ba, values);
+    } catch (std::out_of_range& e) {
+        thrown = true;
+    }
+    SYLAR_ASSERT(thrown);
+
+    // 损坏的字符串长度, 不能按这个长度分配
+    sylar::ByteArray sba;
+    sba.writeUint64(1ull << 62);
+    sba.writeFuint8('a');
+    sba.setPosition(0);
+    std::string str;
+    thrown = false;
+    try {
+        sylar::Deserialize(sba, str);
+    } catch (std::out_of_range& e) {
+        thrown = true;
+    }
+    SYLAR_ASSERT(thrown);
+    SYLAR_ASSERT(str.empty());
+
+    // 损坏的结构体个数, 预分配的内存不超过剩余的字节数
+    sylar::ByteArray uba;
+    uba.writeUint64(1ull << 40);
+    std::string zeros(4096, 0);
+    uba.write(zeros.c_str(), zeros.size());
+    uba.setPosition(0);
+    std::vector<User> users;
+    thrown = false;
+    try {
+        sylar::Deserialize(uba, users);
+    } catch (std::out_of_range& e) {
+        thrown = true;
+    }
+    SYLAR_ASSERT(thrown);
+    SYLAR_ASSERT(users.capacity() < zeros.size());
+    SYLAR_LOG_INFO(g_logger) << "truncated ok";
+}
+
+int main(int argc, char** argv) {
+    test_round_trip();
+    test_format();
+    test_truncated();
+    return 0;
+}